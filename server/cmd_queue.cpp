@@ -0,0 +1,147 @@
+#include <algorithm>
+#include "cmd_queue.h"
+#include "err/err.h"
+
+/*************************************************/
+ReqInfo::ReqInfo(const Opt & opts): ReqInfo() {
+  prio = opts.get("priority", 0);
+  if (opts.exists("deadline")){
+    double d = opts.get("deadline", 0.0);
+    if (d<0) throw Err() << "negative deadline: " << d;
+    deadline = clock_t::now() +
+      std::chrono::duration_cast<clock_t::duration>(
+        std::chrono::duration<double>(d));
+  }
+}
+
+/*************************************************/
+void
+CmdQueue::set_limits(const size_t max_queue_, const double max_wait_){
+  std::lock_guard<std::mutex> lk(m);
+  max_queue = max_queue_;
+  max_wait  = max_wait_;
+}
+
+void
+CmdQueue::set_slots(const int n){
+  std::lock_guard<std::mutex> lk(m);
+  slots = std::max(n, 1);
+  cv.notify_all();
+}
+
+double
+CmdQueue::retry_after() const{
+  return srv_time * (waiting.size() + 1) / slots;
+}
+
+CmdQueue::Lock
+CmdQueue::acquire(const ReqInfo & ri){
+  std::unique_lock<std::mutex> lk(m);
+
+  uint64_t id = next_ticket++;
+  auto t = std::make_pair(-ri.prio, id);
+
+  // replace a waiting request with the same key; take its place
+  // in the queue if it has the same priority
+  auto k = ri.key.size()? keyed.find(ri.key) : keyed.end();
+  if (k != keyed.end()){
+    superseded.insert(k->second.first);
+    waiting.erase(k->second.second);
+    if (k->second.second.first == t.first) t = k->second.second;
+    cv.notify_all();
+  }
+
+  // admission control
+  else if (max_queue>0 && waiting.size() >= max_queue){
+    ErrBusy e(retry_after());
+    e << "device is busy: too many requests in the queue";
+    throw e;
+  }
+  auto wait_end = ReqInfo::clock_t::time_point::max();
+  if (max_wait>0) wait_end = ReqInfo::clock_t::now() +
+      std::chrono::duration_cast<ReqInfo::clock_t::duration>(
+        std::chrono::duration<double>(max_wait));
+
+  waiting.insert(t);
+  if (ri.key.size()) keyed[ri.key] = std::make_pair(id, t);
+
+  // remove the request from the queue
+  auto leave = [&](){
+    waiting.erase(t);
+    auto k = keyed.find(ri.key);
+    if (k != keyed.end() && k->second.first == id) keyed.erase(k);
+    cv.notify_all(); // the first request could be changed
+  };
+
+  // wait until the device is free and we are first in the queue
+  while (1){
+
+    // our place in the queue is taken by a newer request
+    if (superseded.count(id)){
+      superseded.erase(id);
+      throw Err(ERR_SUPERSEDED) << "superseded by a newer request";
+    }
+
+    if (busy<slots && *waiting.begin() == t) break;
+
+    if (ri.alive && !ri.alive()){
+      leave();
+      throw Err(ERR_CANCELLED) << "request cancelled: client disconnected";
+    }
+
+    auto tw = std::min(ri.deadline, wait_end);
+    if (ri.alive) tw = std::min(tw, ReqInfo::clock_t::now() +
+                                    std::chrono::milliseconds(ALIVE_CHECK_MS));
+    if (tw == ReqInfo::clock_t::time_point::max()) {
+      cv.wait(lk);
+      continue;
+    }
+    cv.wait_until(lk, tw);
+    if (superseded.count(id)) continue;
+    if (ReqInfo::clock_t::now() >= ri.deadline &&
+        (busy>=slots || *waiting.begin() != t)){
+      leave();
+      throw Err(ERR_DEADLINE) << "deadline expired in the device queue";
+    }
+    if (ReqInfo::clock_t::now() >= wait_end &&
+        (busy>=slots || *waiting.begin() != t)){
+      leave();
+      ErrBusy e(retry_after());
+      e << "device is busy: waiting time exceeded";
+      throw e;
+    }
+  }
+
+  // do not start requests which are not needed anymore
+  leave();
+  if (ReqInfo::clock_t::now() > ri.deadline)
+    throw Err(ERR_DEADLINE) << "deadline expired in the device queue";
+  if (ri.alive && !ri.alive())
+    throw Err(ERR_CANCELLED) << "request cancelled: client disconnected";
+  busy++;
+  // next request can be started if there are free slots
+  if (busy<slots) cv.notify_all();
+  return Lock(this);
+}
+
+void
+CmdQueue::release(const std::chrono::steady_clock::time_point & start){
+  std::lock_guard<std::mutex> lk(m);
+  busy--;
+  double dt = std::chrono::duration<double>(
+    ReqInfo::clock_t::now() - start).count();
+  srv_time = srv_time>0 ? 0.8*srv_time + 0.2*dt : dt;
+  cv.notify_all();
+}
+
+size_t
+CmdQueue::size(){
+  std::lock_guard<std::mutex> lk(m);
+  return waiting.size();
+}
+
+double
+CmdQueue::get_srv_time(){
+  std::lock_guard<std::mutex> lk(m);
+  return srv_time;
+}
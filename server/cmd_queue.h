@@ -0,0 +1,138 @@
+#ifndef CMD_QUEUE_H
+#define CMD_QUEUE_H
+
+#include <set>
+#include <map>
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include "opt/opt.h"
+#include "err/err.h"
+
+// Error codes for requests which were not sent to the device
+#define ERR_DEADLINE  -2 // deadline expired
+#define ERR_CANCELLED -3 // client disconnected
+#define ERR_BUSY      -4 // device queue is full (see ErrBusy)
+#define ERR_BREAKER   -5 // device circuit breaker is open
+#define ERR_SUPERSEDED -7 // replaced by a newer request with the same key
+
+// period of checking client connection, ms
+#define ALIVE_CHECK_MS 100
+
+// Error for requests rejected because the device is busy.
+// Contains estimated time after which the request can be repeated.
+class ErrBusy: public Err {
+public:
+  double retry_after; // s
+  ErrBusy(const double t): Err(ERR_BUSY), retry_after(t) {}
+};
+
+/*************************************************/
+// Parameters of a request, set by GET arguments:
+// - priority=<n>  -- request priority, integer, higher is served first (default 0);
+// - deadline=<t>  -- time in seconds (from the request arrival); if the
+//                    device is not ready to process the request in this time
+//                    the request fails without talking to the device.
+
+struct ReqInfo {
+  typedef std::chrono::steady_clock clock_t;
+
+  int prio;
+  clock_t::time_point deadline;
+
+  // Function for checking that the client is still connected
+  // (if it is set). Requests of disconnected clients are removed from
+  // device queues.
+  std::function<bool()> alive;
+
+  // Coalescing key (set by the device for setter commands, empty
+  // for other requests). A waiting request is replaced by a newer one
+  // with the same key (see CmdQueue::acquire).
+  std::string key;
+
+  // Default parameters: priority 0, no deadline.
+  ReqInfo(): prio(0), deadline(clock_t::time_point::max()) {}
+
+  // Read parameters from GET arguments, throw Err on errors.
+  ReqInfo(const Opt & opts);
+};
+
+/*************************************************/
+// Queue for device commands. Only one request can be processed at a time
+// (or a few requests, for drivers which support it, see set_slots).
+// Waiting requests are served in order of priority, requests with equal
+// priority -- in order of arrival (each request gets a ticket number).
+// Number of waiting requests and waiting time can be limited, extra
+// requests are rejected with ErrBusy.
+
+class CmdQueue {
+  std::mutex m;
+  std::condition_variable cv;
+
+  // waiting requests: (-priority, ticket number)
+  typedef std::pair<int, uint64_t> ticket_t;
+  std::set<ticket_t> waiting;
+  uint64_t next_ticket;
+
+  // waiting requests with coalescing keys: key -> (request id, ticket);
+  // ids of requests replaced by newer ones
+  std::map<std::string, std::pair<uint64_t, ticket_t> > keyed;
+  std::set<uint64_t> superseded;
+  int busy;   // number of requests in processing
+  int slots;  // max number of requests in processing
+
+  size_t max_queue; // max number of waiting requests (0 - no limit)
+  double max_wait;  // max waiting time, s (0 - no limit)
+
+  // average service time, s (exponential moving average)
+  double srv_time;
+
+  void release(const std::chrono::steady_clock::time_point & start);
+
+  // estimated time until a new request can be processed, s
+  double retry_after() const;
+
+public:
+  CmdQueue(): next_ticket(0), busy(0), slots(1),
+              max_queue(0), max_wait(0), srv_time(0) {}
+
+  // Set limits: max number of waiting requests, max waiting time (s).
+  // Zero means no limit.
+  void set_limits(const size_t max_queue, const double max_wait);
+
+  // Set max number of requests which can be processed simultaneously
+  // (default 1).
+  void set_slots(const int n);
+
+  // Lock object, releases the queue in destructor.
+  class Lock {
+    CmdQueue * q;
+    std::chrono::steady_clock::time_point start;
+  public:
+    Lock(CmdQueue * q): q(q), start(std::chrono::steady_clock::now()) {}
+    Lock(Lock && l): q(l.q), start(l.start) {l.q = NULL;}
+    Lock(const Lock &) = delete;
+    ~Lock(){ if (q) q->release(start); }
+  };
+
+  // Wait for the turn of the request. If deadline of the request
+  // is passed throw Err(ERR_DEADLINE), if client is disconnected
+  // throw Err(ERR_CANCELLED). If the queue is full or max_wait time
+  // is passed throw ErrBusy.
+  // If the request has a coalescing key, it replaces a waiting request
+  // with the same key (taking its place in the queue if priorities
+  // are same),
+  // the old request fails with Err(ERR_SUPERSEDED).
+  Lock acquire(const ReqInfo & ri);
+
+  // Number of waiting requests.
+  size_t size();
+
+  // Average service time, s.
+  double get_srv_time();
+};
+
+#endif
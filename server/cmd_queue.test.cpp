@@ -0,0 +1,249 @@
+///\cond HIDDEN (do not show this in Doxyden)
+
+#include "cmd_queue.h"
+#include "err/assert_err.h"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <unistd.h>
+#include <cmath>
+
+using namespace std;
+
+ReqInfo
+req(const int prio, const double deadline = -1){
+  Opt o;
+  o.put("priority", prio);
+  if (deadline>=0) o.put("deadline", deadline);
+  return ReqInfo(o);
+}
+
+int
+main(){
+  try{
+
+    // parameters
+    {
+      Opt o;
+      o.put("priority", "a");
+      assert_err(ReqInfo r(o), "can't parse value: \"a\"");
+      o.put("priority", 1);
+      o.put("deadline", -1);
+      assert_err(ReqInfo r(o), "negative deadline: -1");
+    }
+
+    // order: priority, then FIFO
+    {
+      CmdQueue q;
+      std::mutex m;
+      std::vector<int> order;
+      std::vector<std::thread> thr;
+      {
+        auto lk = q.acquire(ReqInfo());
+        int n = 0;
+        for (int p: {0, 0, 5, 1, 5}){
+          thr.push_back(std::thread([&q, &m, &order, p, n](){
+            auto lk = q.acquire(req(p));
+            std::lock_guard<std::mutex> l(m);
+            order.push_back(n);
+          }));
+          n++;
+          usleep(20000);
+        }
+        assert_eq(q.size(), 5);
+      }
+      for (auto & t: thr) t.join();
+      assert_eq(order == std::vector<int>({2,4,3,0,1}), true);
+      assert_eq(q.size(), 0);
+    }
+
+    // deadline in the queue
+    {
+      CmdQueue q;
+      auto lk = q.acquire(ReqInfo());
+      assert_err(q.acquire(req(0, 0.05)),
+        "deadline expired in the device queue");
+      assert_eq(q.size(), 0);
+    }
+
+    // deadline expired before the request
+    {
+      CmdQueue q;
+      auto r = req(0, 0);
+      usleep(1000);
+      assert_err(q.acquire(r), "deadline expired in the device queue");
+      // queue is free
+      auto lk = q.acquire(req(0, 1));
+    }
+
+    // expired request does not block others
+    {
+      CmdQueue q;
+      std::thread t;
+      {
+        auto lk = q.acquire(ReqInfo());
+        t = std::thread([&q](){
+          assert_err(q.acquire(req(10, 0.05)),
+            "deadline expired in the device queue");
+        });
+        usleep(100000);
+      }
+      t.join();
+      auto lk = q.acquire(req(0, 0.1));
+    }
+
+    // limits: queue size, waiting time, service time estimation
+    {
+      CmdQueue q;
+      q.set_limits(1, 0.1);
+      { auto lk = q.acquire(ReqInfo()); usleep(100000); }
+      assert_eq(fabs(q.get_srv_time()-0.1)<0.02, true);
+
+      std::thread t;
+      {
+        auto lk = q.acquire(ReqInfo());
+        t = std::thread([&q](){
+          try { q.acquire(ReqInfo()); throw Err() << "no error"; }
+          catch (ErrBusy & e){
+            assert_eq(e.code(), ERR_BUSY);
+            assert_eq(e.str(), "device is busy: waiting time exceeded");
+          }
+        });
+        usleep(20000);
+        try { q.acquire(ReqInfo()); throw Err() << "no error"; }
+        catch (ErrBusy & e){
+          assert_eq(e.str(), "device is busy: too many requests in the queue");
+          assert_eq(fabs(e.retry_after - 0.2)<0.04, true); // srv_time*(queue+1)
+        }
+        usleep(150000);
+      }
+      t.join();
+      assert_eq(q.size(), 0);
+    }
+
+    // client disconnected while waiting
+    {
+      CmdQueue q;
+      std::atomic<bool> conn(true);
+      std::thread t;
+      {
+        auto lk = q.acquire(ReqInfo());
+        t = std::thread([&q, &conn](){
+          auto r = req(0);
+          r.alive = [&conn](){return (bool)conn;};
+          try { q.acquire(r); throw Err() << "no error"; }
+          catch (Err & e){
+            assert_eq(e.code(), ERR_CANCELLED);
+            assert_eq(e.str(), "request cancelled: client disconnected");
+          }
+        });
+        usleep(50000);
+        assert_eq(q.size(), 1);
+        conn = false;
+        usleep(200000);
+        assert_eq(q.size(), 0);
+      }
+      t.join();
+    }
+
+    // coalescing: a waiting request is replaced by a newer one
+    // with the same key, the newer one takes its place in the queue
+    {
+      CmdQueue q;
+      std::mutex m;
+      std::vector<std::string> order, errs;
+      std::vector<std::thread> thr;
+      {
+        auto lk = q.acquire(ReqInfo());
+        int n = 0;
+        for (std::string k: {"F", "", "F", "A", "F"}){
+          thr.push_back(std::thread([&q, &m, &order, &errs, k, n](){
+            ReqInfo r;
+            r.key = k;
+            try {
+              auto lk = q.acquire(r);
+              std::lock_guard<std::mutex> l(m);
+              order.push_back(type_to_str(n));
+            }
+            catch (Err & e){
+              std::lock_guard<std::mutex> l(m);
+              errs.push_back(type_to_str(n) + ": " + e.str());
+            }
+          }));
+          n++;
+          usleep(20000);
+        }
+        assert_eq(q.size(), 3);
+      }
+      for (auto & t: thr) t.join();
+      assert_eq(order == std::vector<std::string>({"4","1","3"}), true);
+      assert_eq(errs == std::vector<std::string>({
+        "0: superseded by a newer request",
+        "2: superseded by a newer request"}), true);
+      assert_eq(q.size(), 0);
+    }
+
+    // coalescing: the newer request with a different priority
+    // does not take the place of the old one
+    {
+      CmdQueue q;
+      std::mutex m;
+      std::vector<std::string> order, errs;
+      std::vector<std::thread> thr;
+      {
+        auto lk = q.acquire(ReqInfo());
+        int n = 0;
+        for (std::string k: {"F", "", "F"}){
+          thr.push_back(std::thread([&q, &m, &order, &errs, k, n](){
+            ReqInfo r;
+            r.key = k;
+            r.prio = (n==0)? 1:0;
+            try {
+              auto lk = q.acquire(r);
+              std::lock_guard<std::mutex> l(m);
+              order.push_back(type_to_str(n));
+            }
+            catch (Err & e){
+              std::lock_guard<std::mutex> l(m);
+              errs.push_back(type_to_str(n) + ": " + e.str());
+            }
+          }));
+          n++;
+          usleep(20000);
+        }
+        assert_eq(q.size(), 2);
+      }
+      for (auto & t: thr) t.join();
+      assert_eq(order == std::vector<std::string>({"1","2"}), true);
+      assert_eq(errs == std::vector<std::string>({
+        "0: superseded by a newer request"}), true);
+    }
+
+    // a few requests in processing
+    {
+      CmdQueue q;
+      q.set_slots(2);
+      std::atomic<int> n(0), nmax(0);
+      std::vector<std::thread> thr;
+      for (int i=0; i<6; i++)
+        thr.push_back(std::thread([&q, &n, &nmax](){
+          auto lk = q.acquire(ReqInfo());
+          int v = ++n;
+          if (v>nmax) nmax = v;
+          usleep(50000);
+          n--;
+        }));
+      for (auto & t: thr) t.join();
+      assert_eq(nmax, 2);
+      assert_eq(q.size(), 0);
+    }
+
+  }
+  catch (Err e) {
+    std::cerr << "Error: " << e.str() << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+///\endcond
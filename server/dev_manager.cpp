@@ -3,6 +3,11 @@
 #include <fstream>
 #include <iomanip>
 #include <unistd.h>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <sys/time.h>
+#include <set>
 
 #include "err/err.h"
 #include "log/log.h"
@@ -11,7 +16,13 @@
 #include "dev_manager.h"
 
 /*************************************************/
-DevManager::DevManager(const std::string & devfile):devfile(devfile){
+const uint64_t DevManager::srv_conn = UINT64_MAX;
+
+DevManager::DevManager(const std::string & devfile, const Opt & defaults):
+    devfile(devfile), preopen_jobs(8),
+    n_asks(0), n_errors(0), n_cancelled(0), n_expired(0), n_rejected(0), n_broken(0), n_superseded(0){
+  for (auto const & p: Device::dev_pars)
+    if (defaults.exists(p)) dev_defaults.put(p, defaults.get(p));
   try {
     read_conf();
   }
@@ -20,6 +31,11 @@ DevManager::DevManager(const std::string & devfile):devfile(devfile){
   }
 }
 
+DevManager::~DevManager(){
+  std::lock_guard<std::mutex> lk(preopen_mutex);
+  if (preopen_thr.joinable()) preopen_thr.join();
+}
+
 
 /*************************************************/
 std::vector<std::string>
@@ -43,11 +59,34 @@ DevManager::conn_open(const uint64_t conn){
   set_conn_name(conn);
 }
 
+void
+DevManager::seq_close(const uint64_t conn){
+  std::map<std::string, std::shared_ptr<Sequence> > ss;
+  {
+    std::lock_guard<std::mutex> lk(seq_mutex);
+    if (seqs.count(conn)==0) return;
+    ss.swap(seqs[conn]);
+    seqs.erase(conn);
+  }
+  // sequences are stopped and destroyed here, without the lock
+}
+
 void
 DevManager::conn_close(const uint64_t conn){
+  // stop sequences, they could use devices
+  seq_close(conn);
+
   // go through all devices, close ones which are not needed
-  for (auto & d:devices) d.second.release(conn);
+  for (auto & d:devices) d.second->release(conn);
   conn_names.erase(conn);
+
+  // release devices on upstream servers
+  std::vector<std::shared_ptr<Upstream> > us;
+  {
+    auto lk = get_sh_lock();
+    for (auto const & u:upstreams) us.push_back(u.second);
+  }
+  for (auto & u:us) u->conn_close(conn);
 }
 
 void
@@ -72,21 +111,70 @@ DevManager::set_conn_name(const uint64_t conn,
 
 /*************************************************/
 std::string
-DevManager::run(const std::string & url, const Opt & opts, const uint64_t conn){
+DevManager::run(const std::string & url, const Opt & opts, const uint64_t conn,
+                const std::function<bool()> & alive){
   auto vs = parse_url(url);
   std::string act = vs[0];
   std::string arg = vs[1];
   std::string msg = vs[2];
 
+  // Requests to devices on upstream servers are forwarded there
+  // through a connection of this client, with its name
+  // (default names starting with # are not forwarded).
+  if (arg!="" && (act=="ask" || act=="use" || act=="release" ||
+      act=="lock" || act=="unlock" || act=="log_start" ||
+      act=="log_finish" || act=="log_get" || act=="info" || act=="check")){
+    std::shared_ptr<Upstream> u;
+    {
+      auto lk = get_sh_lock();
+      u = find_route(arg);
+    }
+    std::string cname;
+    if (u){
+      auto n = conn_names.find(conn);
+      if (n!=conn_names.end() && n->second.size() && n->second[0]!='#')
+        cname = n->second;
+    }
+    if (u && act=="ask"){
+      n_asks++;
+      try { return u->request(conn, cname, act, arg, msg, opts, alive); }
+      catch (Err & e){
+        n_errors++;
+        if (e.code() == ERR_CANCELLED) n_cancelled++;
+        if (e.code() == ERR_BUSY) n_rejected++;
+        throw;
+      }
+    }
+    if (u && act=="info")
+      return u->request(conn, cname, act, arg, msg, opts, alive) +
+        "Upstream server: " + u->status()[0] + "\n";
+    if (u) return u->request(conn, cname, act, arg, msg, opts, alive);
+  }
+
   // ask/<name>/<cmd> -- send a command to the device, get answer
+  // GET arguments: priority=<n>, deadline=<seconds>
   if (act == "ask") {
     if (arg=="")
       throw Err() << "device name expected: " << url;
-    auto lk = get_sh_lock();
-    if (devices.count(arg) == 0)
-      throw Err() << "unknown device: " << arg;
-    Device & d = devices.find(arg)->second;
-    return d.ask(conn, msg);
+    n_asks++;
+    try {
+      ReqInfo ri(opts);
+      ri.alive = alive;
+      auto lk = get_sh_lock();
+      if (devices.count(arg) == 0)
+        throw Err() << "unknown device: " << arg;
+      Device & d = *devices.find(arg)->second;
+      return d.ask(conn, msg, ri);
+    }
+    catch (Err & e){
+      n_errors++;
+      if (e.code() == ERR_CANCELLED) n_cancelled++;
+      if (e.code() == ERR_DEADLINE)  n_expired++;
+      if (e.code() == ERR_BUSY)      n_rejected++;
+      if (e.code() == ERR_BREAKER)   n_broken++;
+      if (e.code() == ERR_SUPERSEDED) n_superseded++;
+      throw;
+    }
   }
 
   // use/<name> -- notify server that device should be open
@@ -96,7 +184,7 @@ DevManager::run(const std::string & url, const Opt & opts, const uint64_t conn){
     auto lk = get_sh_lock();
     if (devices.count(arg) == 0)
       throw Err() << "unknown device: " << arg;
-    devices.find(arg)->second.use(conn);
+    devices.find(arg)->second->use(conn);
     return std::string();
   }
 
@@ -107,7 +195,7 @@ DevManager::run(const std::string & url, const Opt & opts, const uint64_t conn){
     auto lk = get_sh_lock();
     if (devices.count(arg) == 0)
       throw Err() << "unknown device: " << arg;
-    devices.find(arg)->second.release(conn);
+    devices.find(arg)->second->release(conn);
     return std::string();
   }
 
@@ -118,7 +206,7 @@ DevManager::run(const std::string & url, const Opt & opts, const uint64_t conn){
     auto lk = get_sh_lock();
     if (devices.count(arg) == 0)
       throw Err() << "unknown device: " << arg;
-    devices.find(arg)->second.lock(conn);
+    devices.find(arg)->second->lock(conn);
     return std::string();
   }
 
@@ -129,7 +217,7 @@ DevManager::run(const std::string & url, const Opt & opts, const uint64_t conn){
     auto lk = get_sh_lock();
     if (devices.count(arg) == 0)
       throw Err() << "unknown device: " << arg;
-    devices.find(arg)->second.unlock(conn);
+    devices.find(arg)->second->unlock(conn);
     return std::string();
   }
 
@@ -140,7 +228,7 @@ DevManager::run(const std::string & url, const Opt & opts, const uint64_t conn){
     auto lk = get_sh_lock();
     if (devices.count(arg) == 0)
       throw Err() << "unknown device: " << arg;
-    devices.find(arg)->second.log_start(conn);
+    devices.find(arg)->second->log_start(conn);
     return std::string();
   }
 
@@ -151,7 +239,7 @@ DevManager::run(const std::string & url, const Opt & opts, const uint64_t conn){
     auto lk = get_sh_lock();
     if (devices.count(arg) == 0)
       throw Err() << "unknown device: " << arg;
-    devices.find(arg)->second.log_finish(conn);
+    devices.find(arg)->second->log_finish(conn);
     return std::string();
   }
 
@@ -163,7 +251,7 @@ DevManager::run(const std::string & url, const Opt & opts, const uint64_t conn){
     auto lk = get_sh_lock();
     if (devices.count(arg) == 0)
       throw Err() << "unknown device: " << arg;
-    return devices.find(arg)->second.log_get(conn);
+    return devices.find(arg)->second->log_get(conn);
   }
 
   // info/<name> -- print device <name> information
@@ -173,16 +261,113 @@ DevManager::run(const std::string & url, const Opt & opts, const uint64_t conn){
     auto lk = get_sh_lock();
     if (devices.count(arg) == 0)
       throw Err() << "unknown device: " << arg;
-    return devices.find(arg)->second.print(conn);
+    return devices.find(arg)->second->print(conn);
   }
 
   // devices, list -- list all available devices
+  // (including routed devices on upstream servers)
   if (act == "devices" || act == "list") {
     if (arg!="")
       throw Err() << "unexpected argument: " << url;
+    std::set<std::string> names;
+    decltype(routes) rs;
+    {
+      auto lk = get_sh_lock();
+      for (auto const & d:devices) names.insert(d.first);
+      rs = routes;
+    }
+    for (auto const & r:rs){
+      auto pref = r.first.back()=='*';
+      auto pat = pref? r.first.substr(0, r.first.size()-1) : r.first;
+      for (auto const & d:r.second->devices())
+        if (pref? d.compare(0, pat.size(), pat)==0 : d==pat)
+          names.insert(d);
+    }
     std::string ret;
-    for (auto const & d:devices)
-      ret += d.first + "\n";
+    for (auto const & n:names)
+      ret += n + "\n";
+    return ret;
+  }
+
+  // upstreams -- print status of upstream servers
+  if (act == "upstreams") {
+    if (arg!="")
+      throw Err() << "unexpected argument: " << url;
+    std::vector<std::shared_ptr<Upstream> > us;
+    {
+      auto lk = get_sh_lock();
+      for (auto const & u:upstreams) us.push_back(u.second);
+    }
+    std::ostringstream s;
+    s << std::left << std::setw(12) << "upstream" << std::setw(24) << "address"
+      << std::setw(8) << "status" << std::right << std::setw(8) << "devices"
+      << "  error\n";
+    for (auto & u:us){
+      auto st = u->status();
+      s << std::left << std::setw(12) << st[0] << std::setw(24) << st[1]
+        << std::setw(8) << st[2] << std::right << std::setw(8) << st[3];
+      if (st[4]!="") s << "  " << st[4];
+      s << "\n";
+    }
+    return s.str();
+  }
+
+  // snapshot/<device>:<command> ... -- send commands to devices in parallel
+  // GET arguments (priority, deadline) are used for all commands
+  if (act == "snapshot") {
+    auto l = arg + (msg!=""? "/" + msg : "");
+    std::istringstream ss(l);
+    std::vector<std::string> items;
+    while (1){
+      auto vs = read_words(ss, NULL, false);
+      if (vs.empty()) break;
+      items.insert(items.end(), vs.begin(), vs.end());
+    }
+    return snapshot(items, opts, conn, alive);
+  }
+
+  // seq_start/<name>/<description> -- start a sequence of device commands
+  if (act == "seq_start") {
+    if (arg=="")
+      throw Err() << "sequence name expected: " << url;
+    std::lock_guard<std::mutex> lk(seq_mutex);
+    auto & ss = seqs[conn];
+    if (ss.count(arg) && ss[arg]->running())
+      throw Err() << "sequence is running: " << arg;
+    auto s = std::make_shared<Sequence>(msg, [this, conn](const std::string & dev,
+        const std::string & cmd, const std::function<bool()> & alive){
+      return run("ask/" + dev + "/" + cmd, Opt(), conn, alive); });
+    ss[arg] = s;
+    return std::string();
+  }
+
+  // seq_get/<name> -- get table lines added after the previous call
+  // seq_status/<name> -- get status of the sequence
+  // seq_stop/<name> -- stop the sequence
+  if (act == "seq_get" || act == "seq_status" || act == "seq_stop") {
+    if (arg=="")
+      throw Err() << "sequence name expected: " << url;
+    std::shared_ptr<Sequence> s;
+    {
+      std::lock_guard<std::mutex> lk(seq_mutex);
+      if (seqs.count(conn)==0 || seqs[conn].count(arg)==0)
+        throw Err() << "unknown sequence: " << arg;
+      s = seqs[conn][arg];
+    }
+    if (act == "seq_get") return s->get();
+    if (act == "seq_status") return s->status();
+    s->stop();
+    return std::string();
+  }
+
+  // seq_list -- list sequences of the connection with their status
+  if (act == "seq_list") {
+    if (arg!="")
+      throw Err() << "unexpected argument: " << url;
+    std::lock_guard<std::mutex> lk(seq_mutex);
+    std::string ret;
+    if (seqs.count(conn))
+      for (auto const & s: seqs[conn]) ret += s.first + " " + s.second->status();
     return ret;
   }
 
@@ -193,6 +378,31 @@ DevManager::run(const std::string & url, const Opt & opts, const uint64_t conn){
       type_to_str(devices.size()) + " devices";
   }
 
+  // check -- open all devices (or one device), print table with
+  // status and open time. Devices stay open.
+  if (act == "check"){
+    if (msg!="")
+      throw Err() << "unexpected argument: " << msg;
+    std::vector<std::string> names;
+    if (arg!="") names.push_back(arg);
+    return check(names, preopen_jobs);
+  }
+
+  // metrics -- print server counters
+  if (act == "metrics"){
+    if (arg!="")
+      throw Err() << "unexpected argument: " << url;
+    std::ostringstream s;
+    s << "asks "             << n_asks << "\n"
+      << "ask_errors "       << n_errors << "\n"
+      << "cancelled "        << n_cancelled << "\n"
+      << "deadline_expired " << n_expired << "\n"
+      << "rejected "         << n_rejected << "\n"
+      << "breaker_rejected " << n_broken << "\n"
+      << "superseded "       << n_superseded << "\n";
+    return s.str();
+  }
+
   // ping -- do nothing
   if (act == "ping"){
     return std::string();
@@ -237,8 +447,15 @@ DevManager::run(const std::string & url, const Opt & opts, const uint64_t conn){
   if (act == "release_all"){
     if (arg!="")
       throw Err() << "unexpected argument: " << arg;
-    for (auto & d:devices) d.second.release(conn);
+    seq_close(conn);
+    for (auto & d:devices) d.second->release(conn);
     set_conn_name(conn);
+    std::vector<std::shared_ptr<Upstream> > us;
+    {
+      auto lk = get_sh_lock();
+      for (auto const & u:upstreams) us.push_back(u.second);
+    }
+    for (auto & u:us) u->release_all(conn);
     return std::string();
   }
 
@@ -248,7 +465,9 @@ DevManager::run(const std::string & url, const Opt & opts, const uint64_t conn){
 /*************************************************/
 void
 DevManager::read_conf(){
-  std::map<std::string, Device> ret;
+  std::map<std::string, std::shared_ptr<Device> > ret;
+  std::map<std::string, std::shared_ptr<Upstream> > ups;
+  std::vector<std::pair<std::string, std::shared_ptr<Upstream> > > rts;
   int line_num[2] = {0,0};
   std::ifstream ff(devfile);
   if (!ff.good()) throw Err()
@@ -266,6 +485,21 @@ DevManager::read_conf(){
       std::string drv = vs[1];
       std::vector<std::string> args(vs.begin()+2, vs.end());
 
+      // route <upstream> <device or prefix*> ...
+      if (dev == "route"){
+        if (ups.count(drv) == 0) throw Err()
+          << "unknown upstream server: " << drv;
+        if (args.empty()) throw Err()
+          << "expected: route <upstream> <device name or prefix*> ...";
+        for (auto const & r:args){
+          if (r=="" || strcspn(r.c_str(), " \n\t/\\")!=r.size() ||
+              r.find('*')<r.size()-1) throw Err()
+            << "bad device name or prefix: " << r;
+          rts.push_back(std::make_pair(r, ups[drv]));
+        }
+        continue;
+      }
+
       if (dev=="")
         throw Err() << "empty device name";
 
@@ -283,6 +517,26 @@ DevManager::read_conf(){
         opt.put(vs[i].substr(1), vs[i+1]);
       }
 
+      // upstream <name> [-<parameter> <value>]
+      // keep the server (and its connections) if parameters are not changed
+      if (dev == "upstream"){
+        if (ups.count(drv)>0) throw Err()
+          << "duplicated upstream server: " << drv;
+        {
+          auto lk = get_sh_lock();
+          auto u = upstreams.find(drv);
+          if (u!=upstreams.end() && u->second->options() == opt)
+            ups[drv] = u->second;
+        }
+        if (ups.count(drv) == 0)
+          ups[drv] = std::make_shared<Upstream>(drv, opt);
+        continue;
+      }
+
+      // default values of device parameters
+      for (auto const & p: Device::dev_pars)
+        if (!opt.exists(p) && dev_defaults.exists(p)) opt.put(p, dev_defaults[p]);
+
       // do not allow empty devices
       if (dev == "") throw Err() << "empty device";
 
@@ -291,7 +545,7 @@ DevManager::read_conf(){
         << "duplicated device name: " << dev;
 
       // add device information
-      ret.emplace(dev, Device(dev,drv,opt));
+      ret.emplace(dev, std::make_shared<Device>(dev,drv,opt));
 
     }
   } catch (Err e){
@@ -300,8 +554,155 @@ DevManager::read_conf(){
   }
 
   Log(1) << ret.size() << " devices configured";
+  if (ups.size())
+    Log(1) << ups.size() << " upstream servers configured";
+
+  {
+    auto lk = get_lock();
+    devices = ret; // apply the configuration only if no errors have found.
+    upstreams.swap(ups);
+    routes.swap(rts);
+  }
+
+  // open devices in background (wait for the previous preopen)
+  if (preopen_list=="") return;
+  std::lock_guard<std::mutex> lk(preopen_mutex);
+  if (preopen_thr.joinable()) preopen_thr.join();
+  preopen_thr = std::thread(&DevManager::preopen, this);
+}
+
+std::shared_ptr<Upstream>
+DevManager::find_route(const std::string & dev){
+  if (devices.count(dev)) return std::shared_ptr<Upstream>();
+  for (auto const & r:routes){
+    if (r.first.back()=='*'){
+      if (dev.compare(0, r.first.size()-1, r.first, 0, r.first.size()-1)==0)
+        return r.second;
+    }
+    else if (dev == r.first) return r.second;
+  }
+  return std::shared_ptr<Upstream>();
+}
 
-  auto lk = get_lock();
-  devices = ret; // apply the configuration only if no errors have found.
+void
+DevManager::preopen(){
+  if (preopen_list=="") return;
+  std::vector<std::string> names;
+  if (preopen_list!="*"){
+    std::istringstream ss(preopen_list);
+    std::string n;
+    while (std::getline(ss, n, ',')) if (n!="") names.push_back(n);
+  }
+  try {
+    auto res = check(names, preopen_jobs); // do not hold Log lock here!
+    Log(1) << "Opening devices:\n" << res;
+  }
+  catch (Err & e) { Log(1) << "Can't open devices: " << e.str(); }
+}
+
+void
+DevManager::set_preopen(const std::string & list, const int jobs){
+  if (jobs<1) throw Err() << "number of parallel opens should be positive";
+  preopen_list = list;
+  preopen_jobs = jobs;
+  preopen();
+}
+
+/*************************************************/
+std::string
+DevManager::snapshot(const std::vector<std::string> & items, const Opt & opts,
+    const uint64_t conn, const std::function<bool()> & alive){
+
+  if (items.empty()) throw Err() << "<device>:<command> pairs expected";
+  // group requests by device
+  std::map<std::string, std::vector<size_t> > groups;
+  for (size_t i=0; i<items.size(); i++){
+    auto p = items[i].find(':');
+    if (p==0 || p==std::string::npos) throw Err()
+      << "<device>:<command> pair expected: " << items[i];
+    groups[items[i].substr(0,p)].push_back(i);
+  }
+
+  std::vector<struct timeval> t1(items.size()), t2(items.size());
+  std::vector<std::string> ans(items.size()), errs(items.size());
+  auto worker = [&](const std::vector<size_t> & ii){
+    for (auto i: ii){
+      auto p = items[i].find(':');
+      gettimeofday(&t1[i], NULL);
+      try { ans[i] = run("ask/" + items[i].substr(0,p) + "/" +
+                         items[i].substr(p+1), opts, conn, alive); }
+      catch (Err & e) { errs[i] = e.str(); }
+      gettimeofday(&t2[i], NULL);
+    }
+  };
+  std::vector<std::thread> thr;
+  for (auto const & g:groups)
+    thr.push_back(std::thread(worker, std::cref(g.second)));
+  for (auto & t:thr) t.join();
+
+  // print table
+  std::ostringstream s;
+  s << std::setfill('0');
+  for (size_t i=0; i<items.size(); i++){
+    auto & r = errs[i]==""? ans[i] : errs[i];
+    for (auto & c: r) if (c=='\n' || c=='\t' || c=='\r') c = ' ';
+    s << items[i]
+      << "\t" << t1[i].tv_sec << "." << std::setw(6) << t1[i].tv_usec
+      << "\t" << t2[i].tv_sec << "." << std::setw(6) << t2[i].tv_usec
+      << "\t" << (errs[i]==""? "ok":"error") << "\t" << r << "\n";
+  }
+  return s.str();
+}
+
+/*************************************************/
+std::string
+DevManager::check(const std::vector<std::string> & names_, const int jobs){
+  // take devices under the lock, open them without it
+  std::vector<std::string> names(names_);
+  std::vector<std::shared_ptr<Device> > devs;
+  {
+    auto lk = get_sh_lock();
+    if (names.empty())
+      for (auto const & d:devices) names.push_back(d.first);
+    for (auto const & n:names){
+      auto d = devices.find(n);
+      if (d == devices.end()) throw Err() << "unknown device: " << n;
+      devs.push_back(d->second);
+    }
+  }
+
+  // open devices in parallel
+  std::vector<double> times(names.size());
+  std::vector<std::string> errs(names.size());
+  std::atomic<size_t> next(0);
+  auto worker = [&](){
+    size_t i;
+    while ((i = next++) < names.size()){
+      struct timeval t1, t2;
+      gettimeofday(&t1, NULL);
+      try { devs[i]->use(srv_conn); }
+      catch (Err & e) { errs[i] = e.str(); }
+      gettimeofday(&t2, NULL);
+      times[i] = (t2.tv_sec-t1.tv_sec)*1e3 + (t2.tv_usec-t1.tv_usec)*1e-3;
+    }
+  };
+  std::vector<std::thread> thr;
+  for (int j=0; j<jobs && j<(int)names.size(); j++)
+    thr.push_back(std::thread(worker));
+  for (auto & t:thr) t.join();
+
+  // print table
+  std::ostringstream s;
+  s << std::left << std::setw(20) << "device" << std::setw(8) << "status"
+    << std::right << std::setw(10) << "time,ms" << "  error\n";
+  for (size_t i=0; i<names.size(); i++){
+    s << std::left << std::setw(20) << names[i]
+      << std::setw(8) << (errs[i]==""? "ok":"failed")
+      << std::right << std::fixed << std::setprecision(1)
+      << std::setw(10) << times[i];
+    if (errs[i]!="") s << "  " << errs[i];
+    s << "\n";
+  }
+  return s.str();
 }
 
@@ -9,17 +9,34 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <atomic>
+#include <functional>
 #include <shared_mutex> // C++14
+#include <mutex>
+#include <thread>
 
 #include "err/err.h"
 #include "log/log.h"
 #include "opt/opt.h"
 #include "device.h"
+#include "upstream.h"
+#include "sequence.h"
 
 class DevManager {
 
-  // All devices (from configuration file):
-  std::map<std::string, Device> devices;
+  // All devices (from configuration file). Shared pointers are
+  // used to open devices without holding the data lock (check):
+  // the configuration can be reloaded meanwhile.
+  std::map<std::string, std::shared_ptr<Device> > devices;
+
+  // Upstream servers and routes to them: device name or prefix
+  // (with `*` at the end), server (from configuration file).
+  std::map<std::string, std::shared_ptr<Upstream> > upstreams;
+  std::vector<std::pair<std::string, std::shared_ptr<Upstream> > > routes;
+
+  // Upstream server for a device which is not configured locally,
+  // NULL if there is no route. Should be called with the data lock.
+  std::shared_ptr<Upstream> find_route(const std::string & dev);
 
   // Mutex for locking data
   typedef std::shared_timed_mutex mutex_t;
@@ -38,10 +55,53 @@ class DevManager {
   // connection names
   std::map<uint64_t, std::string> conn_names;
 
+  // devices to be opened after reading configuration
+  // ("*" for all devices), max number of parallel opens
+  std::string preopen_list;
+  int preopen_jobs;
+
+  // open devices from preopen_list, write results to the log
+  void preopen();
+
+  // preopen after reloading configuration, in background
+  std::thread preopen_thr;
+  std::mutex preopen_mutex; // protects preopen_thr
+
+  // counters for the metrics action
+  std::atomic<uint64_t> n_asks;      // ask requests
+  std::atomic<uint64_t> n_errors;    // failed ask requests
+  std::atomic<uint64_t> n_cancelled; // requests cancelled because client disconnected
+  std::atomic<uint64_t> n_expired;   // requests with expired deadline
+  std::atomic<uint64_t> n_rejected;  // requests rejected because device is busy
+  std::atomic<uint64_t> n_broken;    // requests rejected by device circuit breakers
+  std::atomic<uint64_t> n_superseded; // setter commands replaced by newer ones
+
+  // default values of device parameters
+  Opt dev_defaults;
+
+  // sequences started by connections: conn -> name -> sequence
+  // (destroyed before other data: they use devices)
+  std::map<uint64_t, std::map<std::string, std::shared_ptr<Sequence> > > seqs;
+  std::mutex seq_mutex;
+
+  // stop and remove sequences of a connection
+  void seq_close(const uint64_t conn);
+
 public:
 
-  // Constructor. Reading configuration.
-  DevManager(const std::string & devfile);
+  // Reserved connection ID for devices opened by the server itself
+  // (preopen and check action). Devices used by this connection
+  // stay open until configuration is reloaded, but can be locked by
+  // a client (the server is not counted as a device user).
+  static const uint64_t srv_conn;
+
+  // Constructor. Reading configuration. Device parameters
+  // (see Device::dev_pars) from `defaults` are used as default
+  // values for all devices.
+  DevManager(const std::string & devfile, const Opt & defaults = Opt());
+
+  // Destructor: wait for background preopen.
+  ~DevManager();
 
   // number of devices (for tests)
   size_t size() const {return devices.size();}
@@ -63,12 +123,32 @@ public:
   // - act:  action (URL without arguments in GET request)
   // - opts: options (arguments from the url)
   // - conn: connection ID
-  std::string run(const std::string & act, const Opt & opts, const uint64_t conn);
+  // - alive: function for checking that the client is still connected (optional)
+  std::string run(const std::string & act, const Opt & opts, const uint64_t conn,
+                  const std::function<bool()> & alive = std::function<bool()>());
 
-  // Read configuration file, update `devices` map.
+  // Read configuration file, update `devices` map, open devices
+  // from the preopen list (in background, without blocking the reload).
   // Throw exception on errors.
   void read_conf();
 
+  // Set list of devices to be opened after reading configuration
+  // (comma-separated names or "*" for all devices) and maximum
+  // number of parallel opens. Open the devices if needed.
+  void set_preopen(const std::string & list, const int jobs);
+
+  // Open devices in parallel (at most `jobs` at a time) by srv_conn,
+  // return table with device name, status, open time and error message.
+  // If `names` is empty, all devices are opened.
+  std::string check(const std::vector<std::string> & names, const int jobs);
+
+  // Send commands to devices, one thread per device (commands to the same
+  // device are sent in the order of appearance). `items` contains
+  // <device>:<command> pairs. Return table with the pair, start and end
+  // time (unix seconds), status (`ok` or `error`), answer or error message.
+  std::string snapshot(const std::vector<std::string> & items, const Opt & opts,
+    const uint64_t conn, const std::function<bool()> & alive);
+
   // Read configunation from other file.
   // This is now used only in tests.
   void read_conf(const std::string & fname){
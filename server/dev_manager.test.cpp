@@ -3,6 +3,9 @@
 #include "dev_manager.h"
 #include "err/assert_err.h"
 #include <cassert>
+#include <sstream>
+#include <sys/time.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -91,9 +94,154 @@ main(){
       "bad configuration file test_data/e7.txt at line 3: "
       "duplicated device name: a");
 
+    // routes to upstream servers
+    assert_err(dm.read_conf("test_data/e8.txt"),
+      "bad configuration file test_data/e8.txt at line 2: "
+      "unknown upstream server: u2");
+
+    assert_err(dm.read_conf("test_data/e9.txt"),
+      "bad configuration file test_data/e9.txt at line 2: "
+      "bad device name or prefix: a*b");
+
     // error does not change configuration
     assert_eq(dm.size(), 2);
 
+    /********************************************/
+    // check action: parallel open
+    dm.read_conf("test_data/n4.txt");
+    assert_err(dm.run("check/x", Opt(), 1), "unknown device: x");
+    {
+      struct timeval t1, t2;
+      gettimeofday(&t1, NULL);
+      auto ret = dm.run("check", Opt(), 1);
+      gettimeofday(&t2, NULL);
+      double dt = (t2.tv_sec-t1.tv_sec) + (t2.tv_usec-t1.tv_usec)*1e-6;
+      assert_eq(dt<0.35, true); // three devices, 0.2s each
+      assert_eq(ret.substr(0,ret.find('\n')),
+        "device              status     time,ms  error");
+      assert_eq(ret.find("a                   ok") != std::string::npos, true);
+      assert_eq(ret.find("b                   ok") != std::string::npos, true);
+      assert_eq(ret.find("  no device\n") != std::string::npos, true);
+      // devices stay open
+      assert_eq(dm.run("info/a", Opt(), 1).find("Device is open") != std::string::npos, true);
+      assert_eq(dm.run("ask/a/x", Opt(), 1), "x");
+      // devices opened by the server do not prevent locking
+      dm.run("lock/a", Opt(), 1);
+      assert_err(dm.run("use/a", Opt(), 2), "device is locked");
+      dm.run("release/a", Opt(), 1);
+      assert_eq(dm.run("info/a", Opt(), 1).find("Device is open") != std::string::npos, true);
+      dm.run("lock/a", Opt(), 2);
+      dm.run("release_all", Opt(), 2);
+    }
+
+    // preopen with one job: sequential opening
+    {
+      dm.read_conf("test_data/n4.txt");
+      struct timeval t1, t2;
+      gettimeofday(&t1, NULL);
+      dm.set_preopen("a,b", 1);
+      gettimeofday(&t2, NULL);
+      double dt = (t2.tv_sec-t1.tv_sec) + (t2.tv_usec-t1.tv_usec)*1e-6;
+      assert_eq(dt>0.35, true);
+      assert_eq(dm.run("info/b", Opt(), 1).find("Device is open") != std::string::npos, true);
+      assert_eq(dm.run("info/c", Opt(), 1).find("Device is closed\n") != std::string::npos, true);
+      assert_err(dm.set_preopen("*", 0), "number of parallel opens should be positive");
+
+      // after reloading devices are opened in background
+      gettimeofday(&t1, NULL);
+      dm.run("reload", Opt(), 1);
+      gettimeofday(&t2, NULL);
+      dt = (t2.tv_sec-t1.tv_sec) + (t2.tv_usec-t1.tv_usec)*1e-6;
+      assert_eq(dt<0.1, true);
+      usleep(500000);
+      assert_eq(dm.run("info/b", Opt(), 1).find("Device is open") != std::string::npos, true);
+    }
+
+    /********************************************/
+    // default device parameters
+    {
+      Opt o;
+      o.put("max_queue", 1);
+      o.put("breaker_errors", -1);
+      DevManager dm("test_data/n2.txt", o); // error is not fatal
+      assert_eq(dm.size(), 0);
+      o.put("breaker_errors", 1);
+      DevManager dm1("test_data/n2.txt", o);
+      assert_eq(dm1.size(), 2);
+    }
+
+    /********************************************/
+    // metrics
+    {
+      DevManager dm("test_data/n2.txt");
+      assert_eq(dm.run("ask/a/x", Opt(), 1), "x");
+      assert_err(dm.run("ask/c/x", Opt(), 1), "unknown device: c");
+      assert_err(dm.run("ask/a/x", Opt(), 1, [](){return false;}),
+        "request cancelled: client disconnected");
+      Opt o;
+      o.put("deadline", 0);
+      assert_err(dm.run("ask/a/x", o, 1),
+        "deadline expired in the device queue");
+      assert_eq(dm.run("metrics", Opt(), 1),
+        "asks 4\nask_errors 3\ncancelled 1\ndeadline_expired 1\nrejected 0\nbreaker_rejected 0\nsuperseded 0\n");
+    }
+
+    /********************************************/
+    // snapshot: parallel requests to different devices
+    {
+      DevManager dm("test_data/dev2.txt");
+      assert_err(dm.run("snapshot", Opt(), 1), "<device>:<command> pairs expected");
+      assert_err(dm.run("snapshot/b:1 c", Opt(), 1), "<device>:<command> pair expected: c");
+      struct timeval t1, t2;
+      gettimeofday(&t1, NULL);
+      auto r = dm.run("snapshot/b:1 \"c:2 3\" a:x/y x:4", Opt(), 1);
+      gettimeofday(&t2, NULL);
+      double dt = (t2.tv_sec-t1.tv_sec) + (t2.tv_usec-t1.tv_usec)*1e-6;
+      assert_eq(dt < 0.35, true);
+      std::vector<std::string> ll;
+      std::istringstream ss(r);
+      std::string l;
+      while (std::getline(ss, l)) ll.push_back(l);
+      assert_eq(ll.size(), 4);
+      assert_eq(ll[0].substr(0,4), "b:1\t");
+      assert_eq(ll[0].substr(ll[0].size()-5), "\tok\t1");
+      assert_eq(ll[1].substr(ll[1].size()-7), "\tok\t2 3");
+      assert_eq(ll[2].substr(ll[2].size()-7), "\tok\tx/y");
+      assert_eq(ll[3].substr(ll[3].size()-24), "\terror\tunknown device: x");
+
+      // requests to the same device are sequential
+      gettimeofday(&t1, NULL);
+      dm.run("snapshot/b:1 b:2", Opt(), 1);
+      gettimeofday(&t2, NULL);
+      dt = (t2.tv_sec-t1.tv_sec) + (t2.tv_usec-t1.tv_usec)*1e-6;
+      assert_eq(dt > 0.4, true);
+    }
+
+    /********************************************/
+    // sequences
+    {
+      DevManager dm("test_data/n2.txt");
+      assert_err(dm.run("seq_get/s1", Opt(), 1), "unknown sequence: s1");
+      assert_err(dm.run("seq_start/s1/read a", Opt(), 1),
+        "sequence line 1: expected: read <device> <command>");
+      assert_err(dm.run("seq_get/s1", Opt(), 1), "unknown sequence: s1");
+      dm.run("seq_start/s1/list v 1 2\nread a x$v\nread a y/$v", Opt(), 1);
+      usleep(100000);
+      assert_eq(dm.run("seq_status/s1", Opt(), 1).substr(0,13), "finished 2/2 ");
+      auto t = dm.run("seq_get/s1", Opt(), 1);
+      assert_eq(t.find("\t2\tx2\ty/2\n") != std::string::npos, true);
+      assert_eq(dm.run("info/a", Opt(), 1).find("You are currently using") != std::string::npos, true);
+
+      // sequences belong to the connection, they are stopped on close
+      assert_err(dm.run("seq_get/s1", Opt(), 2), "unknown sequence: s1");
+      dm.run("seq_start/s2/loop i 1 100 1\nperiod 0.1\nread a $i", Opt(), 2);
+      assert_err(dm.run("seq_start/s2/read a x", Opt(), 2), "sequence is running: s2");
+      assert_eq(dm.run("seq_list", Opt(), 2).substr(0, 10), "s2 running");
+      dm.conn_close(2);
+      assert_eq(dm.run("seq_list", Opt(), 2), "");
+      assert_eq(dm.run("info/a", Opt(), 2).find("Number of users: 1\n") != std::string::npos, true);
+    }
+
   }
   catch (Err e) {
     std::cerr << "Error: " << e.str() << "\n";
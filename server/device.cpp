@@ -1,42 +1,135 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdint>
 #include <unistd.h>
 
 #include "err/err.h"
 #include "log/log.h"
 #include "read_words/read_words.h"
 #include "device.h"
+#include "dev_manager.h"
 
 /*************************************************/
+const std::vector<std::string> Device::dev_pars =
+  {"open_backoff", "max_queue", "max_wait", "breaker_errors", "breaker_probe",
+   "coalesce", "scpi_merge"};
+
 Device::Device( const std::string & dev_name,
         const std::string & drv_name,
         const Opt & drv_args):
+  state(CLOSED),
+  locked(false),
   dev_name(dev_name),
   drv_name(drv_name),
   drv_args(drv_args),
-  locked(false),
+  br_state(BR_CLOSED),
+  br_errors(0),
   max_log_size(1024) {
+
+  // extract device parameters
+  for (auto const & p: dev_pars){
+    if (!this->drv_args.exists(p)) continue;
+    dev_args[p] = this->drv_args[p];
+    this->drv_args.erase(p);
+  }
+  open_backoff = dev_args.get("open_backoff", 1.0);
+  breaker_errors = dev_args.get("breaker_errors", 0);
+  breaker_probe  = dev_args.get("breaker_probe", 5.0);
+  if (breaker_errors<0) throw Err()
+    << "-breaker_errors should be non-negative";
+  if (breaker_probe<0) throw Err()
+    << "-breaker_probe should be non-negative";
+  cmd_queue.set_limits(dev_args.get<size_t>("max_queue", 0),
+                       dev_args.get("max_wait", 0.0));
+
+  scpi_merge = dev_args.get<size_t>("scpi_merge", 0);
+  merge_seq = 1;
+
+  std::istringstream ss(dev_args.get("coalesce", ""));
+  std::string p;
+  while (std::getline(ss, p, ',')){
+    if (p=="") continue;
+    for (auto & c:p) c = toupper(c);
+    coalesce.push_back(p);
+  }
 }
 
 Device::Device(const Device & d){
   users = d.users;
   drv = d.drv;
+  state = d.state;
+  open_err = d.open_err;
+  open_fail_time = d.open_fail_time;
   dev_name = d.dev_name;
   drv_name = d.drv_name;
   drv_args = d.drv_args;
+  dev_args = d.dev_args;
+  open_backoff = d.open_backoff;
+  br_state = d.br_state;
+  br_errors = d.br_errors;
+  br_err = d.br_err;
+  br_time = d.br_time;
+  breaker_errors = d.breaker_errors;
+  breaker_probe = d.breaker_probe;
   locked = d.locked;
   max_log_size = d.max_log_size;
+  coalesce = d.coalesce;
+  scpi_merge = d.scpi_merge;
+  merge_seq = 1;
+  cmd_queue.set_limits(dev_args.get<size_t>("max_queue", 0),
+                       dev_args.get("max_wait", 0.0));
+}
+
+void
+Device::open(std::unique_lock<std::mutex> & lk, const uint64_t conn){
+  while (1){
+    if (state == OPEN) return;
+
+    // another connection is opening the device: wait for the result
+    if (state == OPENING) { open_cv.wait(lk); continue; }
+
+    // last open attempt failed recently
+    if (state == FAILED &&
+        std::chrono::steady_clock::now() - open_fail_time <
+        std::chrono::duration<double>(open_backoff))
+      throw Err() << open_err;
+
+    // open the device without locking data
+    state = OPENING;
+    lk.unlock();
+    std::shared_ptr<Driver> d;
+    std::string err;
+    try { d = Driver::create(drv_name, drv_args); }
+    catch (Err & e) { err = e.str(); }
+    lk.lock();
+
+    if (d) {
+      drv = d;
+      state = OPEN;
+      cmd_queue.set_slots(d->parallel());
+      Log(2) << "conn:" << conn << " open device: " << dev_name;
+    }
+    else {
+      state = FAILED;
+      open_err = err;
+      open_fail_time = std::chrono::steady_clock::now();
+      Log(2) << "conn:" << conn << " can't open device: " << dev_name << ": " << err;
+    }
+    open_cv.notify_all();
+    if (!d) throw Err() << err;
+  }
 }
 
 void
 Device::use(const uint64_t conn){
+  auto lk = get_data_lock();
   if (users.count(conn)>0) return; // device is opened and used by this connection
   if (locked) throw Err() << "device is locked";
-  auto lk = get_data_lock();
-  if (users.empty()) { // device needs to be opened
-    drv = Driver::create(drv_name, drv_args);
-    Log(2) << "conn:" << conn << " open device: " << dev_name;
-  }
+  open(lk, conn);
+  // device could be locked while we were waiting
+  if (locked) throw Err() << "device is locked";
   users.insert(conn);
 }
 
@@ -54,29 +147,55 @@ Device::release(const uint64_t conn){
   // if device is used by only this connection close it
   if (users.size()==1){
     drv.reset();
+    state = CLOSED;
     Log(2) << "conn:" << conn << " close device: " << dev_name;
   }
   if (locked) locked = false;
   users.erase(conn);
 }
 
+size_t
+Device::n_users() const {
+  return users.size() - users.count(DevManager::srv_conn);
+}
+
 void
 Device::lock(const uint64_t conn){
   // to lock the device we should be its only user.
-  if (users.count(conn)==0) use(conn);
+  use(conn);
+  std::shared_ptr<Driver> d;
+  {
+    auto lk = get_data_lock();
+    if (n_users()!=1)
+      throw Err() << "Can't lock the device: it is in use";
+    if (locked) return;
+    d = drv;
+  }
+
+  // lock the driver without locking device data:
+  // it can wait for running requests
+  if (d) d->lock(true);
   auto lk = get_data_lock();
-  if (users.size()!=1)
+  if (n_users()!=1){
+    lk.unlock();
+    if (d) d->lock(false);
     throw Err() << "Can't lock the device: it is in use";
+  }
   locked = true;
 }
 
 void
 Device::unlock(const uint64_t conn){
-  auto lk = get_data_lock();
-  if (!locked) return;
-  if (users.count(conn)==0)
-    throw Err() << "device is locked by another connection";
-  locked = false;
+  std::shared_ptr<Driver> d;
+  {
+    auto lk = get_data_lock();
+    if (!locked) return;
+    if (users.count(conn)==0)
+      throw Err() << "device is locked by another connection";
+    locked = false;
+    d = drv;
+  }
+  if (d) d->lock(false);
 }
 
 void
@@ -106,6 +225,7 @@ Device::log_get(const uint64_t conn){
 
 void
 Device::log_message(const std::string & pref, const std::string & msg){
+  auto lk = get_data_lock();
   if (log_bufs.size()==0) return;
   // make shared_ptr to share it between log buffers
   std::shared_ptr<std::string> s(new std::string);
@@ -117,29 +237,219 @@ Device::log_message(const std::string & pref, const std::string & msg){
   }
 }
 
-// Send message to the device, get answer
+void
+Device::breaker_check(bool & probe){
+  if (breaker_errors==0 || probe) return;
+  auto lk = get_data_lock();
+  if (br_state == BR_CLOSED) return;
+
+  // time to send a probe request
+  if (br_state == BR_OPEN &&
+      std::chrono::steady_clock::now() - br_time >=
+      std::chrono::duration<double>(breaker_probe)){
+    br_state = BR_PROBE;
+    probe = true;
+    return;
+  }
+  throw Err(ERR_BREAKER) << "device is not responding "
+    "(circuit breaker is open): " << br_err;
+}
+
+void
+Device::breaker_update(const bool ok, const bool probe, const std::string & err){
+  if (breaker_errors==0) return;
+  auto lk = get_data_lock();
+  if (ok){
+    if (br_state != BR_CLOSED)
+      Log(1) << "circuit breaker closed: " << dev_name;
+    br_state = BR_CLOSED;
+    br_errors = 0;
+    return;
+  }
+  br_errors++;
+  br_err = err;
+  if (probe || (br_state == BR_CLOSED && br_errors >= breaker_errors)){
+    br_state = BR_OPEN;
+    br_time = std::chrono::steady_clock::now();
+    Log(1) << "circuit breaker opened: " << dev_name << ": " << err;
+  }
+}
+
+void
+Device::merge_add(const std::string & msg, std::shared_ptr<MergeItem> & w,
+                  uint64_t & qseq, ReqInfo & ri){
+  if (scpi_merge==0 || msg.empty()) return;
+  auto lk = get_data_lock();
+  auto seq = merge_seq++;
+  // queries and long commands (which can not be merged) are
+  // registered to keep order of commands
+  if (msg.find('?') != std::string::npos || msg.size()>scpi_merge){
+    qseq = seq;
+    merge_queries.insert(seq);
+    return;
+  }
+  w.reset(new MergeItem(msg, seq));
+  merge_writes.push_back(w);
+  // stop waiting in the queue if the command is taken by another request
+  auto alive = ri.alive;
+  auto wp = w.get();
+  ri.alive = [wp, alive](){ return !wp->taken && (!alive || alive()); };
+}
+
+std::string
+Device::merge_take(const std::string & msg, std::shared_ptr<MergeItem> & w,
+    const uint64_t qseq, std::vector<std::shared_ptr<MergeItem> > & items,
+    const bool compound){
+  auto lk = get_data_lock();
+  merge_queries.erase(qseq);
+  if (w && w->taken) return std::string();
+
+  // earliest query which is still waiting
+  uint64_t qmin = merge_queries.empty()? UINT64_MAX : *merge_queries.begin();
+  size_t size = msg.size();
+  if (w){
+    w->taken = true;
+    items.push_back(w);
+    merge_writes.remove(w);
+  }
+  // the driver can not read answers of queries after other commands
+  if (qseq && !compound) return msg;
+  for (auto i = merge_writes.begin(); i != merge_writes.end();){
+    auto & x = *i;
+    // do not send commands before queries which arrived earlier
+    if (qseq ? x->seq > qseq || x->seq > qmin :
+               x->seq > w->seq && x->seq > qmin) break;
+    if (size + x->msg.size() + 2 > scpi_merge) break;
+    size += x->msg.size() + 2;
+    x->taken = true;
+    items.push_back(x);
+    i = merge_writes.erase(i);
+  }
+  std::sort(items.begin(), items.end(),
+    [](const std::shared_ptr<MergeItem> & a, const std::shared_ptr<MergeItem> & b){
+      return a->seq < b->seq; });
+
+  // compound message, commands start from the root of the command tree
+  std::string ret;
+  auto add = [&ret](const std::string & m){
+    if (ret.size()) ret += (m[0]==':' || m[0]=='*') ? ";" : ";:";
+    ret += m;
+  };
+  for (auto const & x: items) add(x->msg);
+  if (qseq) add(msg);
+  return ret;
+}
+
+void
+Device::merge_remove(std::shared_ptr<MergeItem> & w, const uint64_t qseq){
+  auto lk = get_data_lock();
+  merge_queries.erase(qseq);
+  if (w && !w->taken) merge_writes.remove(w);
+}
+
+void
+Device::merge_done(std::vector<std::shared_ptr<MergeItem> > & items,
+                   const Err * e){
+  {
+    auto lk = get_data_lock();
+    for (auto & x: items){
+      x->done = true;
+      if (e) { x->err = e->str(); x->code = e->code(); }
+    }
+  }
+  merge_cv.notify_all();
+}
+
 std::string
-Device::ask(const uint64_t conn, const std::string & msg){
+Device::merge_wait(std::shared_ptr<MergeItem> & w){
+  auto lk = get_data_lock();
+  merge_cv.wait(lk, [&w](){ return w->done; });
+  if (w->err.size() || w->code) throw Err(w->code) << w->err;
+  return std::string();
+}
 
-  // open device if needed
-  if (users.count(conn)==0) use(conn);
+// Send message to the device, get answer
+std::string
+Device::ask(const uint64_t conn, const std::string & msg, const ReqInfo & ri){
 
-  auto lk = get_cmd_lock();
+  // open device if needed, get the driver
+  use(conn);
+  ReqInfo r(ri);
+  r.key = coalesce_key(msg);
+  std::shared_ptr<Driver> d;
+  bool log;
+  {
+    auto lk = get_data_lock();
+    d = drv;
+    log = log_bufs.size()>0;
+  }
+  if (!d) throw Err() << "device is closed";
 
-  // if no logging is needed just return answer
-  if (log_bufs.size()==0) return drv->ask(msg);
+  // SCPI merging: our write-only command, arrival number of a query
+  std::shared_ptr<MergeItem> w;
+  uint64_t qseq = 0;
+  merge_add(msg, w, qseq, r);
 
-  // do all logging (message, answer, errors)
-  log_message(">> ", msg);
+  // Fail fast if the circuit breaker is open. Check it again
+  // after waiting in the queue: it could be opened meanwhile.
+  bool probe = false;
+  bool sent = false;
   try {
-    auto ret = drv->ask(msg);
-    log_message("<< ", ret);
-    return ret;
+    breaker_check(probe);
+    auto lk = get_cmd_lock(r);
+    breaker_check(probe);
+
+    std::vector<std::shared_ptr<MergeItem> > items;
+    auto m = (w || qseq) ? merge_take(msg, w, qseq, items, d->read_compound()) : msg;
+    if (m.size()){
+      sent = true;
+      if (log) log_message(">> ", m);
+      try {
+        auto ret = d->ask(m);
+        merge_done(items);
+        if (log) log_message("<< ", ret);
+        breaker_update(true, probe);
+        return ret;
+      }
+      catch (Err & e) {
+        merge_done(items, &e);
+        throw;
+      }
+    }
   }
   catch (Err & e) {
-    log_message("EE ", e.str());
+    // command was taken by another request: wait for the result
+    if (!sent && w && w->taken) {
+      if (probe) { auto lk = get_data_lock(); br_state = BR_OPEN; }
+      return merge_wait(w);
+    }
+    merge_remove(w, qseq);
+    // request was not sent to the device (queue errors, open breaker)
+    if (e.code() == ERR_DEADLINE || e.code() == ERR_CANCELLED ||
+        e.code() == ERR_BUSY || e.code() == ERR_BREAKER ||
+        e.code() == ERR_SUPERSEDED){
+      // probe request was not used: allow another one
+      if (probe) { auto lk = get_data_lock(); br_state = BR_OPEN; }
+      throw;
+    }
+    if (log) log_message("EE ", e.str());
+    // error answers from the device do not count as failures
+    breaker_update(e.code() == ERR_ANSWER, probe, e.str());
     throw;
   }
+  // command was taken by another request after we got the device
+  if (probe) { auto lk = get_data_lock(); br_state = BR_OPEN; }
+  return merge_wait(w);
+}
+
+std::string
+Device::coalesce_key(const std::string & msg) const {
+  if (coalesce.empty() || msg.find('?') != std::string::npos) return "";
+  auto h = msg.substr(0, msg.find_first_of(" \t"));
+  for (auto & c:h) c = toupper(c);
+  for (auto const & p:coalesce)
+    if (p=="*" || h.compare(0, p.size(), p)==0) return h;
+  return "";
 }
 
 std::string
@@ -151,7 +461,22 @@ Device::print(const uint64_t conn) const {
     s << "Driver arguments:\n";
   for (auto const & o:drv_args)
     s << "  -" << o.first << ": " << o.second << "\n";
-  s << "Device is " << (users.size()>0 ? "open":"closed") << "\n";
+  if (dev_args.size())
+    s << "Device parameters:\n";
+  for (auto const & o:dev_args)
+    s << "  -" << o.first << ": " << o.second << "\n";
+  switch (state){
+    case OPENING: s << "Device is opening\n"; break;
+    case FAILED:  s << "Device is closed, last open failed: " << open_err << "\n"; break;
+    default: s << "Device is " << (users.size()>0 ? "open":"closed") << "\n";
+  }
+  if (breaker_errors>0){
+    switch (br_state){
+      case BR_OPEN:  s << "Circuit breaker is open: " << br_err << "\n"; break;
+      case BR_PROBE: s << "Circuit breaker is open, probing the device: " << br_err << "\n"; break;
+      default: s << "Circuit breaker is closed, errors: " << br_errors << "\n";
+    }
+  }
   s << "Number of users: " << users.size() << "\n";
   if (conn && users.count(conn))
     s << "You are currently using the device\n";
@@ -4,13 +4,19 @@
 #include <set>
 #include <map>
 #include <queue>
+#include <list>
+#include <atomic>
 #include <string>
+#include <vector>
 #include <memory>
 
 #include "err/err.h"
 #include "opt/opt.h"
 #include "drv.h"
+#include "cmd_queue.h"
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 /*************************************************/
 
@@ -22,9 +28,23 @@ class Device {
   // Device driver (non-null if device is in use)
   std::shared_ptr<Driver> drv;
 
+  // State of the device. Driver is created without locking
+  // data_mutex; other connections which want to use the device
+  // wait for the result (open_cv). Failed open is remembered
+  // for open_backoff time.
+  enum open_state_t {CLOSED, OPENING, OPEN, FAILED};
+  open_state_t state;
+  std::condition_variable open_cv;
+  std::string open_err; // error message of the last open attempt
+  std::chrono::steady_clock::time_point open_fail_time;
+
   // Connections which use the device
   std::set<uint64_t> users;
 
+  // Number of users except the server itself (DevManager::srv_conn):
+  // devices opened by preopen or check can be locked by a client.
+  size_t n_users() const;
+
   // Is the device locked by a single user?
   bool locked;
 
@@ -35,6 +55,10 @@ class Device {
   std::string drv_name;
   Opt drv_args;
 
+  // Device parameters (extracted from driver args)
+  Opt dev_args;
+  double open_backoff; // time to remember open errors, s
+
   // Mutex for locking device data
   std::mutex data_mutex;
 
@@ -42,12 +66,90 @@ class Device {
   std::unique_lock<std::mutex> get_data_lock() {
     return std::unique_lock<std::mutex>(data_mutex);}
 
-  // Mutex for locking write+read commands
-  std::mutex cmd_mutex;
-
-  // Get lock for the mutex
-  std::unique_lock<std::mutex> get_cmd_lock() {
-    return std::unique_lock<std::mutex>(cmd_mutex);}
+  // Circuit breaker. After breaker_errors consecutive communication
+  // errors the breaker opens and requests fail immediately. After
+  // breaker_probe time one request is sent to the device as a probe:
+  // if it succeeds the breaker closes, otherwise it opens again.
+  enum breaker_state_t {BR_CLOSED, BR_OPEN, BR_PROBE};
+  breaker_state_t br_state;
+  int br_errors;          // number of consecutive errors
+  std::string br_err;     // last error message
+  std::chrono::steady_clock::time_point br_time; // time when breaker opened
+  int breaker_errors;     // max number of errors, 0 - breaker is off
+  double breaker_probe;   // time between probe requests, s
+
+  // Check the breaker before sending a request. Throw Err if the
+  // breaker is open, set `probe` flag if the request should be used
+  // as a probe.
+  void breaker_check(bool & probe);
+
+  // Update the breaker after a request.
+  void breaker_update(const bool ok, const bool probe,
+                      const std::string & err = std::string());
+
+  // Queue for write+read commands (priorities, deadlines)
+  CmdQueue cmd_queue;
+
+  // Prefixes of setter commands which can be coalesced
+  // (upper case, "*" for all commands), see coalesce_key.
+  std::vector<std::string> coalesce;
+
+  // Coalescing key of a command: header of a setter command (first
+  // word, upper case) if it matches one of the coalesce prefixes,
+  // empty string otherwise. Queries (commands with `?`) are not coalesced.
+  std::string coalesce_key(const std::string & msg) const;
+
+  // Wait for the turn of a request
+  CmdQueue::Lock get_cmd_lock(const ReqInfo & ri) {
+    return cmd_queue.acquire(ri);}
+
+  // SCPI merging. Write-only commands (without `?`) are collected in
+  // merge_writes while they wait for the device. The first request which
+  // gets the device (a write-only command, or a query) takes waiting
+  // commands and sends them as one compound message: `CMD1;:CMD2;:MEAS?`.
+  // Commands are taken in order of arrival, only if no query (or a command
+  // longer than scpi_merge) which arrived earlier is still waiting
+  // (merge_queries), up to scpi_merge bytes. Queries take commands only
+  // if the driver reads answers of compound messages (Driver::read_compound).
+  // Owners of taken commands get the result of the compound request.
+  struct MergeItem {
+    std::string msg;
+    uint64_t seq;             // arrival number
+    std::atomic<bool> taken;  // taken by a request
+    bool done;                // compound request is finished
+    std::string err;          // error message
+    int code;                 // error code (0 - no error)
+    MergeItem(const std::string & msg, const uint64_t seq):
+      msg(msg), seq(seq), taken(false), done(false), code(0) {}
+  };
+  size_t scpi_merge; // max size of compound messages, 0 - no merging
+  std::list<std::shared_ptr<MergeItem> > merge_writes;
+  std::set<uint64_t> merge_queries;
+  uint64_t merge_seq;
+  std::condition_variable merge_cv;
+
+  // Register a command for merging: create an item for a write-only
+  // command (and cancel waiting in the queue if it is taken), or
+  // get arrival number for a query or a command longer than scpi_merge.
+  void merge_add(const std::string & msg, std::shared_ptr<MergeItem> & w,
+                 uint64_t & qseq, ReqInfo & ri);
+
+  // Take waiting commands, return the compound message, empty string
+  // if own command was taken by another request. Queries take commands
+  // only if the driver reads answers of compound messages (`compound`).
+  std::string merge_take(const std::string & msg, std::shared_ptr<MergeItem> & w,
+    const uint64_t qseq, std::vector<std::shared_ptr<MergeItem> > & items,
+    const bool compound);
+
+  // Remove the command which was not sent.
+  void merge_remove(std::shared_ptr<MergeItem> & w, const uint64_t qseq);
+
+  // Set result of the compound request for all its commands.
+  void merge_done(std::vector<std::shared_ptr<MergeItem> > & items,
+                  const Err * e = NULL);
+
+  // Wait for result of a command taken by another request.
+  std::string merge_wait(std::shared_ptr<MergeItem> & w);
 
   // Log buffers: conn -> list(shared_ptr(strings))
   // Each connection can start its own log buffer and
@@ -62,7 +164,16 @@ class Device {
   // log a message with a prefix
   void log_message(const std::string & pref, const std::string & msg);
 
+  // Open the device if needed, or wait until it is opened
+  // by another connection. Data lock should be locked, it is
+  // unlocked while the driver is created.
+  void open(std::unique_lock<std::mutex> & lk, const uint64_t conn);
+
 public:
+  // Names of device parameters. They can be set in the configuration
+  // file together with driver parameters, but are not passed to the driver.
+  static const std::vector<std::string> dev_pars;
+
   // Constructor
   Device( const std::string & dev_name,
           const std::string & drv_name,
@@ -98,8 +209,11 @@ public:
   // Get contents of the log buffer and clear it.
   std::string log_get(const uint64_t conn);
 
-  // Send message to the device, get answer
-  std::string ask(const uint64_t conn, const std::string & msg);
+  // Send message to the device, get answer.
+  // Request parameters (priority, deadline) are used to order
+  // requests to the device.
+  std::string ask(const uint64_t conn, const std::string & msg,
+                  const ReqInfo & ri = ReqInfo());
 
   // Print device information: name, users, driver, driver arguments.
   std::string print(const uint64_t conn=0) const;
@@ -0,0 +1,233 @@
+///\cond HIDDEN (do not show this in Doxyden)
+
+#include "device.h"
+#include "cmd_queue.h"
+#include "err/assert_err.h"
+#include <vector>
+#include <thread>
+#include <unistd.h>
+#include <sys/time.h>
+
+using namespace std;
+
+// current time, seconds
+double
+now(){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+int
+main(){
+  try{
+
+    // slow open: one open attempt is shared between connections,
+    // other operations do not wait for it
+    {
+      Opt o;
+      o.put("open_delay", 0.3);
+      Device d("d", "test", o);
+
+      double t0 = now();
+      std::thread t1([&](){ d.use(1); });
+      std::thread t2([&](){ d.use(2); });
+      usleep(50000);
+      assert_eq(d.print().find("Device is opening") != string::npos, true);
+      d.log_start(3);
+      d.release(4);
+      assert_eq(now()-t0 < 0.2, true);
+      t1.join();
+      t2.join();
+      double dt = now()-t0;
+      assert_eq(dt>0.25 && dt < 0.5, true);
+      assert_eq(d.print(1).find("Number of users: 2") != string::npos, true);
+      assert_eq(d.ask(1, "abc"), "abc");
+      assert_eq(d.log_get(3), ">> abc\n<< abc\n");
+
+      // close and open again
+      d.release(1);
+      d.release(2);
+      t0 = now();
+      assert_eq(d.ask(5, "abc"), "abc");
+      assert_eq(now()-t0 > 0.25, true);
+    }
+
+    // failed open is remembered for open_backoff time
+    {
+      Opt o;
+      o.put("open_error", "no device");
+      o.put("open_delay", 0.2);
+      o.put("open_backoff", 0.5);
+      Device d("d", "test_spp", o);
+
+      double t0 = now();
+      assert_err(d.use(1), "no device");
+      assert_eq(now()-t0 > 0.15, true);
+
+      t0 = now();
+      assert_err(d.ask(2, "abc"), "no device");
+      assert_eq(now()-t0 < 0.1, true);
+      assert_eq(d.print().find(
+        "Device parameters:\n"
+        "  -open_backoff: 0.5\n"
+        "Device is closed, last open failed: no device\n") != string::npos, true);
+
+      usleep(500000);
+      t0 = now();
+      assert_err(d.use(1), "no device");
+      assert_eq(now()-t0 > 0.15, true);
+    }
+
+    // circuit breaker
+    {
+      Opt o;
+      o.put("fail_rate", 1);
+      o.put("delay", 0.1);
+      o.put("errpref", "");
+      o.put("breaker_errors", 2);
+      o.put("breaker_probe", 0.3);
+      Device d("d", "test", o);
+
+      assert_eq(d.print().find(
+        "Circuit breaker is closed, errors: 0\n") != string::npos, true);
+      assert_err(d.ask(1, "abc"), "simulated failure");
+      assert_err(d.ask(1, "abc"), "simulated failure");
+
+      // fail fast
+      double t0 = now();
+      assert_err(d.ask(1, "abc"),
+        "device is not responding (circuit breaker is open): simulated failure");
+      assert_eq(now()-t0 < 0.05, true);
+      assert_eq(d.print().find(
+        "Circuit breaker is open: simulated failure\n") != string::npos, true);
+
+      // probe request goes to the device, breaker opens again
+      usleep(300000);
+      t0 = now();
+      assert_err(d.ask(1, "abc"), "simulated failure");
+      assert_eq(now()-t0 > 0.05, true);
+      assert_err(d.ask(1, "abc"),
+        "device is not responding (circuit breaker is open): simulated failure");
+    }
+
+    // coalescing of setter commands
+    {
+      Opt o;
+      o.put("delay", 0.1);
+      o.put("coalesce", "freq,sour:");
+      Device d("d", "test", o);
+      std::vector<std::string> msgs = {"FREQ 1", "freq 2", "FREQ?", "FREQ 3",
+        "SOUR:VOLT 1", "AMPL 1", "SOUR:VOLT 2"};
+      std::vector<std::string> res(msgs.size());
+      std::vector<std::thread> thr;
+      for (size_t i=0; i<msgs.size(); i++){
+        thr.push_back(std::thread([&d, &res, &msgs, i](){
+          try { res[i] = d.ask(1, msgs[i]); }
+          catch (Err & e) { res[i] = e.str(); }
+        }));
+        usleep(20000);
+      }
+      for (auto & t: thr) t.join();
+      assert_eq(res == std::vector<std::string>({"FREQ 1",
+        "superseded by a newer request", "FREQ?", "FREQ 3",
+        "superseded by a newer request", "AMPL 1", "SOUR:VOLT 2"}), true);
+    }
+
+    // SCPI merging of write-only commands
+    for (int limit: {100, 5}) {
+      Opt o;
+      o.put("delay", 0.1);
+      o.put("scpi_merge", limit);
+      Device d("d", "test", o);
+      std::vector<std::string> msgs = {"A?", "W1", "*W2", "Q?", "W3"};
+      std::vector<int> prio = {0, 0, 0, 1, 0};
+      std::vector<std::string> res(msgs.size());
+      std::vector<std::thread> thr;
+      for (size_t i=0; i<msgs.size(); i++){
+        thr.push_back(std::thread([&d, &res, &msgs, &prio, i](){
+          Opt p;
+          p.put("priority", prio[i]);
+          try { res[i] = d.ask(1, msgs[i], ReqInfo(p)); }
+          catch (Err & e) { res[i] = e.str(); }
+        }));
+        usleep(20000);
+      }
+      for (auto & t: thr) t.join();
+      // the query takes earlier commands, later ones are sent separately
+      auto exp = (limit == 100) ?
+        std::vector<std::string>({"A?", "", "", "W1;*W2;:Q?", "W3"}) :
+        std::vector<std::string>({"A?", "W1", "*W2", "Q?", "W3"});
+      assert_eq(res == exp, true);
+
+      // write-only commands are merged without a query
+      thr.clear();
+      msgs = {"A?", "W1", "W2"};
+      res.assign(msgs.size(), "");
+      for (size_t i=0; i<msgs.size(); i++){
+        thr.push_back(std::thread([&d, &res, &msgs, i](){ res[i] = d.ask(1, msgs[i]); }));
+        usleep(20000);
+      }
+      for (auto & t: thr) t.join();
+      exp = (limit == 100) ?
+        std::vector<std::string>({"A?", "W1;:W2", ""}) :
+        std::vector<std::string>({"A?", "W1", "W2"});
+      assert_eq(res == exp, true);
+
+      // commands are not sent before a query (or a long command)
+      // which arrived earlier
+      for (std::string b: {std::string("B?"), "B" + std::string(100,'x') + "?",
+                           "B" + std::string(100,'x')}){
+        thr.clear();
+        msgs = {"A?", b, "W1", "Q?"};
+        prio = {0, 0, 0, 1};
+        res.assign(msgs.size(), "");
+        for (size_t i=0; i<msgs.size(); i++){
+          thr.push_back(std::thread([&d, &res, &msgs, &prio, i](){
+            Opt p;
+            p.put("priority", prio[i]);
+            res[i] = d.ask(1, msgs[i], ReqInfo(p));
+          }));
+          usleep(20000);
+        }
+        for (auto & t: thr) t.join();
+        assert_eq(res == msgs, true);
+      }
+    }
+
+    // no merging of commands into queries if the driver reads
+    // only queries with `?` in the first word
+    for (std::string rc: {"always", "qmark1w"}) {
+      Opt o;
+      o.put("delay", 0.1);
+      o.put("scpi_merge", 100);
+      o.put("read_cond", rc);
+      Device d("d", "test", o);
+      std::vector<std::string> msgs = {"A?", "W1", "Q?"};
+      std::vector<int> prio = {0, 0, 1};
+      std::vector<std::string> res(msgs.size());
+      std::vector<std::thread> thr;
+      for (size_t i=0; i<msgs.size(); i++){
+        thr.push_back(std::thread([&d, &res, &msgs, &prio, i](){
+          Opt p;
+          p.put("priority", prio[i]);
+          res[i] = d.ask(1, msgs[i], ReqInfo(p));
+        }));
+        usleep(20000);
+      }
+      for (auto & t: thr) t.join();
+      auto exp = (rc == "always") ?
+        std::vector<std::string>({"A?", "", "W1;:Q?"}) :
+        std::vector<std::string>({"A?", "", "Q?"});
+      assert_eq(res == exp, true);
+    }
+
+  }
+  catch (Err e) {
+    std::cerr << "Error: " << e.str() << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+///\endcond
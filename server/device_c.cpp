@@ -1,10 +1,27 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <set>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <chrono>
 #include <unistd.h> // usleep
+#include <poll.h>
+#include <csignal>
+#include <ctime>
+#include <sys/socket.h>
 
 #include <curl/curl.h>
 #include "tun.h"
+#include "unix_sock.h"
 
 #include "read_words/read_words.h"
 #include "read_words/read_conf.h"
@@ -19,15 +36,19 @@ void usage(const GetOptSet & options, bool pod=false){
   HelpPrinter pr(pod, options, "device_c");
   pr.name("device client program");
   pr.usage("[<options>] ask <dev> <msg> -- send message to the device, print answer");
+  pr.usage("[<options>] multi_ask <dev> <msg> [<dev> <msg> ...] -- send messages to a few "
+           "devices in parallel, print answers in the same order");
   pr.usage("[<options>] use_dev <dev>   -- SPP interface to a device");
   pr.usage("[<options>] use_srv         -- SPP interface to the server");
   pr.usage("[<options>] (list|devices)  -- print list of available devices");
   pr.usage("[<options>] info <dev>      -- print information about device");
   pr.usage("[<options>] reload          -- reload device configuration");
+  pr.usage("[<options>] check [<dev>]   -- open all devices (or one device), print status table");
   pr.usage("[<options>] monitor <dev>   -- monitor all communication of the device");
   pr.usage("[<options>] ping            -- check if the server is working");
   pr.usage("[<options>] get_time        -- get server system time");
   pr.usage("[<options>] get_srv         -- get server address");
+  pr.usage("[<options>] mux             -- run connection multiplexer on --mux socket");
 
   pr.head(1, "Options:");
   pr.opts({"DEVCLI"});
@@ -37,6 +58,23 @@ void usage(const GetOptSet & options, bool pod=false){
   throw Err();
 }
 
+// Encode answer in SPP format: split into lines, protect '#' symbols.
+std::string
+spp_encode(const std::string & s){
+  if (s.size()==0) return s;
+  std::string ret;
+  size_t p0 = 0;
+  while (1){
+    auto p1 = s.find('\n', p0);
+    auto l = s.substr(p0, p1==std::string::npos? p1 : p1-p0);
+    if (l.size() && l[0]=='#') ret += '#';
+    ret += l + '\n';
+    if (p1==std::string::npos) break;
+    p0 = p1+1;
+  }
+  return ret;
+}
+
 // write callback for libcurl
 size_t write_cb(void *buffer, size_t size, size_t nmemb, void *data){
   *(std::string*)data += std::string((const char*)buffer, size*nmemb);
@@ -46,77 +84,264 @@ size_t write_cb(void *buffer, size_t size, size_t nmemb, void *data){
 class Downloader {
   CURLM *cm;
   std::string server;
+  std::string base; // base url
+  std::string args; // GET arguments
+  std::string name; // connection name
+  long nconn; // number of new connections made in the last request
+  int retries; // max number of retries if the device is busy
 
 public:
 
-  Downloader(const std::string & srv): server(srv){
+  // Server address: http://<host>:<port> or unix:<socket path>
+  Downloader(const std::string & srv):
+      server(srv), base(srv), nconn(0), retries(3){
     curl_global_init(CURL_GLOBAL_ALL);
     cm = curl_easy_init();
+    if (server.substr(0,5) == "unix:"){
+      curl_easy_setopt(cm, CURLOPT_UNIX_SOCKET_PATH, server.substr(5).c_str());
+      base = "http://localhost";
+    }
+  }
+
+  // New connection to the same server, with same arguments.
+  Downloader(const Downloader & D):
+      server(D.server), base(D.base), args(D.args), nconn(0), retries(D.retries){
+    cm = curl_easy_init();
+    if (server.substr(0,5) == "unix:")
+      curl_easy_setopt(cm, CURLOPT_UNIX_SOCKET_PATH, server.substr(5).c_str());
   }
 
   ~Downloader(){
     curl_easy_cleanup(cm);
   }
 
-  // ask the server
-  std::string get(const std::string & act,
-                  const std::string & dev = "",
-                  const std::string & cmd = ""){
+  // set max number of retries if the device is busy
+  void set_retries(const int n) {retries = n;}
+
+  // set connection name on the server (empty: default name)
+  void set_name(const std::string & n){
+    get("set_conn_name", n);
+    name = n;
+  }
+  const std::string & get_name() const {return name;}
+
+  // add a GET argument to all requests
+  void add_arg(const std::string & name, const std::string & val){
+    char *val_ = curl_easy_escape(cm, val.data() , val.size());
+    args += (args==""? "?":"&") + name + "=" + val_;
+    curl_free(val_);
+  }
+
+  // build url for a request
+  std::string make_url(const std::string & act,
+                       const std::string & dev,
+                       const std::string & cmd){
     // escape url components
     char *dev_ = curl_easy_escape(cm, dev.data() , dev.size());
     char *act_ = curl_easy_escape(cm, act.data() , act.size());
     char *cmd_ = curl_easy_escape(cm, cmd.data() , cmd.size());
 
     // build url, free unneeded strings
-    std::string url = server + "/" + act_;
+    std::string url = base + "/" + act_;
     if  (dev != "") url += std::string("/") + dev_;
     if  (cmd != "") url += std::string("/") + cmd_;
     curl_free(dev_);
     curl_free(act_);
     curl_free(cmd_);
+    return url + args;
+  }
+
+  // ask the server
+  std::string get(const std::string & act,
+                  const std::string & dev = "",
+                  const std::string & cmd = ""){
+    return get_url(make_url(act, dev, cmd), retries);
+  }
+
+  // Ask the server using url from make_url. If the device is busy
+  // repeat the request up to `n` times. If `wait`>0 wait before the
+  // first request (it was already rejected), s.
+  std::string get_url(const std::string & url, const int n, int wait = 0){
 
     // set curl options
     std::string data; // data storage
     curl_easy_setopt(cm, CURLOPT_URL, url.c_str());
     curl_easy_setopt(cm, CURLOPT_WRITEFUNCTION, write_cb);
     curl_easy_setopt(cm, CURLOPT_WRITEDATA, (void*) &data);
-    auto ret = curl_easy_perform(cm);
-    if (ret != CURLE_OK) throw Err() << curl_easy_strerror(ret);
-
-    // get response code
-    long http_code = 0;
-    curl_easy_getinfo (cm, CURLINFO_RESPONSE_CODE, &http_code);
-    if (http_code != 200) throw Err() << data;
-    return data;
+
+    for (int i=0;; i++){
+      if (wait>0) sleep(wait);
+      data.clear();
+      auto ret = curl_easy_perform(cm);
+      curl_easy_getinfo(cm, CURLINFO_NUM_CONNECTS, &nconn);
+      if (ret != CURLE_OK) throw Err() << curl_easy_strerror(ret);
+
+      // get response code
+      long http_code = 0;
+      curl_easy_getinfo (cm, CURLINFO_RESPONSE_CODE, &http_code);
+      if (http_code == 200) return data;
+
+      // device is busy: wait and retry
+      if (http_code == 503 && i < n){
+        wait = retry_after(cm);
+        continue;
+      }
+      throw Err() << data;
+    }
   }
 
-  // SPP interface to a single device.
-  void use_dev(const std::string & dev,
-               std::istream & in, std::ostream & out,
-               const bool lock, const std::string & name){
+  // Time to wait before repeating request rejected by a busy device, s.
+  // Value of Retry-After header, limited to 1..10s.
+  static int retry_after(CURL * h){
+    curl_off_t t = 1;
+#if LIBCURL_VERSION_NUM >= 0x074200
+    curl_easy_getinfo(h, CURLINFO_RETRY_AFTER, &t);
+#endif
+    return t<1 ? 1 : t>10 ? 10 : t;
+  }
 
-    out << "#SPP001\n"; // command-line protocol, version 001.
-    out << "Server: " << server << "\n";
-    out << "Device: " << dev << "\n";
+  // Answer of multi_get: success flag and answer or error message.
+  struct Answer {
+    bool ok;
+    std::string data;
+    Answer(): ok(false) {}
+  };
+
+  // Send a few requests in parallel (libcurl multi interface),
+  // each through its own connection. Every request contains action,
+  // device, and message. Answers are returned in the same order.
+  std::vector<Answer> multi_get(
+         const std::vector<std::vector<std::string> > & reqs){
+
+    std::vector<Answer> ret(reqs.size());
+    std::vector<CURL*> hs(reqs.size(), NULL);
+    std::vector<std::string> urls(reqs.size());
+    CURLM *mh = curl_multi_init();
+
+    for (size_t i=0; i<reqs.size(); i++){
+      auto r = reqs[i];
+      r.resize(3);
+      urls[i] = make_url(r[0], r[1], r[2]);
+      hs[i] = curl_easy_init();
+      curl_easy_setopt(hs[i], CURLOPT_URL, urls[i].c_str());
+      curl_easy_setopt(hs[i], CURLOPT_WRITEFUNCTION, write_cb);
+      curl_easy_setopt(hs[i], CURLOPT_WRITEDATA, (void*) &ret[i].data);
+      if (server.substr(0,5) == "unix:")
+        curl_easy_setopt(hs[i], CURLOPT_UNIX_SOCKET_PATH, server.substr(5).c_str());
+      curl_multi_add_handle(mh, hs[i]);
+    }
 
-    // Outer try -- exit on errors with #Error message
-    // For SPP2 it should be #Fatal
-    try {
-      // open device, set lock and connection name,
-      // throw error if needed
-      get("use", dev);
-      if (name !="") get("set_conn_name", name);
-      if (lock) get("lock", dev);
-      out << "#OK\n";
-      out.flush();
+    // Run all transfers. Requests rejected by a busy device are
+    // added again after their Retry-After delay (up to `retries` times),
+    // waiting in parallel with other transfers.
+    typedef std::chrono::steady_clock clock_t;
+    std::vector<int> tries(reqs.size(), 0);
+    std::map<size_t, clock_t::time_point> delayed; // handle -> restart time
+    int running = 0;
+    while (1) {
+      auto res = curl_multi_perform(mh, &running);
+      if (res != CURLM_OK) break;
+
+      // collect results
+      CURLMsg *m;
+      int q;
+      while ((m = curl_multi_info_read(mh, &q))){
+        if (m->msg != CURLMSG_DONE) continue;
+        size_t i = std::find(hs.begin(), hs.end(), m->easy_handle) - hs.begin();
+        if (i>=hs.size()) continue;
+        if (m->data.result != CURLE_OK){
+          ret[i].data = curl_easy_strerror(m->data.result);
+          continue;
+        }
+        long http_code = 0;
+        curl_easy_getinfo(hs[i], CURLINFO_RESPONSE_CODE, &http_code);
+        ret[i].ok = (http_code == 200);
+
+        // device is busy: repeat the request later
+        if (http_code == 503 && tries[i] < retries){
+          tries[i]++;
+          curl_multi_remove_handle(mh, hs[i]);
+          delayed[i] = clock_t::now() + std::chrono::seconds(retry_after(hs[i]));
+        }
+      }
+
+      // restart delayed requests
+      auto now = clock_t::now();
+      long ms = 1000;
+      for (auto d = delayed.begin(); d != delayed.end();){
+        if (d->second > now) {
+          ms = std::min<long>(ms, std::chrono::duration_cast<
+            std::chrono::milliseconds>(d->second - now).count() + 1);
+          d++; continue;
+        }
+        ret[d->first].data.clear();
+        curl_multi_add_handle(mh, hs[d->first]);
+        running++;
+        ms = 0;
+        d = delayed.erase(d);
+      }
+
+      if (!running && delayed.empty()) break;
+      if (running) curl_multi_wait(mh, NULL, 0, ms, NULL);
+      else std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    }
 
+    for (auto h: hs){
+      curl_multi_remove_handle(mh, h);
+      curl_easy_cleanup(h);
+    }
+    curl_multi_cleanup(mh);
+    return ret;
+  }
+
+  // Was a new connection to the server made in the last request?
+  // (Server forgets connection name and releases devices
+  // when a connection is closed.)
+  bool new_connection() const {return nconn>0;}
+
+  // Is there an open connection to the server, which will be used
+  // by the next request? False before the first request and
+  // after the server closed the connection.
+  bool connected() {
+    curl_socket_t s = CURL_SOCKET_BAD;
+#if LIBCURL_VERSION_NUM >= 0x072d00
+    curl_easy_getinfo(cm, CURLINFO_ACTIVESOCKET, &s);
+#endif
+    if (s == CURL_SOCKET_BAD) return false;
+    struct pollfd p = {s, POLLRDHUP, 0};
+    if (poll(&p, 1, 0) <= 0) return true;
+    return (p.revents & (POLLRDHUP | POLLHUP | POLLERR)) == 0;
+  }
+
+  // Request processing function for spp_loop: get words of
+  // a request and a connection to the server, return answer.
+  typedef std::function<std::string(Downloader &,
+    const std::vector<std::string> &)> proc_t;
+
+  // Function for spp_loop: should the request go through this connection
+  // in order with other requests?
+  typedef std::function<bool(const std::vector<std::string> &)> serial_t;
+
+  // Process SPP requests from `in` until EOF or empty line. If pipeline>0
+  // use SPP version 3: requests start with a tag, they are processed in
+  // `pipeline` parallel connections to the server (this one and copies),
+  // answers are written as soon as they are ready, with `#OK <tag>`
+  // or `#Error <tag>: <msg>` lines. Requests for which `serial` returns
+  // true go through this connection, after all previous requests are
+  // finished and before the next ones are started. Copies get
+  // connection names `<name>:<N>`.
+  void spp_loop(std::istream & in, std::ostream & out,
+                const int pipeline, const proc_t & proc,
+                const serial_t & serial = serial_t()){
+
+    if (pipeline<1){
       while (1){
         // inner try -- continue to a new command with #Error message
         try {
           if (!in) break;
           auto pars = read_words(in);
           if (pars.size()==0) break;
-          out << get("ask", dev, join_words(pars)) << '\n';
+          out << proc(*this, pars) << '\n';
           out << "#OK\n";
           out.flush();
         }
@@ -125,6 +350,133 @@ public:
           out.flush();
         }
       }
+      return;
+    }
+
+    std::mutex m;  // protects the queue, the counter and the output
+    std::condition_variable cv;
+    std::deque<std::vector<std::string> > queue;
+    size_t active = 0; // requests processed by workers
+    bool done = false;
+
+    // process a tagged request, return SPP answer
+    auto run = [&proc](Downloader & D, std::vector<std::string> pars){
+      auto tag = pars[0];
+      pars.erase(pars.begin());
+      try {
+        return spp_encode(proc(D, pars)) + "#OK " + tag + "\n";
+      }
+      catch (Err & e){
+        auto msg = e.str();
+        for (auto & c: msg) if (c=='\n') c=' ';
+        return "#Error " + tag + ": " + msg + "\n";
+      }
+    };
+
+    auto worker = [&](Downloader & D){
+      while (1){
+        std::vector<std::string> pars;
+        {
+          std::unique_lock<std::mutex> lk(m);
+          cv.wait(lk, [&](){return done || queue.size();});
+          if (queue.empty()) return;
+          pars.swap(queue.front());
+          queue.pop_front();
+          active++;
+        }
+        auto ans = run(D, pars);
+        std::lock_guard<std::mutex> lk(m);
+        out << ans;
+        out.flush();
+        active--;
+        cv.notify_all();
+      }
+    };
+
+    // names of copies follow the name of this connection
+    auto copy_name = [this](const int i){
+      return name.size()? name + ":" + type_to_str(i) : std::string();
+    };
+
+    std::vector<std::unique_ptr<Downloader> > conns;
+    std::vector<std::thread> thr;
+    for (int i=1; i<pipeline; i++){
+      conns.emplace_back(new Downloader(*this));
+      if (name.size()) conns.back()->set_name(copy_name(i));
+    }
+    thr.push_back(std::thread(worker, std::ref(*this)));
+    for (auto & c: conns)
+      thr.push_back(std::thread(worker, std::ref(*c)));
+
+    while (in){
+      std::vector<std::string> pars;
+      try { pars = read_words(in); }
+      catch (Err & e) { break; }
+      if (pars.size()==0) break;
+
+      if (serial && serial(std::vector<std::string>(pars.begin()+1, pars.end()))){
+        // wait until all previous requests are finished
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait(lk, [&](){return queue.empty() && active==0;});
+        lk.unlock();
+        auto n = name;
+        auto ans = run(*this, pars);
+        if (n != name){
+          for (size_t i=0; i<conns.size(); i++){
+            try { conns[i]->set_name(copy_name(i+1)); }
+            catch (Err & e) {}
+          }
+        }
+        lk.lock();
+        out << ans;
+        out.flush();
+        continue;
+      }
+
+      std::lock_guard<std::mutex> lk(m);
+      queue.push_back(pars);
+      cv.notify_all();
+    }
+    {
+      std::lock_guard<std::mutex> lk(m);
+      done = true;
+    }
+    cv.notify_all();
+    for (auto & t: thr) t.join();
+    for (auto & c: conns){
+      try { c->get("release_all"); } catch (Err & e) {}
+    }
+  }
+
+  // SPP interface to a single device.
+  // If pipeline>0 SPP version 3 is used.
+  void use_dev(const std::string & dev,
+               std::istream & in, std::ostream & out,
+               const bool lock, const std::string & name,
+               const int pipeline = 0){
+
+    // command-line protocol, version 001 or 003.
+    out << (pipeline>0? "#SPP003\n" : "#SPP001\n");
+    out << "Server: " << server << "\n";
+    out << "Device: " << dev << "\n";
+
+    // Outer try -- exit on errors with #Error message
+    // For SPP2 it should be #Fatal
+    try {
+      // open device, set lock and connection name,
+      // throw error if needed
+      get("use", dev);
+      if (name !="") set_name(name);
+      if (lock) get("lock", dev);
+      out << "#OK\n";
+      out.flush();
+
+      // a locked device can be used only through this connection
+      spp_loop(in, out, pipeline,
+        [&dev](Downloader & D, const std::vector<std::string> & pars){
+          return D.get("ask", dev, join_words(pars));
+        },
+        [lock](const std::vector<std::string> &){ return lock; });
     }
     catch(Err e){
       if (e.str()!="") out << "#Error: " << e.str() << "\n";
@@ -135,8 +487,10 @@ public:
   }
 
   // SPP interface to the server.
-  void use_srv(std::istream & in, std::ostream & out){
-    out << "#SPP001\n"; // command-line protocol, version 001.
+  // If pipeline>0 SPP version 3 is used.
+  void use_srv(std::istream & in, std::ostream & out, const int pipeline = 0){
+    // command-line protocol, version 001 or 003.
+    out << (pipeline>0? "#SPP003\n" : "#SPP001\n");
     out << "Server: " << server << "\n";
     out.flush();
 
@@ -148,26 +502,27 @@ public:
       out << "#OK\n";
       out.flush();
 
-      while (1){
-        // inner try -- continue to a new command with #Error message
-        try {
-          if (!in) break;
-          auto pars = read_words(in);
-          if (pars.size()==0) break;
-
-          if (pars.size()>3)
+      // Only `ask` requests go through parallel connections. Other
+      // actions change state of the connection (devices in use, locks,
+      // name, logs) and go through this one, as well as requests to
+      // devices locked by it.
+      std::set<std::string> locked;
+      spp_loop(in, out, pipeline,
+        [&locked](Downloader & D, const std::vector<std::string> & p){
+          if (p.size()>3)
             throw Err() << "too many arguments";
+          auto pars = p;
           pars.resize(3);
-
-          out << get(pars[0], pars[1], pars[2]) << '\n';
-          out << "#OK\n";
-          out.flush();
-        }
-        catch(Err e){
-          if (e.str()!="") out << "#Error: " << e.str() << "\n";
-          out.flush();
-        }
-      }
+          if (pars[0] == "set_conn_name") { D.set_name(pars[1]); return std::string(); }
+          auto ret = D.get(pars[0], pars[1], pars[2]);
+          if (pars[0] == "lock") locked.insert(pars[1]);
+          if (pars[0] == "unlock" || pars[0] == "release") locked.erase(pars[1]);
+          if (pars[0] == "release_all") locked.clear();
+          return ret;
+        },
+        [&locked](const std::vector<std::string> & p){
+          return p.empty() || p[0] != "ask" || (p.size()>1 && locked.count(p[1]));
+        });
     }
     catch(Err e){
       if (e.str()!="") out << "#Error: " << e.str() << "\n";
@@ -187,6 +542,233 @@ public:
 
 };
 
+/*************************************************/
+// Connection multiplexer.
+//
+// The daemon (`device_c --mux <socket> mux`) listens on a unix socket and
+// sends requests of local clients to the server through persistent
+// connections (and a single tunnel if -via is used): one connection for
+// each device and one for requests without a device, so requests to
+// different devices do not wait for each other.
+// Devices stay in use by these connections between client calls.
+//
+// Protocol: the daemon writes SPP header with "Server: <server>" line.
+// Then each request line is split into action, device and message
+// (as in use_srv mode) and the answer is sent in SPP format.
+// Requests can not contain newline characters.
+
+// period of keep-alive requests, s (server closes idle connections in 10s)
+#define MUX_PING_PERIOD 5
+
+// Actions which can go through the multiplexer.
+bool
+mux_action(const std::string & act){
+  return act == "ask" || act == "list" || act == "devices" ||
+         act == "info" || act == "reload" || act == "ping" ||
+         act == "get_time" || act == "check";
+}
+
+volatile sig_atomic_t mux_stop = 0;
+void mux_stop_func(int){ mux_stop = 1; }
+
+class Mux {
+  Downloader & D;
+  std::string server, name;
+
+  // connection to the server
+  struct Conn {
+    std::unique_ptr<Downloader> D; // empty for the main connection
+    std::string name; // connection name (<name>:<device> for devices)
+    std::mutex m;  // protects D and last
+    time_t last;   // time of the last request
+    Conn(): last(0) {}
+  };
+  std::mutex pm;   // protects conns
+  std::map<std::string, std::unique_ptr<Conn> > conns; // device -> connection
+
+  std::mutex cm;   // protects clients
+  std::condition_variable cv;
+  std::set<int> clients;
+
+  // connection for a device ("" for requests without a device)
+  Conn & conn(const std::string & dev){
+    std::lock_guard<std::mutex> lk(pm);
+    auto & c = conns[dev];
+    if (!c) {
+      c.reset(new Conn);
+      c->name = name;
+      if (dev!="") {
+        c->D.reset(new Downloader(D));
+        if (name!="") c->name += ":" + dev;
+      }
+    }
+    return *c;
+  }
+
+  // ask the server through a connection; set connection name
+  // before the first request on a new (or reopened) connection
+  std::string get(Conn & c, const std::string & act,
+                  const std::string & dev = "",
+                  const std::string & cmd = ""){
+    std::lock_guard<std::mutex> lk(c.m);
+    auto & d = c.D? *c.D : D;
+    c.last = time(NULL);
+    if (c.name!="" && !d.connected()) d.get("set_conn_name", c.name);
+    auto ret = d.get(act, dev, cmd);
+    // connection was closed just before the request
+    if (d.new_connection() && c.name!="") d.get("set_conn_name", c.name);
+    return ret;
+  }
+
+  // ping connections which were idle for MUX_PING_PERIOD
+  void ping(){
+    std::vector<Conn*> cc;
+    {
+      std::lock_guard<std::mutex> lk(pm);
+      for (auto const & c: conns) cc.push_back(c.second.get());
+    }
+    for (auto c: cc){
+      {
+        std::lock_guard<std::mutex> lk(c->m);
+        if (time(NULL) - c->last < MUX_PING_PERIOD) continue;
+      }
+      try { get(*c, "ping"); } catch (Err & e) {}
+    }
+  }
+
+  // serve a single client
+  void serve(const int fd){
+    try {
+      write_all(fd, "#SPP001\nServer: " + server + "\n#OK\n");
+      FdLineReader in(fd);
+      std::string l;
+      while (in.getline(l)){
+        std::string out;
+        try {
+          std::istringstream ss(l);
+          auto pars = read_words(ss);
+          if (pars.size()==0) continue;
+          if (pars.size()>3) throw Err() << "too many arguments";
+          pars.resize(3);
+          out = spp_encode(get(conn(pars[1]), pars[0], pars[1], pars[2])) + "#OK\n";
+        }
+        catch (Err & e){
+          auto msg = e.str();
+          for (auto & c: msg) if (c=='\n') c=' ';
+          out = "#Error: " + msg + "\n";
+        }
+        write_all(fd, out);
+      }
+    }
+    catch (Err & e) {}
+
+    std::lock_guard<std::mutex> lk(cm);
+    clients.erase(fd);
+    ::close(fd);
+    cv.notify_all();
+  }
+
+public:
+  Mux(Downloader & D, const std::string & server, const std::string & name):
+    D(D), server(server), name(name) {}
+
+  // Run the daemon until SIGINT or SIGTERM.
+  void run(const std::string & path){
+    get(conn(""), "ping"); // check the server, set connection name
+
+    int lfd = unix_sock_listen(path);
+    signal(SIGINT,  mux_stop_func);
+    signal(SIGTERM, mux_stop_func);
+    signal(SIGPIPE, SIG_IGN);
+
+    // keep server connections alive
+    std::thread ka([this](){
+      while (!mux_stop){
+        usleep(100000);
+        ping();
+      }
+    });
+
+    while (!mux_stop){
+      struct pollfd pfd = {lfd, POLLIN, 0};
+      if (poll(&pfd, 1, 500) <= 0) continue;
+      int fd = accept(lfd, NULL, NULL);
+      if (fd<0) continue;
+      std::lock_guard<std::mutex> lk(cm);
+      clients.insert(fd);
+      std::thread(&Mux::serve, this, fd).detach();
+    }
+
+    ka.join();
+    ::close(lfd);
+    unlink(path.c_str());
+
+    // disconnect clients, wait for running requests
+    {
+      std::unique_lock<std::mutex> lk(cm);
+      for (auto fd: clients) shutdown(fd, SHUT_RDWR);
+      cv.wait(lk, [this](){return clients.empty();});
+    }
+    for (auto & c: conns){
+      try { get(*c.second, "release_all"); } catch (Err & e) {}
+    }
+  }
+};
+
+// Client of the multiplexer.
+class MuxClient {
+  int fd;
+  FdLineReader in;
+
+  // Read SPP answer. Throw Err on #Error or on EOF.
+  std::string read_answer(){
+    std::string ret, l;
+    bool first = true;
+    while (in.getline(l)){
+      if (l == "#OK") return ret;
+      if (l.substr(0,8) == "#Error: ") throw Err() << l.substr(8);
+      if (l.size() && l[0]=='#'){
+        if (l.size()<2 || l[1]!='#') continue;
+        l = l.substr(1);
+      }
+      if (!first) ret += '\n';
+      ret += l;
+      first = false;
+    }
+    throw Err() << "multiplexer closed connection";
+  }
+
+public:
+  // Connect to the multiplexer socket, check that it uses the server.
+  MuxClient(const std::string & path, const std::string & server):
+      fd(unix_sock_connect(path)), in(fd) {
+    try {
+      std::string l;
+      if (!in.getline(l) || l != "#SPP001")
+        throw Err() << "bad multiplexer header";
+      if (!in.getline(l) || l != "Server: " + server)
+        throw Err() << "multiplexer uses another server";
+      read_answer();
+    }
+    catch (Err & e){
+      ::close(fd);
+      throw;
+    }
+  }
+
+  ~MuxClient(){ ::close(fd); }
+
+  // ask the server
+  std::string get(const std::string & act,
+                  const std::string & dev = "",
+                  const std::string & cmd = ""){
+    if ((act+dev+cmd).find('\n') != std::string::npos)
+      throw Err() << "newline characters are not supported by the multiplexer";
+    write_all(fd, join_words({act, dev, cmd}) + "\n");
+    return read_answer();
+  }
+};
+
 /*************************************************/
 void
 check_par_count(const std::vector<std::string> & pars,
@@ -215,6 +797,8 @@ main(int argc, char ** argv) {
     std::string on("DEVCLI");
     options.add("server",  1,'s', on, "Server (default: localhost).");
     options.add("port",    1,'p', on, "Port (default: 8082).");
+    options.add("socket",  1,0,   on, "Connect to the server through a unix domain socket "
+                                      "instead of TCP (default: empty).");
     options.add("via",     1,'v', on, "Connect to the server through a tunnel. "
                                       "Argument: name of the gateway.");
     options.add("via_cmd", 1,0  , on, "Specify command template for making the tunnel, with $L, $R, $H, "
@@ -223,6 +807,17 @@ main(int argc, char ** argv) {
     options.add("lock",    0,'l', on, "Lock the device (only for use_dev action).");
     options.add("name",    0,'n', on, "Set connection name (only for use_dev action). "
                                       "Default: \"device_c(<pid>)\". If empty, reset to server default name");
+    options.add("pipeline",1,0,   on, "Use SPP version 3 with tagged requests in use_dev and use_srv "
+                                      "modes, process up to N requests in parallel (default: 0, "
+                                      "use SPP version 1). With --lock option requests go one by one.");
+    options.add("mux",     1,'m', on, "Unix socket of the connection multiplexer. With \"mux\" action "
+                                      "run the multiplexer, with other actions use it if it is running.");
+    options.add("retry",   1,0,   on, "Number of retries if the device is busy (server returns 503 code). "
+                                      "Delay is taken from Retry-After header, 1 to 10 s (default: 3).");
+    options.add("priority",1,0,   on, "Priority of requests to devices, integer, higher is served first "
+                                      "(default: 0).");
+    options.add("deadline",1,0,   on, "Fail requests to devices if they can not be started in this time, "
+                                      "seconds (default: no deadline).");
     options.add("help",    0,'h', on, "Print help message and exit.");
     options.add("pod",     0,0,   on, "Print help message in POD format and exit.");
 
@@ -236,73 +831,139 @@ main(int argc, char ** argv) {
 
     // read config file
     std::string cfgfile = "/etc/device2/device_c.cfg";
-    Opt optsf = read_conf(cfgfile, {"server", "port", "via", "via_cmd"});
+    Opt optsf = read_conf(cfgfile, {"server", "port", "socket", "via", "via_cmd", "mux"});
     opts.put_missing(optsf);
 
     // extract parameters
     auto server = opts.get("server", "localhost");
     int port = opts.get("port", 8082);
     auto srv = "http://" + server + ":" + type_to_str(port);
+    if (opts.get("socket", "") != ""){
+      if (opts.exists("via"))
+        throw Err() << "--via and --socket options can not be used together";
+      srv = "unix:" + opts.get("socket", "");
+    }
     auto name = opts.get("name",
       std::string("device_c(") + type_to_str(getpid())+")");
 
-    // create a tunnel if needed
-    if (opts.exists("via")) srv = create_tunnel(opts);
-
     // some non-option arguments needed!
     if (pars.size()==0) usage(options);
     auto & action = pars[0];
 
-    Downloader D(srv);
+    // use the multiplexer if it is running
+    std::unique_ptr<MuxClient> M;
+    bool nl = false;
+    for (auto const & p: pars) if (p.find('\n') != std::string::npos) nl = true;
+    bool rargs = opts.exists("priority") || opts.exists("deadline");
+    if (opts.exists("mux") && mux_action(action) && !nl && !rargs){
+      try { M.reset(new MuxClient(opts.get("mux", ""), srv)); }
+      catch (Err & e) {} // use direct connection
+    }
+
+    // run the multiplexer
+    if (action == "mux"){
+      check_par_count(pars, 1);
+      if (opts.get("mux", "") == "")
+        throw Err() << "socket is not set (use --mux option)";
+      auto srv0 = srv;
+      if (opts.exists("via")) srv = create_tunnel(opts);
+      Downloader D(srv);
+      Mux(D, srv0, name).run(opts.get("mux", ""));
+      return 0;
+    }
+
+    // create a tunnel if needed
+    if (!M && opts.exists("via")) srv = create_tunnel(opts);
+
+    std::unique_ptr<Downloader> D;
+    if (!M) {
+      D.reset(new Downloader(srv));
+      if (opts.exists("priority")) D->add_arg("priority", opts.get("priority"));
+      if (opts.exists("deadline")) D->add_arg("deadline", opts.get("deadline"));
+      D->set_retries(opts.get("retry", 3));
+    }
+
+    // ask the server, through the multiplexer if possible
+    auto get = [&](const std::string & act,
+                   const std::string & dev,
+                   const std::string & cmd){
+      return M? M->get(act, dev, cmd) : D->get(act, dev, cmd);
+    };
 
     if (action == "ask"){
       if (pars.size()<3)
         throw Err() << "not enough parameters for \"ask\" action";
       std::vector<std::string> args(pars.begin()+2, pars.end());
-      std::cout << D.get(action, pars[1], join_words(args)) << "\n";
-      D.get("release", pars[1]);
+      auto cmd = join_words(args);
+      std::cout << get(action, pars[1], cmd) << "\n";
+      // keep the device in use if the multiplexer is used
+      if (D) D->get("release", pars[1]);
+      return 0;
+    }
+
+    if (action == "multi_ask"){
+      if (pars.size()<3 || pars.size()%2 != 1)
+        throw Err() << "\"multi_ask\" action needs pairs of device and message";
+      std::vector<std::vector<std::string> > reqs;
+      for (size_t i=1; i+1<pars.size(); i+=2)
+        reqs.push_back({"ask", pars[i], pars[i+1]});
+      bool err = false;
+      for (auto const & a: D->multi_get(reqs)){
+        if (a.ok) std::cout << a.data << "\n";
+        else {std::cout << "#Error: " << a.data << "\n"; err = true;}
+      }
+      if (err) throw Err();
       return 0;
     }
 
     if (action == "use_dev"){
       check_par_count(pars, 2);
-      D.use_dev(pars[1], std::cin, std::cout, opts.exists("lock"), name);
+      // locked device can not be used through other connections
+      int nconn = opts.get("pipeline", 0);
+      if (nconn>1 && opts.exists("lock")) nconn = 1;
+      D->use_dev(pars[1], std::cin, std::cout, opts.exists("lock"), name, nconn);
       return 0;
     }
 
     if (action == "use_srv"){
       check_par_count(pars, 1);
-      D.use_srv(std::cin, std::cout);
+      D->use_srv(std::cin, std::cout, opts.get("pipeline", 0));
       return 0;
     }
 
     if (action == "list" || action == "devices") {
       check_par_count(pars, 1);
-      std::cout << D.get(action);
+      std::cout << get(action, "", "");
       return 0;
     }
 
     if (action == "monitor") {
       check_par_count(pars, 2);
-      D.monitor(pars[1], std::cout);
+      D->monitor(pars[1], std::cout);
       return 0;
     }
 
     if (action == "reload") {
       check_par_count(pars, 1);
-      std::cout << D.get(action) << "\n";
+      std::cout << get(action, "", "") << "\n";
+      return 0;
+    }
+
+    if (action == "check"){
+      if (pars.size()>2) check_par_count(pars, 2);
+      std::cout << get(action, pars.size()>1? pars[1]:"", "");
       return 0;
     }
 
     if (action == "info"){
       check_par_count(pars, 2);
-      std::cout << D.get(action, pars[1]);
+      std::cout << get(action, pars[1], "");
       return 0;
     }
 
     if (action == "ping"){
       check_par_count(pars, 1);
-      auto ret = D.get(action);
+      auto ret = get(action, "", "");
       if ( ret != "")
         throw Err() << "wrong response from the server: " << ret;
       return 0;
@@ -310,7 +971,7 @@ main(int argc, char ** argv) {
 
     if (action == "get_time"){
       check_par_count(pars, 1);
-      std::cout << D.get(action) << "\n";
+      std::cout << get(action, "", "") << "\n";
       return 0;
     }
 
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <memory>
+#include <cstdlib>
 
 #include <csignal>
 #include <sys/types.h>
@@ -23,6 +25,7 @@
 #define DEF_LOGFILE "/var/log/device_d.log"
 #define DEF_ADDR    "127.0.0.1"
 #define DEF_PORT    8082
+#define DEF_SMODE   "0666"
 #define DEF_VERB    1
 
 #define STR(s) STR_(s)
@@ -71,7 +74,17 @@ main(int argc, char ** argv) {
     options.add("cfgfile", 1,'C', "DEVSERV", "Server configuration file (default: " DEF_CFGFILE ").");
     options.add("devfile", 1,'D', "DEVSERV", "Device list file (default: " DEF_DEVFILE ").");
     options.add("addr",    1,'a', "DEVSERV", "IP address to listen. Use '*' to listen everywhere (default: " DEF_ADDR ").");
-    options.add("port",    1,'p', "DEVSERV", "TCP port for connections (default: " STR(DEF_PORT) ").");
+    options.add("port",    1,'p', "DEVSERV", "TCP port for connections, 0 to disable TCP connections (default: " STR(DEF_PORT) ").");
+    options.add("socket",  1,0,   "DEVSERV", "Also listen unix domain socket (default: empty, do not use unix socket).");
+    options.add("socket_mode", 1,0, "DEVSERV", "Access mode of the unix socket, octal (default: " DEF_SMODE ").");
+    options.add("preopen", 1,0,   "DEVSERV", "Open devices on start and after reloading configuration: "
+      "comma-separated list of device names or '*' for all devices (default: empty).");
+    options.add("preopen_jobs", 1,0, "DEVSERV", "Number of devices opened in parallel by --preopen option "
+      "and check action (default: 8).");
+    options.add("max_queue", 1,0, "DEVSERV", "Default maximum number of requests waiting for a device, "
+      "extra requests are rejected with 503 code (default: 0, no limit).");
+    options.add("max_wait", 1,0, "DEVSERV", "Default maximum time of waiting for a device, s, "
+      "then request is rejected with 503 code (default: 0, no limit).");
     options.add("dofork",  0,'f', "DEVSERV", "Do fork and run as a daemon.");
     options.add("stop",    0,'S', "DEVSERV", "Stop running daemon (found by pid-file).");
     options.add("reload",  0,'R', "DEVSERV", "Reload configuration of running daemon (found by pid-file).");
@@ -102,12 +115,14 @@ main(int argc, char ** argv) {
     // read config file
     std::string cfgfile = opts.get("cfgfile", DEF_CFGFILE);
     Opt optsf = read_conf(cfgfile,
-       {"addr", "port","logfile","pidfile","devfile","user","verbose"});
+       {"addr", "port","socket","socket_mode","preopen","preopen_jobs","max_queue","max_wait","logfile","pidfile","devfile","user","verbose"});
     opts.put_missing(optsf);
 
     // extract parameters
     std::string addr = opts.get("addr", DEF_ADDR);
     int port    = opts.get("port", DEF_PORT);
+    std::string sock = opts.get("socket", "");
+    int smode   = strtol(opts.get("socket_mode", DEF_SMODE).c_str(), NULL, 8);
     bool dofork = opts.exists("dofork");
     bool stop   = opts.exists("stop");
     bool reload = opts.exists("reload");
@@ -231,13 +246,26 @@ main(int argc, char ** argv) {
         Log(1) << "Starting device_d in console mode, pid=" << pid;
     }
 
-    // create device manager
-    DevManager dm(devfile);
+    // create device manager, with default device parameters
+    DevManager dm(devfile, opts);
     dmp = &dm; // pointer for ReloadFunc
 
-    HTTP_Server srv(addr, port, test, &dm);
-    Log(1) << "HTTP server is running at "
-      << addr << ":" << port;
+    // open devices
+    dm.set_preopen(opts.get("preopen", ""), opts.get("preopen_jobs", 8));
+
+    if (port==0 && sock=="")
+      throw Err() << "TCP port or unix socket should be set";
+
+    std::unique_ptr<HTTP_Server> srv, srv_unix;
+    if (port!=0){
+      srv.reset(new HTTP_Server(addr, port, test, &dm));
+      Log(1) << "HTTP server is running at "
+        << addr << ":" << port;
+    }
+    if (sock!=""){
+      srv_unix.reset(new HTTP_Server(sock, smode, &dm));
+      Log(1) << "HTTP server is running at unix socket " << sock;
+    }
     if (test) Log(1) << "TESTING MODE";
 
     // set up signals
@@ -11,6 +11,10 @@
 #include "drv_serial_et.h"
 #include "drv_serial_simple.h"
 #include "drv_gpib.h"
+#include "drv_hislip.h"
+#include "drv_vxi11.h"
+#include "drv_modbus.h"
+#include "drv_device2.h"
 
 std::shared_ptr<Driver>
 Driver::create(const std::string & name, const Opt & args){
@@ -18,8 +22,14 @@ Driver::create(const std::string & name, const Opt & args){
   if (name == "test")
     return std::shared_ptr<Driver>(new Driver_test(args));
 
-  if (name == "spp")
+  if (name == "test_spp")
+    return std::shared_ptr<Driver>(new Driver_test_spp(args));
+
+  if (name == "spp") {
+    if (args.get("instances", 1) > 1)
+      return std::shared_ptr<Driver>(new Driver_spp_pool(args));
     return std::shared_ptr<Driver>(new Driver_spp(args));
+  }
 
   if (name == "usbtmc")
     return std::shared_ptr<Driver>(new Driver_usbtmc(args));
@@ -51,5 +61,20 @@ Driver::create(const std::string & name, const Opt & args){
   if (name == "gpib")
      return std::shared_ptr<Driver>(new Driver_gpib(args));
 
+  if (name == "hislip")
+     return std::shared_ptr<Driver>(new Driver_hislip(args));
+
+  if (name == "vxi11")
+     return std::shared_ptr<Driver>(new Driver_vxi11(args));
+
+  if (name == "modbus_tcp")
+     return std::shared_ptr<Driver>(new Driver_modbus_tcp(args));
+
+  if (name == "modbus_rtu")
+     return std::shared_ptr<Driver>(new Driver_modbus_rtu(args));
+
+  if (name == "device2")
+     return std::shared_ptr<Driver>(new Driver_device2(args));
+
   throw Err() << "unknown driver: " << name;
 }
@@ -5,6 +5,11 @@
 #include <memory>
 #include "opt/opt.h"
 
+// Error code for errors reported by the device itself (error answers,
+// nack characters). Other driver errors are communication errors
+// (timeouts, I/O errors), they are counted by device circuit breakers.
+#define ERR_ANSWER -6
+
 /*************************************************/
 // base class
 
@@ -25,6 +30,22 @@ public:
   // Send message to the device, get answer
   virtual std::string ask(const std::string & msg) = 0;
 
+  // Max number of requests which can be processed simultaneously.
+  // If it is more then 1, ask() can be called from different threads.
+  virtual int parallel() const {return 1;}
+
+  // Does ask() read an answer for a compound SCPI message with a query
+  // after other commands (`FREQ 1;:MEAS?`)? Used by the device for
+  // merging write-only commands into queries (-scpi_merge parameter).
+  virtual bool read_compound() const {return false;}
+
+  // The device is locked (unlocked) by its only user. Drivers of
+  // remote devices lock them on the remote side, throw Err if it
+  // is not possible.
+  virtual void lock(const bool) {}
+
+  virtual ~Driver() {}
+
 };
 
 #endif
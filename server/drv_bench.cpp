@@ -0,0 +1,240 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <sys/time.h>
+
+#include "getopt/getopt.h"
+#include "err/err.h"
+#include "drv.h"
+#include "sim.h"
+
+/*************************************************/
+// Benchmark of driver read/write paths using instrument simulators.
+
+// print help message
+void usage(const GetOptSet & options, bool pod=false){
+  HelpPrinter pr(pod, options, "drv_bench");
+  pr.name("benchmark of device drivers using instrument simulators");
+  pr.usage("[<options>] [<driver> ...]");
+  pr.par("Drivers: test, spp, spp_stream, spp_data, spp_data_stream, "
+         "serial, serial_asm340, serial_vs_ld, "
+         "serial_tenma_ps, serial_et, serial_simple, net, net_gpib_prologix, hislip, vxi11. "
+         "By default all drivers are tested. Targets spp_data* use a program "
+         "with long answers (10000 lines), *_stream targets use "
+         "iostream-based pipes (-fast_pipe 0).");
+  pr.head(1, "Options:");
+  pr.opts({"BENCH"});
+  throw Err();
+}
+
+// current time, seconds
+double
+now(){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+// Benchmark target: name (driver name by default), driver name,
+// simulator type, simulator and driver options, message (if it
+// should differ from the -msg option).
+struct Target {
+  std::string name, drv, sim, msg;
+  Opt sim_opts, drv_opts;
+};
+
+std::vector<Target>
+make_targets(){
+  std::vector<Target> ret;
+  Target t;
+
+  t = Target();
+  t.drv = "test";
+  ret.push_back(t);
+
+  t = Target();
+  t.drv = "spp";
+  t.drv_opts.put("prog", "test_data/spp.sh");
+  ret.push_back(t);
+
+  t.name = "spp_stream";
+  t.drv_opts.put("fast_pipe", 0);
+  ret.push_back(t);
+
+  t = Target();
+  t.name = "spp_data"; t.drv = "spp"; t.msg = "10000";
+  t.drv_opts.put("prog", "test_data/spp_data.sh");
+  ret.push_back(t);
+
+  t.name = "spp_data_stream";
+  t.drv_opts.put("fast_pipe", 0);
+  ret.push_back(t);
+
+  t = Target();
+  t.drv = "serial"; t.sim = "serial";
+  t.drv_opts.put("ndelay", 0);
+  t.drv_opts.put("raw", 1);
+  t.drv_opts.put("vmin", 0);
+  t.drv_opts.put("timeout", 2.0);
+  t.drv_opts.put("delay", 0);
+  t.drv_opts.put("add_str", "\n");
+  t.drv_opts.put("trim_str", "\n");
+  ret.push_back(t);
+
+  t = Target();
+  t.drv = "serial_asm340"; t.sim = "serial";
+  t.sim_opts.put("eol", "\r");
+  t.sim_opts.put("add_str", "\r\x06");
+  ret.push_back(t);
+
+  t = Target();
+  t.drv = "serial_vs_ld"; t.sim = "serial";
+  t.sim_opts.put("add_str", "\nok");
+  ret.push_back(t);
+
+  t = Target();
+  t.drv = "serial_tenma_ps"; t.sim = "serial";
+  t.sim_opts.put("eol", "");
+  t.sim_opts.put("add_str", "");
+  ret.push_back(t);
+
+  t = Target();
+  t.drv = "serial_et"; t.sim = "serial";
+  t.sim_opts.put("add_str", "\n\n");
+  ret.push_back(t);
+
+  t = Target();
+  t.drv = "serial_simple"; t.sim = "serial";
+  ret.push_back(t);
+
+  t = Target();
+  t.drv = "net"; t.sim = "net";
+  t.drv_opts.put("addr", "127.0.0.1");
+  ret.push_back(t);
+
+  t = Target();
+  t.drv = "net_gpib_prologix"; t.sim = "net";
+  t.sim_opts.put("prologix", 1);
+  t.drv_opts.put("addr", "127.0.0.1");
+  t.drv_opts.put("gpib_addr", 1);
+  ret.push_back(t);
+
+  t = Target();
+  t.drv = "hislip"; t.sim = "hislip";
+  t.drv_opts.put("addr", "127.0.0.1");
+  ret.push_back(t);
+
+  t = Target();
+  t.drv = "vxi11"; t.sim = "vxi11";
+  t.drv_opts.put("addr", "127.0.0.1");
+  ret.push_back(t);
+
+  return ret;
+}
+
+/*************************************************/
+int
+main(int argc, char ** argv) {
+
+  try {
+    GetOptSet options;
+    options.add("num",   1,'n', "BENCH", "Number of requests for each driver (default: 50).");
+    options.add("delay", 1,'d', "BENCH", "Response latency of simulators, seconds (default: 0).");
+    options.add("size",  1,'s', "BENCH", "Answer size, bytes (default: 0, repeat the message).");
+    options.add("msg",   1,'m', "BENCH", "Message (default: \"MEAS?\").");
+    options.add("help",  0,'h', "BENCH", "Print help message and exit.");
+    options.add("pod",   0,0,   "BENCH", "Print help message in POD format and exit.");
+
+    std::vector<std::string> drivers;
+    Opt opts = parse_options_all(&argc, &argv, options, {}, drivers);
+    if (opts.exists("help")) usage(options);
+    if (opts.exists("pod"))  usage(options,true);
+
+    int num      = opts.get("num", 50);
+    double delay = opts.get("delay", 0.0);
+    size_t size  = opts.get<size_t>("size", 0);
+    std::string msg = opts.get("msg", "MEAS?");
+
+    auto targets = make_targets();
+
+    std::cout << std::left << std::setw(20) << "driver"
+              << std::right
+              << std::setw(6)  << "num"
+              << std::setw(6)  << "err"
+              << std::setw(10) << "open,ms"
+              << std::setw(10) << "mean,ms"
+              << std::setw(10) << "min,ms"
+              << std::setw(10) << "max,ms"
+              << std::setw(10) << "kB/s" << "\n";
+
+    for (auto & t: targets){
+      if (t.name.empty()) t.name = t.drv;
+      if (drivers.size() && std::find(drivers.begin(),
+          drivers.end(), t.name) == drivers.end()) continue;
+
+      // start simulator
+      if (delay>0) t.sim_opts.put("delay", delay);
+      if (size>0)  t.sim_opts.put("answer_size", size);
+      std::unique_ptr<SimInstr> sim;
+      if (t.sim == "serial"){
+        auto s = new SimSerial(t.sim_opts);
+        sim.reset(s);
+        t.drv_opts.put("dev", s->dev());
+      }
+      if (t.sim == "net"){
+        auto s = new SimNet(t.sim_opts);
+        sim.reset(s);
+        t.drv_opts.put("port", s->port());
+      }
+      if (t.sim == "hislip"){
+        auto s = new SimHiSLIP(t.sim_opts);
+        sim.reset(s);
+        t.drv_opts.put("port", s->port());
+      }
+      if (t.sim == "vxi11"){
+        auto s = new SimVXI11(t.sim_opts);
+        sim.reset(s);
+        t.drv_opts.put("port", s->port());
+      }
+      if (t.drv == "test"){
+        if (delay>0) t.drv_opts.put("delay", delay);
+        if (size>0)  t.drv_opts.put("answer_size", size);
+      }
+
+      double t0 = now();
+      auto drv = Driver::create(t.drv, t.drv_opts);
+      double topen = now()-t0;
+
+      double tmin=-1, tmax=0, tsum=0;
+      size_t bytes=0;
+      int err=0;
+      for (int i=0; i<num; i++){
+        double t1 = now();
+        try { bytes += drv->ask(t.msg.size()? t.msg : msg).size(); }
+        catch (Err & e) { err++; }
+        double dt = now()-t1;
+        tsum += dt;
+        if (tmin<0 || dt<tmin) tmin = dt;
+        if (dt>tmax) tmax = dt;
+      }
+
+      std::cout << std::left << std::setw(20) << t.name
+                << std::right << std::fixed << std::setprecision(3)
+                << std::setw(6)  << num
+                << std::setw(6)  << err
+                << std::setw(10) << topen*1e3
+                << std::setw(10) << (num? tsum/num*1e3 : 0)
+                << std::setw(10) << tmin*1e3
+                << std::setw(10) << tmax*1e3
+                << std::setw(10) << (tsum>0? bytes/tsum/1e3 : 0) << "\n";
+    }
+  }
+  catch (Err e){
+    if (e.str()!="") std::cerr << "Error: " << e.str() << "\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,407 @@
+#include "drv_device2.h"
+#include "drv_net.h"
+#include "cmd_queue.h"
+#include "unix_sock.h"
+#include "err/err.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <poll.h>
+#include <sys/socket.h>
+
+// period of keep-alive requests, s (server closes idle connections in 10s)
+#define DEVICE2_PING_PERIOD 5
+
+/*************************************************/
+void
+HttpConn::open(const std::string & addr, const std::string & port,
+               const std::string & sock, const double timeout){
+  close();
+  if (sock.size()){
+    fd = unix_sock_connect(sock);
+    host = "localhost";
+  }
+  else {
+    fd = tcp_connect(addr, port, "", timeout, 60.0);
+    host = addr;
+  }
+}
+
+void
+HttpConn::close(){
+  if (fd>=0) ::close(fd);
+  fd = -1;
+  buf.clear();
+}
+
+bool
+HttpConn::recv_more(const std::chrono::steady_clock::time_point & t_end,
+                    const std::function<bool()> & alive){
+  char tmp[65536];
+  while (1){
+    auto dt = std::chrono::duration_cast<std::chrono::milliseconds>(
+      t_end - std::chrono::steady_clock::now()).count();
+    if (dt<0) dt = 0;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int res = poll(&pfd, 1, alive? std::min<long>(dt, ALIVE_CHECK_MS) : dt);
+    if (res<0 && errno==EINTR) continue;
+    if (res<0) throw Err() << "poll error: " << strerror(errno);
+    if (res==0 && alive && !alive())
+      throw Err(ERR_CANCELLED) << "request cancelled: client disconnected";
+    if (res==0 && dt>ALIVE_CHECK_MS && alive) continue;
+    if (res==0) throw Err() << "read timeout";
+
+    auto r = ::recv(fd, tmp, sizeof(tmp), 0);
+    if (r<0 && errno==EINTR) continue;
+    if (r<0 && errno==ECONNRESET) return false;
+    if (r<0) throw Err() << "read error: " << strerror(errno);
+    if (r==0) return false;
+    buf.append(tmp, r);
+    return true;
+  }
+}
+
+int
+HttpConn::get(const std::string & url, std::string & body,
+              double & retry_after, const double timeout,
+              const std::function<bool()> & alive){
+  if (fd<0) throw Err() << "not connected";
+  auto t_end = std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(timeout));
+
+  buf.clear();
+  // write error: connection was closed by the server
+  try { write_all(fd, "GET " + url + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n"); }
+  catch (Err & e) { return 0; }
+
+  // status line and headers
+  size_t he;
+  while ((he = buf.find("\r\n\r\n")) == std::string::npos){
+    if (recv_more(t_end, alive)) continue;
+    if (buf.empty()) return 0;
+    throw Err() << "connection closed by the server";
+  }
+  if (buf.compare(0, 5, "HTTP/") != 0) throw Err() << "bad HTTP response";
+  auto sp = buf.find(' ');
+  int code = (sp<he) ? atoi(buf.c_str()+sp+1) : 0;
+  if (code<100) throw Err() << "bad HTTP response";
+
+  long clen = -1;
+  bool chunked = false, close_conn = false;
+  retry_after = 0;
+  size_t p = buf.find("\r\n")+2;
+  while (p < he){
+    auto e = buf.find("\r\n", p);
+    auto l = buf.substr(p, e-p);
+    p = e+2;
+    auto c = l.find(':');
+    if (c == std::string::npos) continue;
+    auto n = l.substr(0, c);
+    auto v = l.substr(c+1);
+    while (v.size() && v[0]==' ') v.erase(0,1);
+    if (strcasecmp(n.c_str(), "Content-Length")==0) clen = atol(v.c_str());
+    if (strcasecmp(n.c_str(), "Retry-After")==0) retry_after = atof(v.c_str());
+    if (strcasecmp(n.c_str(), "Transfer-Encoding")==0 &&
+        strcasecmp(v.c_str(), "chunked")==0) chunked = true;
+    if (strcasecmp(n.c_str(), "Connection")==0 &&
+        strcasecmp(v.c_str(), "close")==0) close_conn = true;
+  }
+  buf.erase(0, he+4);
+
+  // body
+  body.clear();
+  if (chunked){
+    while (1){
+      size_t e;
+      while ((e = buf.find("\r\n")) == std::string::npos)
+        if (!recv_more(t_end, alive)) throw Err() << "connection closed by the server";
+      size_t n = strtoul(buf.c_str(), NULL, 16);
+      buf.erase(0, e+2);
+      while (buf.size() < n+2)
+        if (!recv_more(t_end, alive)) throw Err() << "connection closed by the server";
+      if (n==0) { buf.erase(0, 2); break; } // no trailers
+      body.append(buf, 0, n);
+      buf.erase(0, n+2);
+    }
+  }
+  else if (clen>=0){
+    while (buf.size() < (size_t)clen)
+      if (!recv_more(t_end, alive)) throw Err() << "connection closed by the server";
+    body = buf.substr(0, clen);
+    buf.erase(0, clen);
+  }
+  else {
+    while (recv_more(t_end, alive)) {}
+    body.swap(buf);
+    close_conn = true;
+  }
+  if (close_conn) close();
+  return code;
+}
+
+std::string
+HttpConn::escape(const std::string & s){
+  static const char hex[] = "0123456789ABCDEF";
+  std::string ret;
+  for (unsigned char c: s){
+    if (isalnum(c) || c=='-' || c=='_' || c=='.' || c=='~') ret += c;
+    else {ret += '%'; ret += hex[c>>4]; ret += hex[c&0xf];}
+  }
+  return ret;
+}
+
+std::string
+HttpConn::make_url(const std::string & act,
+                   const std::string & arg, const std::string & msg){
+  std::string url = "/" + escape(act);
+  if (arg!="") url += "/" + escape(arg);
+  if (msg!="") url += "/" + escape(msg);
+  return url;
+}
+
+/*************************************************/
+
+Driver_device2::Driver_device2(const Opt & opts): locked(false), stop(false) {
+  opts.check_unknown({"addr","port","socket","dev","name","conns",
+    "timeout","connect_timeout","errpref","idn","reconnect","reconnect_max"});
+
+  errpref = opts.get("errpref", "device2: ");
+
+  dev = opts.get("dev", "");
+  if (dev == "") throw Err() << errpref
+    << "Parameter -dev is empty or missing";
+
+  addr = opts.get("addr", "localhost");
+  port = opts.get("port", "8082");
+  sock = opts.get("socket", "");
+  name = opts.get("name", "");
+  errpref += (sock.size()? sock : addr + ":" + port) + "/" + dev + ": ";
+
+  timeout = opts.get("timeout", 20.0);
+  connect_timeout = opts.get("connect_timeout", 5.0);
+  idn = opts.get("idn", "");
+  reconnect = opts.get("reconnect", true);
+  double dmax = opts.get("reconnect_max", 10.0);
+  int n = opts.get("conns", 4);
+  if (n<1) throw Err() << errpref << "-conns should be positive";
+  for (int i=0; i<n; i++) conns.emplace_back(new Conn(dmax));
+
+  // open the primary connection, use the device
+  try { open_conn(0); }
+  catch (Err & e) { throw Err(e.code()) << errpref << e.str(); }
+
+  thr = std::thread(&Driver_device2::keepalive_loop, this);
+}
+
+Driver_device2::~Driver_device2(){
+  {
+    std::lock_guard<std::mutex> lk(m);
+    stop = true;
+  }
+  cv.notify_all();
+  if (thr.joinable()) thr.join();
+  // the server releases the device when connections are closed
+}
+
+std::string
+Driver_device2::call(Conn & c, const std::string & act,
+                     const std::string & arg, const std::string & msg){
+  std::string body;
+  double ra = 0;
+  int code;
+  c.stale = false;
+  try { code = c.h.get(HttpConn::make_url(act, arg, msg), body, ra, timeout); }
+  catch (Err & e) {
+    c.h.close();
+    throw;
+  }
+  c.last = std::chrono::steady_clock::now();
+  if (code == 0){
+    c.h.close();
+    c.stale = true;
+    throw Err() << "connection closed by the server";
+  }
+  if (code == 200) return body;
+  if (code == 503){
+    ErrBusy e(ra);
+    e << body;
+    throw e;
+  }
+  if (code == 409) throw Err(ERR_SUPERSEDED) << body;
+  throw Err(ERR_ANSWER) << body;
+}
+
+void
+Driver_device2::open_conn(const size_t i){
+  auto & c = *conns[i];
+  c.h.open(addr, port, sock, connect_timeout);
+  c.opened = true;
+  c.last = std::chrono::steady_clock::now();
+  if (i!=0) return;
+  try {
+    call(c, "use", dev);
+    if (name != "") call(c, "set_conn_name", name);
+    if (locked) call(c, "lock", dev);
+  }
+  catch (Err & e) {
+    c.h.close();
+    throw;
+  }
+}
+
+std::string
+Driver_device2::request(const size_t i, const std::string & act,
+                        const std::string & arg, const std::string & msg){
+  auto & c = *conns[i];
+  for (int attempt=0; ; attempt++){
+    bool reused = c.h.is_open();
+    if (!reused){
+      if (c.opened && !reconnect) throw Err() << errpref << c.err;
+      if (!c.backoff.ready()) throw Err() << errpref << c.err
+        << " (reconnecting in " << c.backoff.wait() << " s)";
+      try { open_conn(i); }
+      catch (Err & e) {
+        c.backoff.fail();
+        c.err = e.str();
+        throw Err(e.code()) << errpref << e.str();
+      }
+      c.backoff.reset();
+    }
+    try { return call(c, act, arg, msg); }
+    catch (ErrBusy & e) { throw; }
+    catch (Err & e) {
+      if (e.code() == ERR_ANSWER || e.code() == ERR_SUPERSEDED) throw;
+      // keep-alive connection was closed by the server: repeat once
+      if (c.stale && reused && attempt==0) continue;
+      c.err = e.str();
+      throw Err() << errpref << e.str();
+    }
+  }
+}
+
+size_t
+Driver_device2::take(const bool primary){
+  std::unique_lock<std::mutex> lk(m);
+  while (1){
+    // idle open connection, then idle closed one
+    size_t best = conns.size();
+    for (size_t i=0; i<conns.size(); i++){
+      if ((primary || locked) && i!=0) break;
+      auto & c = *conns[i];
+      if (c.busy) continue;
+      if (c.h.is_open()) { best = i; break; }
+      if (best == conns.size()) best = i;
+    }
+    if (best < conns.size()){
+      conns[best]->busy = true;
+      return best;
+    }
+    cv.wait(lk);
+  }
+}
+
+void
+Driver_device2::give(const size_t i){
+  {
+    std::lock_guard<std::mutex> lk(m);
+    conns[i]->busy = false;
+  }
+  cv.notify_all();
+}
+
+void
+Driver_device2::take_all(std::unique_lock<std::mutex> & lk){
+  cv.wait(lk, [this](){
+    for (auto const & c: conns) if (c->busy) return false;
+    return true;
+  });
+  for (auto & c: conns) c->busy = true;
+}
+
+void
+Driver_device2::keepalive_loop(){
+  std::unique_lock<std::mutex> lk(m);
+  while (!stop){
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i=0; i<conns.size() && !stop; i++){
+      auto & c = *conns[i];
+      if (c.busy) continue;
+      bool ping = c.h.is_open() &&
+        now - c.last > std::chrono::seconds(DEVICE2_PING_PERIOD);
+      // the primary connection keeps the device in use (and locked)
+      bool reopen = i==0 && !c.h.is_open() && reconnect && c.backoff.ready();
+      if (!ping && !reopen) continue;
+      c.busy = true;
+      lk.unlock();
+      try { request(i, "ping"); }
+      catch (Err & e) {}
+      lk.lock();
+      c.busy = false;
+      cv.notify_all();
+    }
+    cv.wait_for(lk, std::chrono::milliseconds(100));
+  }
+}
+
+std::string
+Driver_device2::read() {
+  std::lock_guard<std::mutex> lk(m);
+  return last;
+}
+
+void
+Driver_device2::write(const std::string & msg) {
+  auto ret = ask(msg);
+  std::lock_guard<std::mutex> lk(m);
+  last = ret;
+}
+
+std::string
+Driver_device2::ask(const std::string & msg) {
+  if (idn.size() && strcasecmp(msg.c_str(),"*idn?")==0) return idn;
+  size_t i = take(false);
+  try {
+    auto ret = request(i, "ask", dev, msg);
+    give(i);
+    return ret;
+  }
+  catch (Err & e) {
+    give(i);
+    throw;
+  }
+}
+
+void
+Driver_device2::lock(const bool l) {
+  std::unique_lock<std::mutex> lk(m);
+  if (l == locked) return;
+  take_all(lk);
+  lk.unlock();
+  try {
+    if (l) {
+      // other connections should not use the device
+      for (size_t i=1; i<conns.size(); i++)
+        if (conns[i]->h.is_open()) request(i, "release", dev);
+      request(0, "lock", dev);
+    }
+    else if (conns[0]->h.is_open()) {
+      request(0, "unlock", dev);
+    }
+  }
+  catch (Err & e) {
+    if (l) {
+      lk.lock();
+      for (auto & c: conns) c->busy = false;
+      cv.notify_all();
+      throw;
+    }
+  }
+  lk.lock();
+  locked = l;
+  for (auto & c: conns) c->busy = false;
+  cv.notify_all();
+}
@@ -0,0 +1,171 @@
+#ifndef DRV_DEVICE2_H
+#define DRV_DEVICE2_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include "drv.h"
+#include "drv_utils.h"
+#include "opt/opt.h"
+
+/*************************************************/
+/*
+ * Driver `device2` -- device on another device2 server
+ *
+
+Driver talks HTTP directly to an upstream `device_d` server and sends
+messages to a device there. It keeps a pool of keep-alive connections,
+so a few requests can be processed in parallel (if the remote device
+allows it), and each request costs one network round trip.
+
+Device is used by the first (primary) connection while it is open
+locally, connection name is set there. When the local device is locked
+by its only user, the remote device is locked too (other connections
+release it, all requests go through the primary connection). Idle
+connections are pinged every 5 s, otherwise the server would close them
+and release the device. Remote errors are returned as device errors,
+"busy" answers (HTTP 503) are passed to the local client.
+
+Parameters:
+
+* `-addr <v>`      -- Server address. Default: localhost.
+* `-port <N>`      -- Server port. Default: 8082.
+* `-socket <v>`    -- Connect to the server through a unix domain socket
+                      instead of TCP. Default: empty.
+* `-dev <v>`       -- Name of the remote device. Required.
+* `-name <v>`      -- Connection name on the remote server.
+                      Default: empty, server default.
+* `-conns <N>`     -- Max number of connections (and parallel requests).
+                      Default: 4.
+* `-timeout <N>`   -- Request timeout, seconds. Should be larger than
+                      timeouts of the remote device. Default: 20.0.
+* `-connect_timeout <N>` -- Connection timeout, seconds. Default: 5.0.
+* `-errpref <str>` -- Prefix for error messages. Default: "device2: ".
+* `-idn <str>`     -- Override output of *idn? command.
+                      Default: empty string, do not override.
+* `-reconnect <v>`, `-reconnect_max <v>` -- Reconnection settings,
+                      same as in `net` driver.
+*/
+
+/*************************************************/
+// Keep-alive HTTP/1.1 connection to a device server (GET requests).
+
+class HttpConn {
+  int fd;
+  std::string host;
+  std::string buf; // received data
+
+  // Read more data into the buffer, return false on EOF.
+  // Throw Err on errors and timeouts, Err(ERR_CANCELLED) if `alive`
+  // function is set and returns false.
+  bool recv_more(const std::chrono::steady_clock::time_point & t_end,
+                 const std::function<bool()> & alive);
+
+public:
+  HttpConn(): fd(-1) {}
+  ~HttpConn() {close();}
+  HttpConn(const HttpConn &) = delete;
+  HttpConn & operator=(const HttpConn &) = delete;
+
+  // Connect to a TCP server, or to a unix socket if `sock` is
+  // not empty. Throw Err on errors.
+  void open(const std::string & addr, const std::string & port,
+            const std::string & sock, const double timeout);
+  void close();
+  bool is_open() const {return fd>=0;}
+
+  // Send GET request, read response: return HTTP status code, body and
+  // Retry-After header (0 if missing). Return 0 if the connection was
+  // closed before the response (keep-alive connection was closed by the
+  // server, request was not processed). Throw Err on other errors,
+  // the connection should be closed then. If `alive` function is set,
+  // it is checked while waiting for the response, and the request is
+  // cancelled (Err with ERR_CANCELLED code) if it returns false.
+  int get(const std::string & url, std::string & body,
+          double & retry_after, const double timeout,
+          const std::function<bool()> & alive = std::function<bool()>());
+
+  // Escape a URL component.
+  static std::string escape(const std::string & s);
+
+  // Build URL for a device server request: /<act>[/<arg>[/<msg>]]
+  static std::string make_url(const std::string & act,
+    const std::string & arg = std::string(),
+    const std::string & msg = std::string());
+};
+
+/*************************************************/
+
+class Driver_device2: public Driver {
+  std::string addr, port, sock, dev, name, errpref, idn;
+  double timeout, connect_timeout;
+  bool reconnect;
+
+  struct Conn {
+    HttpConn h;
+    bool busy;   // used by a request
+    bool stale;  // last request failed because the server closed the connection
+    bool opened; // the connection was opened at least once
+    Backoff backoff;
+    std::string err; // last connection error
+    std::chrono::steady_clock::time_point last; // time of the last request
+    Conn(const double dmax): busy(false), stale(false), opened(false),
+      backoff(0.1, dmax) {}
+  };
+  // conns[0] is the primary connection
+  std::vector<std::unique_ptr<Conn> > conns;
+  std::atomic<bool> locked;
+  std::string last; // answer for read()
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread thr; // pings idle connections, restores the primary one
+  bool stop;
+
+  // Do a request through an open connection. Errors are thrown
+  // without the error prefix.
+  std::string call(Conn & c, const std::string & act,
+                   const std::string & arg = std::string(),
+                   const std::string & msg = std::string());
+
+  // Open a connection. The primary connection uses the device,
+  // sets connection name and locks the device if needed.
+  void open_conn(const size_t i);
+
+  // Do a request, open the connection if needed, repeat
+  // the request if a keep-alive connection was closed by the server.
+  std::string request(const size_t i, const std::string & act,
+                      const std::string & arg = std::string(),
+                      const std::string & msg = std::string());
+
+  // Get an idle connection (only the primary one if primary=true,
+  // open ones are preferred), wait if all are busy.
+  size_t take(const bool primary);
+
+  // Return the connection to the pool.
+  void give(const size_t i);
+
+  // Wait until all connections are idle and mark them busy.
+  void take_all(std::unique_lock<std::mutex> & lk);
+
+  // Ping idle connections, reopen the primary one.
+  void keepalive_loop();
+
+public:
+
+  Driver_device2(const Opt & opts);
+  ~Driver_device2();
+
+  std::string read() override;
+  void write(const std::string & msg) override;
+  std::string ask(const std::string & msg) override;
+  void lock(const bool l) override;
+  int parallel() const override {return conns.size();}
+};
+
+#endif
@@ -0,0 +1,429 @@
+#include "drv_hislip.h"
+#include "drv_net.h"
+#include "err/err.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <chrono>
+#include <sys/socket.h>
+
+// initial message id (IVI-6.1, 3.1.2)
+#define HISLIP_FIRST_ID 0xffffff00
+// protocol version 1.0, vendor id "DS"
+#define HISLIP_VERSION  0x0100
+#define HISLIP_VENDOR   0x4453
+
+/*************************************************/
+// Protocol functions
+
+std::string
+Driver_hislip::encode_u64(const uint64_t v){
+  std::string ret(8, '\0');
+  for (int i=0; i<8; i++) ret[i] = (v >> (8*(7-i))) & 0xff;
+  return ret;
+}
+
+uint64_t
+Driver_hislip::decode_u64(const std::string & s){
+  uint64_t ret = 0;
+  for (size_t i=0; i<8 && i<s.size(); i++) ret = (ret<<8) | (uint8_t)s[i];
+  return ret;
+}
+
+std::string
+Driver_hislip::encode(const Msg & m){
+  std::string ret("HS");
+  ret.reserve(16 + m.data.size());
+  ret += (char)m.type;
+  ret += (char)m.ctl;
+  for (int i=3; i>=0; i--) ret += (char)((m.par >> (8*i)) & 0xff);
+  ret += encode_u64(m.data.size());
+  ret += m.data;
+  return ret;
+}
+
+bool
+Driver_hislip::decode(std::string & buf, Msg & m){
+  if (buf.size()<16) return false;
+  if (buf[0]!='H' || buf[1]!='S')
+    throw Err() << "HiSLIP: bad message header";
+  uint64_t len = decode_u64(buf.substr(8,8));
+  if (buf.size() < 16+len) return false;
+  m.type = buf[2];
+  m.ctl  = buf[3];
+  m.par  = 0;
+  for (int i=4; i<8; i++) m.par = (m.par<<8) | (uint8_t)buf[i];
+  m.data = buf.substr(16, len);
+  buf.erase(0, 16+len);
+  return true;
+}
+
+void
+Driver_hislip::send_msg(const int fd, const Msg & m){
+  auto s = encode(m);
+  size_t n = 0;
+  while (n < s.size()){
+    auto res = ::send(fd, s.data()+n, s.size()-n, MSG_NOSIGNAL);
+    if (res<0 && errno==EINTR) continue;
+    if (res<0) throw Err() << "write error: " << strerror(errno);
+    n += res;
+  }
+}
+
+bool
+Driver_hislip::recv_msg(const int fd, Msg & m, const double timeout){
+  auto t_end = std::chrono::steady_clock::time_point::max();
+  if (timeout>0) t_end = std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(timeout));
+  std::string buf(16, '\0');
+  if (!read_n(fd, &buf[0], 16, t_end, true)) return false;
+  if (buf[0]!='H' || buf[1]!='S')
+    throw Err() << "HiSLIP: bad message header";
+  uint64_t len = decode_u64(buf.substr(8,8));
+  buf.resize(16+len);
+  if (len>0) read_n(fd, &buf[16], len, t_end);
+  decode(buf, m);
+  return true;
+}
+
+/*************************************************/
+
+Driver_hislip::Driver_hislip(const Opt & opts):
+    sfd(-1), afd(-1), overlap(false), msg_id(HISLIP_FIRST_ID),
+    rmt(false), srq_stb(-1), reading(false), broken(false) {
+  opts.check_unknown({"addr","port","name","timeout","connect_timeout",
+    "max_msg_size","pipeline","errpref","idn","read_cond","add_str",
+    "trim_str","reconnect","reconnect_max"});
+
+  errpref = opts.get("errpref", "hislip: ");
+
+  addr = opts.get("addr", "");
+  if (addr == "") throw Err() << errpref
+    << "Parameter -addr is empty or missing";
+  port = opts.get("port", "4880");
+  name = opts.get("name", "hislip0");
+
+  errpref += addr + ":" + port + ": ";
+
+  timeout  = opts.get("timeout", 5.0);
+  connect_timeout = opts.get("connect_timeout", 5.0);
+  max_size = opts.get<uint64_t>("max_msg_size", 1<<20);
+  pipeline = opts.get("pipeline", 8);
+  add      = opts.get("add_str",  "\n");
+  trim     = opts.get("trim_str", "\n");
+  idn      = opts.get("idn", "");
+  read_cond = str_to_read_cond(opts.get("read_cond", "qmark1w"));
+  reconnect = opts.get("reconnect", true);
+  backoff = Backoff(0.1, opts.get("reconnect_max", 10.0));
+  if (max_size<256) throw Err() << errpref
+    << "-max_msg_size should be at least 256";
+  if (pipeline<1) throw Err() << errpref
+    << "-pipeline should be positive";
+
+  connect_channels();
+}
+
+Driver_hislip::~Driver_hislip() {
+  close_channels();
+}
+
+void
+Driver_hislip::connect_channels() {
+  try {
+    // synchronous channel
+    sfd = tcp_connect(addr, port, errpref, connect_timeout, 60.0);
+    send_msg(sfd, Msg(Initialize, 0,
+      (HISLIP_VERSION<<16) | HISLIP_VENDOR, name));
+    Msg r;
+    if (!recv_msg(sfd, r, timeout)) throw Err() << "initialization timeout";
+    if (r.type == FatalError || r.type == Error)
+      throw Err() << "initialization error: " << r.data;
+    if (r.type != InitializeResponse)
+      throw Err() << "unexpected message during initialization: " << (int)r.type;
+    overlap = r.ctl & 1;
+    uint16_t session = r.par & 0xffff;
+
+    // asynchronous channel
+    afd = tcp_connect(addr, port, errpref, connect_timeout, 60.0);
+    send_msg(afd, Msg(AsyncInitialize, 0, session));
+    if (!recv_msg(afd, r, timeout)) throw Err() << "initialization timeout";
+    if (r.type != AsyncInitializeResponse)
+      throw Err() << "unexpected message during initialization: " << (int)r.type;
+
+    // max message size
+    send_msg(afd, Msg(AsyncMaximumMessageSize, 0, 0, encode_u64(max_size)));
+    if (!recv_msg(afd, r, timeout)) throw Err() << "initialization timeout";
+    if (r.type != AsyncMaximumMessageSizeResponse)
+      throw Err() << "unexpected message during initialization: " << (int)r.type;
+    srv_max_size = decode_u64(r.data);
+    if (srv_max_size==0) srv_max_size = max_size;
+  }
+  catch (Err & e) {
+    close_channels();
+    if (e.str().compare(0, errpref.size(), errpref)==0) throw;
+    throw Err() << errpref << e.str();
+  }
+  msg_id = HISLIP_FIRST_ID;
+  rmt = false;
+  broken = false;
+}
+
+void
+Driver_hislip::close_channels() {
+  if (sfd>=0) ::close(sfd);
+  if (afd>=0) ::close(afd);
+  sfd = afd = -1;
+}
+
+void
+Driver_hislip::set_broken(const std::string & err) {
+  broken = true;
+  conn_err = err;
+  for (auto & p: pending) { p.second->err = errpref + err; p.second->done = true; }
+  pending.clear();
+  cv.notify_all();
+}
+
+void
+Driver_hislip::check_connection() {
+  if (!broken) return;
+  // another thread still reads the old channel
+  if (reading) throw Err() << errpref << conn_err;
+  close_channels();
+  if (!reconnect) throw Err() << errpref << conn_err;
+  if (!backoff.ready()) throw Err() << errpref << conn_err
+    << " (reconnecting in " << backoff.wait() << " s)";
+  try { connect_channels(); }
+  catch (Err & e) {
+    backoff.fail();
+    conn_err = e.str().substr(errpref.size());
+    throw;
+  }
+  backoff.reset();
+}
+
+void
+Driver_hislip::dispatch(const Msg & msg) {
+  switch (msg.type){
+    case Data:
+    case DataEnd: {
+      auto i = pending.find(msg.par);
+      if (i == pending.end()) break; // answer to a cancelled request
+      i->second->data += msg.data;
+      if (msg.type == DataEnd) {
+        i->second->done = true;
+        pending.erase(i);
+        rmt = true;
+      }
+      break;
+    }
+    case Error:
+      for (auto & p: pending) {
+        p.second->err = errpref + "device error: " + msg.data;
+        p.second->done = true;
+      }
+      pending.clear();
+      break;
+    case FatalError:
+      set_broken("fatal error: " + msg.data);
+      break;
+    default: // Interrupted and other messages are ignored
+      break;
+  }
+}
+
+Driver_hislip::Msg
+Driver_hislip::async_query(const Msg & msg, const uint8_t type) {
+  try {
+    send_msg(afd, msg);
+    while (1){
+      Msg r;
+      if (!recv_msg(afd, r, timeout)) throw Err() << "read timeout";
+      if (r.type == AsyncServiceRequest) { srq_stb = r.ctl; continue; }
+      if (r.type == FatalError) throw Err() << "fatal error: " << r.data;
+      if (r.type == type) return r;
+    }
+  }
+  catch (Err & e){
+    set_broken(e.str());
+    throw Err() << errpref << e.str();
+  }
+}
+
+void
+Driver_hislip::read_srq() {
+  try {
+    Msg r;
+    while (recv_msg(afd, r, 0.001))
+      if (r.type == AsyncServiceRequest) srq_stb = r.ctl;
+  }
+  catch (Err & e){
+    set_broken(e.str());
+    throw Err() << errpref << e.str();
+  }
+}
+
+void
+Driver_hislip::clear(std::unique_lock<std::mutex> & lk) {
+  // fail waiting requests
+  for (auto & p: pending) {
+    p.second->err = errpref + "device clear";
+    p.second->done = true;
+  }
+  pending.clear();
+  cv.notify_all();
+
+  // another thread still reads the synchronous channel
+  cv.wait(lk, [this](){ return !reading; });
+  if (broken) throw Err() << errpref << conn_err;
+
+  // device clear can change the mode: the device sends its preferred
+  // mode (overlapped bit in ack.ctl), we accept it, the final setting
+  // comes with DeviceClearAcknowledge
+  auto ack = async_query(Msg(AsyncDeviceClear), AsyncDeviceClearAcknowledge);
+  uint8_t ctl = ack.ctl;
+  try {
+    send_msg(sfd, Msg(DeviceClearComplete, ctl));
+    // wait for acknowledge, skip old answers
+    while (1){
+      Msg r;
+      if (!recv_msg(sfd, r, timeout)) throw Err() << "read timeout";
+      if (r.type == DeviceClearAcknowledge) {ctl = r.ctl; break;}
+      if (r.type == FatalError) throw Err() << "fatal error: " << r.data;
+    }
+  }
+  catch (Err & e){
+    set_broken(e.str());
+    throw Err() << errpref << e.str();
+  }
+  overlap = ctl & 1;
+  msg_id = HISLIP_FIRST_ID;
+  rmt = false;
+}
+
+/*************************************************/
+
+uint32_t
+Driver_hislip::send_data(const std::string & msg, Answer * a) {
+  check_connection();
+  std::string s = msg + add;
+  uint32_t id = msg_id;
+  if (a) pending[id] = a;
+
+  // split long messages, last part is sent as DataEnd
+  try {
+    size_t n = 0;
+    do {
+      size_t len = std::min<uint64_t>(s.size()-n, srv_max_size);
+      bool last = n + len >= s.size();
+      send_msg(sfd, Msg(last? DataEnd : Data, rmt? 1:0, id, s.substr(n, len)));
+      rmt = false;
+      n += len;
+    } while (n < s.size());
+  }
+  catch (Err & e) {
+    set_broken(e.str());
+    throw Err() << errpref << e.str();
+  }
+  msg_id += 2;
+  return id;
+}
+
+std::string
+Driver_hislip::wait_answer(std::unique_lock<std::mutex> & lk,
+                           const uint32_t id, Answer & a) {
+  auto t_end = std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(timeout));
+
+  while (!a.done){
+    if (reading) {
+      // another thread reads the channel
+      if (cv.wait_until(lk, t_end) == std::cv_status::timeout && !a.done) {
+        pending.erase(id);
+        throw Err() << errpref << "read timeout";
+      }
+      continue;
+    }
+
+    // read a message from the channel without locking the mutex
+    reading = true;
+    int fd = sfd;
+    lk.unlock();
+    Msg r;
+    bool got = false;
+    std::string err;
+    try {
+      double dt = std::chrono::duration<double>(
+        t_end - std::chrono::steady_clock::now()).count();
+      got = recv_msg(fd, r, std::max(dt, 0.001));
+    }
+    catch (Err & e) { err = e.str(); }
+    lk.lock();
+    reading = false;
+    cv.notify_all();
+
+    if (err.size()) { set_broken(err); continue; }
+    if (got) { dispatch(r); continue; }
+    if (!a.done) {
+      pending.erase(id);
+      throw Err() << errpref << "read timeout";
+    }
+  }
+  if (a.err.size()) throw Err() << a.err;
+  trim_str(a.data, trim);
+  return a.data;
+}
+
+void
+Driver_hislip::write(const std::string & msg) {
+  std::unique_lock<std::mutex> lk(m);
+  send_data(msg, NULL);
+}
+
+std::string
+Driver_hislip::read() {
+  std::unique_lock<std::mutex> lk(m);
+  if (broken) throw Err() << errpref << conn_err;
+  // wait for the answer to the last message
+  Answer a;
+  uint32_t id = msg_id - 2;
+  pending[id] = &a;
+  return wait_answer(lk, id, a);
+}
+
+std::string
+Driver_hislip::ask(const std::string & msg) {
+  if (idn.size() && strcasecmp(msg.c_str(),"*idn?")==0) return idn;
+  std::unique_lock<std::mutex> lk(m);
+
+  // special messages
+  if (msg == "#stb" || msg == "#srq" || msg == "#clear"){
+    check_connection();
+    if (msg == "#clear") { clear(lk); return std::string(); }
+    if (msg == "#stb") {
+      auto r = async_query(Msg(AsyncStatusQuery, rmt? 1:0, msg_id-2),
+                           AsyncStatusResponse);
+      rmt = false;
+      return type_to_str((int)r.ctl);
+    }
+    read_srq();
+    if (srq_stb<0) return std::string();
+    auto ret = type_to_str(srq_stb);
+    srq_stb = -1;
+    return ret;
+  }
+
+  if (!check_read_cond(msg, read_cond)) {
+    send_data(msg, NULL);
+    return std::string();
+  }
+
+  // Register the answer and send the message. In overlapped mode
+  // other threads can send their messages while we are waiting.
+  Answer a;
+  auto id = send_data(msg, &a);
+  return wait_answer(lk, id, a);
+}
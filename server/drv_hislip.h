@@ -0,0 +1,196 @@
+#ifndef DRV_HISLIP_H
+#define DRV_HISLIP_H
+
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include "drv.h"
+#include "drv_utils.h"
+#include "opt/opt.h"
+
+/*************************************************/
+/*
+ * Driver `hislip` -- LXI devices, HiSLIP protocol (IVI-6.1)
+ *
+
+HiSLIP uses two TCP connections to the device: synchronous channel
+for data and asynchronous channel for control messages (status byte,
+device clear, service requests). Messages have explicit length, answers
+can contain arbitrary binary data.
+
+If the device works in overlapped mode, a few requests can be sent
+without waiting for answers (up to `-pipeline` requests), answers are
+matched to requests using message IDs. In synchronized mode requests
+are sent one by one.
+
+Driver reads answer from the device only if there is a question mark '?'
+in the first word of the message.
+
+Special messages (not sent to the device):
+
+* `#stb`   -- Read status byte (HiSLIP AsyncStatusQuery), return decimal number.
+* `#srq`   -- Return status byte of the last service request received
+              from the device since the previous `#srq` message, or empty
+              string if there was no service requests.
+* `#clear` -- Device clear. Requests which are waiting for answers fail.
+
+Parameters:
+
+* `-addr`          -- Network address or IP.
+                      Required.
+* `-port <N>`      -- Port number.
+                      Default: "4880".
+* `-name <v>`      -- HiSLIP sub-address (device name).
+                      Default: "hislip0".
+* `-timeout <N>`   -- Read timeout, seconds.
+                      Default 5.0.
+* `-connect_timeout <N>` -- Connection timeout, seconds.
+                      Default: 5.0.
+* `-max_msg_size <N>` -- Max message size proposed to the device, bytes.
+                      Default: 1048576.
+* `-pipeline <N>`  -- Max number of requests sent to the device without
+                      waiting for answers (overlapped mode only).
+                      Default: 8.
+* `-errpref <str>` -- Prefix for error messages.
+                      Default: "hislip: "
+* `-idn <str>`     -- Override output of *idn? command.
+                      Default: empty string, do not override.
+* `-read_cond <v>` -- When do we need to read answer from a command:
+                      always, never, qmark (if there is a question mark in the message),
+                      qmark1w (question mark in the first word). Default: qmark1w.
+* `-add_str <v>`   -- Add string to each message sent to the device.
+                      Default: "\n"
+* `-trim_str <v>`  -- Remove string from the end of received messages.
+                      Default: "\n"
+* `-reconnect <v>`, `-reconnect_max <v>` -- Reconnection settings,
+                      same as in `net` driver.
+*/
+
+class Driver_hislip: public Driver {
+public:
+
+  // HiSLIP message types
+  enum msg_type_t {
+    Initialize = 0, InitializeResponse = 1, FatalError = 2, Error = 3,
+    Data = 6, DataEnd = 7, DeviceClearComplete = 8,
+    DeviceClearAcknowledge = 9, Interrupted = 13,
+    AsyncMaximumMessageSize = 15, AsyncMaximumMessageSizeResponse = 16,
+    AsyncInitialize = 17, AsyncInitializeResponse = 18,
+    AsyncDeviceClear = 19, AsyncServiceRequest = 20,
+    AsyncStatusQuery = 21, AsyncStatusResponse = 22,
+    AsyncDeviceClearAcknowledge = 23
+  };
+
+  // HiSLIP message: type, control code, message parameter, payload.
+  struct Msg {
+    uint8_t type, ctl;
+    uint32_t par;
+    std::string data;
+    Msg(const uint8_t type = 0, const uint8_t ctl = 0,
+        const uint32_t par = 0, const std::string & data = std::string()):
+      type(type), ctl(ctl), par(par), data(data) {}
+  };
+
+  // Encode a message (header + payload).
+  static std::string encode(const Msg & m);
+
+  // Decode a message from the beginning of the buffer, remove it
+  // from the buffer. Return false if the message is not complete.
+  // Throw Err if the header is wrong.
+  static bool decode(std::string & buf, Msg & m);
+
+  // Send a message, throw Err on errors.
+  static void send_msg(const int fd, const Msg & m);
+
+  // Receive a message. Return false on timeout if nothing was received,
+  // throw Err on errors.
+  static bool recv_msg(const int fd, Msg & m, const double timeout);
+
+  // Encode/decode 64-bit big-endian number (max message size).
+  static std::string encode_u64(const uint64_t v);
+  static uint64_t decode_u64(const std::string & s);
+
+private:
+  std::string addr, port, name;
+  std::string errpref, idn, add, trim;
+  double timeout, connect_timeout;
+  read_cond_t read_cond;
+  uint64_t max_size;    // our max message size
+  uint64_t srv_max_size; // max message size of the device
+  int pipeline;
+
+  // All data below is protected by the mutex.
+  std::mutex m;
+  std::condition_variable cv;
+
+  int sfd, afd;    // synchronous and asynchronous channels
+  bool overlap;    // overlapped mode
+  uint32_t msg_id; // next message id
+  bool rmt;        // response message terminator was received
+  int srq_stb;     // status byte of the last service request, -1 if none
+
+  // Requests waiting for answers: message id -> answer.
+  // Only one thread reads the synchronous channel at a time
+  // and distributes answers.
+  struct Answer {
+    std::string data, err;
+    bool done;
+    Answer(): done(false) {}
+  };
+  std::map<uint32_t, Answer*> pending;
+  bool reading;
+
+  bool broken;
+  bool reconnect;
+  Backoff backoff;
+  std::string conn_err; // error which broke the connection
+
+  // Open both channels, do initialization.
+  void connect_channels();
+
+  // Close channels.
+  void close_channels();
+
+  // Mark connection as broken, fail all waiting requests.
+  void set_broken(const std::string & err);
+
+  // Reconnect if needed. Mutex should be locked.
+  void check_connection();
+
+  // Send a message to the synchronous channel, register the answer
+  // (if it is not NULL), return message id. Mutex should be locked.
+  uint32_t send_data(const std::string & msg, Answer * a);
+
+  // Wait for the answer, read the synchronous channel if nobody
+  // else is reading it.
+  std::string wait_answer(std::unique_lock<std::mutex> & lk,
+                          const uint32_t id, Answer & a);
+
+  // Process a message received from the synchronous channel.
+  void dispatch(const Msg & msg);
+
+  // Send a message to the asynchronous channel and wait for the
+  // answer of a given type, remember service requests.
+  Msg async_query(const Msg & msg, const uint8_t type);
+
+  // Read pending service requests from the asynchronous channel.
+  void read_srq();
+
+  // Device clear. Mutex should be locked (it is unlocked while
+  // another thread reads the synchronous channel).
+  void clear(std::unique_lock<std::mutex> & lk);
+
+public:
+
+  Driver_hislip(const Opt & opts);
+  ~Driver_hislip();
+
+  std::string read() override;
+  void write(const std::string & msg) override;
+  std::string ask(const std::string & msg) override;
+  bool read_compound() const override {return read_cond_any(read_cond);}
+  int parallel() const override {return overlap? pipeline : 1;}
+};
+
+#endif
@@ -0,0 +1,480 @@
+#include "drv_modbus.h"
+#include "err/err.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <poll.h>
+#include <termios.h>
+#include <sys/socket.h>
+
+/*************************************************/
+std::string
+Modbus::u16(const uint16_t v){
+  return std::string{(char)(v>>8), (char)(v & 0xff)};
+}
+
+uint16_t
+Modbus::get_u16(const std::string & s, const size_t pos){
+  if (pos+2 > s.size()) throw Err() << "data is too short";
+  return ((uint8_t)s[pos]<<8) | (uint8_t)s[pos+1];
+}
+
+uint16_t
+Modbus::crc16(const std::string & data){
+  uint16_t crc = 0xFFFF;
+  for (auto c: data){
+    crc ^= (uint8_t)c;
+    for (int i=0; i<8; i++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+  }
+  return crc;
+}
+
+int
+Modbus::pdu_size(const std::string & pdu, const bool request){
+  if (pdu.size()<1) return 0;
+  uint8_t fn = pdu[0];
+  if (!request && (fn & 0x80)) return 2;
+  switch (fn){
+    case READ_COILS: case READ_DISCRETE:
+    case READ_HOLDING: case READ_INPUT:
+      if (request) return 5;
+      return pdu.size()<2 ? 0 : 2 + (uint8_t)pdu[1];
+    case WRITE_COIL: case WRITE_REGISTER:
+      return 5;
+    case WRITE_COILS: case WRITE_REGISTERS:
+      if (!request) return 5;
+      return pdu.size()<6 ? 0 : 6 + (uint8_t)pdu[5];
+  }
+  return -1;
+}
+
+std::string
+Modbus::exc_msg(const int code){
+  switch (code){
+    case 1:  return "illegal function";
+    case 2:  return "illegal data address";
+    case 3:  return "illegal data value";
+    case 4:  return "server device failure";
+    case 5:  return "acknowledge";
+    case 6:  return "server device busy";
+    case 8:  return "memory parity error";
+    case 10: return "gateway path unavailable";
+    case 11: return "gateway target device failed to respond";
+  }
+  return "unknown exception";
+}
+
+/*************************************************/
+Modbus::Modbus(const Opt & opts): busy(false) {
+  int u    = opts.get("unit", 1);
+  coalesce = opts.get("coalesce", 8);
+  max_gap  = opts.get("max_gap", 0);
+  if (u<0 || u>247) throw Err() << "Modbus: -unit should be in [0..247]";
+  def_unit = u;
+  if (coalesce<1) throw Err() << "Modbus: -coalesce should be positive";
+  if (max_gap<0)  throw Err() << "Modbus: -max_gap should be non-negative";
+}
+
+// parse a decimal number (or hex with 0x prefix if hex=true), check range
+static long
+get_num(const std::string & s, const long min, const long max,
+        const std::string & errpref, const char * name, const bool hex = false){
+  char * e;
+  errno = 0;
+  bool h = hex && s.compare(0,2,"0x")==0;
+  const char * b = s.c_str() + (h? 2:0);
+  long v = strtol(b, &e, h? 16:10);
+  if (e==b || *e!='\0' || errno || v<min || v>max)
+    throw Err() << errpref << "bad " << name << ": " << s;
+  return v;
+}
+
+Modbus::Req
+Modbus::parse(const std::string & msg, const std::string & errpref){
+  std::istringstream ss(msg);
+  std::string cmd, a, v;
+  ss >> cmd >> a;
+  std::vector<std::string> args;
+  while (ss >> v) args.push_back(v);
+
+  bool rd = strcasecmp(cmd.c_str(), "read")==0;
+  bool wr = strcasecmp(cmd.c_str(), "write")==0;
+  if (!rd && !wr) throw Err() << errpref
+    << "unknown command, READ or WRITE expected: " << msg;
+
+  Req r;
+  r.unit = def_unit;
+  auto p = a.find(':');
+  if (p!=std::string::npos){
+    r.unit = get_num(a.substr(0,p), 0, 247, errpref, "unit address");
+    a = a.substr(p+1);
+  }
+
+  // Modicon address: type + 4 or 5 digits (1-based)
+  if (a.size()!=5 && a.size()!=6) throw Err() << errpref
+    << "bad register address: " << a;
+  int type = a[0]-'0';
+  r.addr = get_num(a.substr(1), 1, 65536, errpref, "register address") - 1;
+
+  if (rd){
+    switch (type){
+      case 0: r.fn = READ_COILS; break;
+      case 1: r.fn = READ_DISCRETE; break;
+      case 3: r.fn = READ_INPUT; break;
+      case 4: r.fn = READ_HOLDING; break;
+      default: throw Err() << errpref << "bad register address: " << a;
+    }
+    if (args.size()>1) throw Err() << errpref << "too many arguments: " << msg;
+    int max = (type<3)? 2000:125;
+    r.num = args.size()? get_num(args[0], 1, max, errpref, "number of registers") : 1;
+  }
+  else {
+    int max;
+    switch (type){
+      case 0: r.fn = WRITE_COILS;     max = 1968; break;
+      case 4: r.fn = WRITE_REGISTERS; max = 123;  break;
+      default: throw Err() << errpref << "register is not writable: " << a;
+    }
+    if (args.size()<1) throw Err() << errpref << "no values: " << msg;
+    if ((int)args.size()>max) throw Err() << errpref << "too many values: " << msg;
+    for (auto const & s: args)
+      r.vals.push_back(get_num(s, 0, type==0? 1:65535, errpref, "value", true));
+    r.num = r.vals.size();
+    if (r.num==1) r.fn = (type==0)? WRITE_COIL : WRITE_REGISTER;
+  }
+  if (r.addr + r.num > 65536) throw Err() << errpref
+    << "register range is too long: " << msg;
+  if (r.unit==0 && rd) throw Err() << errpref
+    << "can't read from broadcast address";
+  return r;
+}
+
+std::string
+Modbus::do_pdu(const uint8_t unit, const std::string & pdu,
+               const std::string & errpref){
+  auto ans = transact(unit, pdu);
+  if (unit==0) return ans;
+  if (ans.size()==2 && (uint8_t)ans[0] == (pdu[0]|0x80))
+    throw Err(ERR_ANSWER) << errpref << "exception " << (int)(uint8_t)ans[1]
+      << ": " << exc_msg((uint8_t)ans[1]);
+  if (ans.size()<1 || ans[0]!=pdu[0] ||
+      (int)ans.size() != pdu_size(ans, false))
+    throw Err() << errpref << "wrong answer";
+  return ans;
+}
+
+void
+Modbus::read_group(const std::vector<Req*> & grp, const std::string & errpref){
+  auto & r0 = *grp[0];
+  int a1 = r0.addr, a2 = r0.addr + r0.num;
+  for (auto r: grp) a2 = std::max<int>(a2, r->addr + r->num);
+  int n = a2 - a1;
+  bool bits = r0.fn==READ_COILS || r0.fn==READ_DISCRETE;
+
+  try {
+    auto ans = do_pdu(r0.unit, std::string(1,(char)r0.fn) + u16(a1) + u16(n), errpref);
+    if ((uint8_t)ans[1] != (bits? (n+7)/8 : 2*n))
+      throw Err() << errpref << "wrong answer size";
+    for (auto r: grp){
+      r->res.clear();
+      for (int i = r->addr - a1; i < r->addr - a1 + r->num; i++)
+        r->res.push_back(bits? ((uint8_t)ans[2+i/8]>>(i%8)) & 1 :
+                               get_u16(ans, 2+2*i));
+    }
+  }
+  catch (Err & e) {
+    // combined read failed: repeat requests one by one
+    if (grp.size()>1 && e.code()==ERR_ANSWER){
+      for (auto r: grp) read_group(std::vector<Req*>(1,r), errpref);
+      return;
+    }
+    for (auto r: grp) { r->err = e.str(); r->err_code = e.code(); }
+  }
+}
+
+void
+Modbus::process(const std::vector<Req*> & batch, const std::string & errpref){
+  size_t i = 0;
+  while (i<batch.size()){
+    auto & r = *batch[i];
+
+    // write
+    if (r.fn!=READ_COILS && r.fn!=READ_DISCRETE &&
+        r.fn!=READ_HOLDING && r.fn!=READ_INPUT){
+      std::string pdu(1, (char)r.fn);
+      pdu += u16(r.addr);
+      switch (r.fn){
+        case WRITE_COIL: pdu += u16(r.vals[0]? 0xFF00:0); break;
+        case WRITE_REGISTER: pdu += u16(r.vals[0]); break;
+        case WRITE_COILS: {
+          std::string b((r.num+7)/8, '\0');
+          for (size_t j=0; j<r.num; j++) if (r.vals[j]) b[j/8] |= 1<<(j%8);
+          pdu += u16(r.num) + std::string(1,(char)b.size()) + b;
+          break;
+        }
+        case WRITE_REGISTERS:
+          pdu += u16(r.num) + std::string(1,(char)(2*r.num));
+          for (auto v: r.vals) pdu += u16(v);
+          break;
+      }
+      try { do_pdu(r.unit, pdu, errpref); }
+      catch (Err & e) { r.err = e.str(); r.err_code = e.code(); }
+      i++;
+      continue;
+    }
+
+    // sequence of reads: sort, merge adjacent ranges
+    size_t j = i;
+    while (j<batch.size() && (batch[j]->fn==READ_COILS ||
+           batch[j]->fn==READ_DISCRETE || batch[j]->fn==READ_HOLDING ||
+           batch[j]->fn==READ_INPUT)) j++;
+    std::vector<Req*> rs(batch.begin()+i, batch.begin()+j);
+    std::stable_sort(rs.begin(), rs.end(), [](const Req * a, const Req * b){
+      if (a->unit!=b->unit) return a->unit<b->unit;
+      if (a->fn!=b->fn) return a->fn<b->fn;
+      return a->addr<b->addr;});
+
+    std::vector<Req*> grp;
+    int a1 = 0, a2 = 0;
+    for (auto r: rs){
+      int max = (r->fn==READ_COILS || r->fn==READ_DISCRETE)? 2000:125;
+      if (grp.size() && r->unit==grp[0]->unit && r->fn==grp[0]->fn &&
+          r->addr <= a2 + max_gap &&
+          std::max<int>(a2, r->addr + r->num) - a1 <= max){
+        grp.push_back(r);
+        a2 = std::max<int>(a2, r->addr + r->num);
+        continue;
+      }
+      if (grp.size()) read_group(grp, errpref);
+      grp = std::vector<Req*>(1, r);
+      a1 = r->addr;
+      a2 = r->addr + r->num;
+    }
+    if (grp.size()) read_group(grp, errpref);
+    i = j;
+  }
+}
+
+std::string
+Modbus::modbus_ask(const std::string & msg, const std::string & errpref){
+  Req r = parse(msg, errpref);
+
+  std::unique_lock<std::mutex> lk(m);
+  queue.push_back(&r);
+  while (!r.done){
+    if (busy) { cv.wait(lk); continue; }
+
+    // process all collected requests
+    busy = true;
+    std::vector<Req*> batch;
+    batch.swap(queue);
+    lk.unlock();
+    process(batch, errpref);
+    lk.lock();
+    for (auto b: batch) b->done = true;
+    busy = false;
+    cv.notify_all();
+  }
+  lk.unlock();
+
+  if (r.err.size()) throw Err(r.err_code) << r.err;
+  std::ostringstream ss;
+  for (size_t i=0; i<r.res.size(); i++) ss << (i?" ":"") << r.res[i];
+  return ss.str();
+}
+
+void
+Modbus::modbus_write(const std::string & msg, const std::string & errpref){
+  auto ret = modbus_ask(msg, errpref);
+  std::lock_guard<std::mutex> lk(m);
+  last = ret;
+}
+
+std::string
+Modbus::modbus_read(){
+  std::lock_guard<std::mutex> lk(m);
+  std::string ret;
+  ret.swap(last);
+  return ret;
+}
+
+/*************************************************/
+Opt
+Driver_modbus_tcp::set_opt(const Opt & opts){
+  opts.check_unknown({"addr","port","timeout","errpref","idn",
+                      "reconnect","reconnect_max","connect_timeout",
+                      "addr_cache","tcp_nodelay","keepalive",
+                      "keepalive_intvl","keepalive_cnt",
+                      "unit","coalesce","max_gap"});
+  Opt o(opts);
+  o.put_missing("port", "502");
+  o.put_missing("timeout", 1.0);
+  o.put_missing("errpref", "modbus_tcp: ");
+  o.erase("unit");
+  o.erase("coalesce");
+  o.erase("max_gap");
+  return o;
+}
+
+Driver_modbus_tcp::Driver_modbus_tcp(const Opt & opts):
+  Driver_net(set_opt(opts)), Modbus(opts), tid(0) {}
+
+std::string
+Driver_modbus_tcp::transact(const uint8_t unit, const std::string & pdu){
+  check_connection();
+
+  // MBAP header: transaction id, protocol id (0), length, unit
+  uint16_t t = ++tid;
+  std::string req = u16(t) + u16(0) + u16(pdu.size()+1) + (char)unit + pdu;
+
+  ssize_t ret = ::send(sockfd, req.data(), req.size(), MSG_NOSIGNAL);
+  // connection was reset: nothing was sent, reconnect and try again
+  if (ret<0 && reconnect && (errno==EPIPE || errno==ECONNRESET)) {
+    set_broken(std::string("write error: ") + strerror(errno));
+    check_connection();
+    ret = ::send(sockfd, req.data(), req.size(), MSG_NOSIGNAL);
+  }
+  if (ret<0) {
+    set_broken(std::string("write error: ") + strerror(errno));
+    throw Err() << errpref << conn_err;
+  }
+
+  auto t_end = std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(timeout));
+  try {
+    while (1){
+      char h[7];
+      read_n(sockfd, h, 7, t_end);
+      std::string hs(h, 7);
+      size_t len = get_u16(hs, 4);
+      if (len<2 || len>254) throw Err() << "wrong frame length";
+      std::string ans(len-1, '\0');
+      read_n(sockfd, &ans[0], len-1, t_end);
+      if (get_u16(hs, 0) != t) continue; // answer to an old request
+      return ans;
+    }
+  }
+  catch (Err & e) {
+    // stream position is unknown after errors and timeouts
+    set_broken(e.str());
+    throw Err() << errpref << e.str();
+  }
+}
+
+std::string
+Driver_modbus_tcp::ask(const std::string & msg) {
+  if (idn.size() && strcasecmp(msg.c_str(),"*idn?")==0) return idn;
+  return modbus_ask(msg, errpref);
+}
+
+/*************************************************/
+Opt
+Driver_modbus_rtu::set_opt(const Opt & opts){
+  opts.check_unknown({"dev","speed","parity","timeout","char_timeout",
+                      "errpref","idn","unit","coalesce","max_gap"});
+  Opt o;
+  o.put("dev", opts.get("dev", ""));
+  o.put("speed",  opts.get("speed", 9600));
+  o.put("parity", opts.get("parity", "8E1"));
+  o.put("errpref", opts.get("errpref", "modbus_rtu: "));
+  o.put("idn", opts.get("idn", ""));
+  o.put("cread",  1);
+  o.put("clocal", 1);
+  o.put("raw",    1);
+  o.put("sfc",    0);
+  o.put("icrnl",  0);
+  o.put("opost",  0);
+  o.put("ndelay", 1); // poll is used for timeouts
+  o.put("delay",  0);
+  return o;
+}
+
+Driver_modbus_rtu::Driver_modbus_rtu(const Opt & opts):
+    Driver_serial(set_opt(opts)), Modbus(opts) {
+  timeout      = opts.get("timeout", 1.0);
+  char_timeout = opts.get("char_timeout", 0.05);
+
+  // 11 bits per character
+  int speed = opts.get("speed", 9600);
+  if (speed<=0) throw Err() << errpref << "bad speed: " << speed;
+  t35 = speed>19200 ? 1.75e-3 : 3.5*11/speed;
+  t_last = std::chrono::steady_clock::now();
+}
+
+std::string
+Driver_modbus_rtu::transact(const uint8_t unit, const std::string & pdu){
+  typedef std::chrono::steady_clock clock;
+  auto dur = [](double t){ return std::chrono::duration_cast<clock::duration>(
+                             std::chrono::duration<double>(t));};
+
+  std::string req = (char)unit + pdu;
+  uint16_t crc = crc16(req);
+  req += (char)(crc & 0xff);
+  req += (char)(crc >> 8);
+
+  // silent interval after the previous frame
+  std::this_thread::sleep_until(t_last + dur(t35));
+  tcflush(fd, TCIFLUSH); // drop noise and late answers
+
+  size_t n = 0;
+  while (n < req.size()){
+    auto res = ::write(fd, req.data()+n, req.size()-n);
+    if (res<0 && errno==EAGAIN) {
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      poll(&pfd, 1, 10);
+      continue;
+    }
+    if (res<0 && errno==EINTR) continue;
+    if (res<0) throw Err() << errpref << "write error: " << strerror(errno);
+    n += res;
+  }
+  tcdrain(fd);
+  t_last = clock::now();
+  if (unit==0) return std::string(); // broadcast
+
+  // read the answer: first byte within timeout, then no pauses
+  // longer than char_timeout
+  std::string ans;
+  auto t_end = clock::now() + dur(timeout);
+  while (1){
+    int size = ans.size()>1 ? pdu_size(ans.substr(1), false) : 0;
+    if (size<0) throw Err() << errpref << "wrong answer";
+    if (size>0 && (int)ans.size() >= size+3) { ans.resize(size+3); break; }
+
+    auto t = ans.size()? clock::now() + dur(char_timeout) : t_end;
+    double dt = std::chrono::duration<double>(t - clock::now()).count();
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int res = poll(&pfd, 1, dt>0 ? int(dt*1000)+1 : 0);
+    if (res<0 && errno==EINTR) continue;
+    if (res<0) throw Err() << errpref << "poll error: " << strerror(errno);
+    if (res==0) throw Err() << errpref
+      << (ans.size()? "incomplete answer" : "read timeout");
+    char buf[256];
+    auto r = ::read(fd, buf, sizeof(buf));
+    if (r<0 && (errno==EAGAIN || errno==EINTR)) continue;
+    if (r<=0) throw Err() << errpref << "read error: " << strerror(errno);
+    ans.append(buf, r);
+  }
+  t_last = clock::now();
+
+  crc = crc16(ans.substr(0, ans.size()-2));
+  if ((uint8_t)ans[ans.size()-2] != (crc & 0xff) ||
+      (uint8_t)ans[ans.size()-1] != (crc >> 8))
+    throw Err() << errpref << "CRC error";
+  if ((uint8_t)ans[0] != unit)
+    throw Err() << errpref << "answer from a wrong unit";
+  return ans.substr(1, ans.size()-3);
+}
+
+std::string
+Driver_modbus_rtu::ask(const std::string & msg) {
+  if (idn.size() && strcasecmp(msg.c_str(),"*idn?")==0) return idn;
+  return modbus_ask(msg, errpref);
+}
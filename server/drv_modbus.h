@@ -0,0 +1,195 @@
+#ifndef DRV_MODBUS_H
+#define DRV_MODBUS_H
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include "drv_serial.h"
+#include "drv_net.h"
+#include "opt/opt.h"
+
+/*************************************************/
+/*
+ * Drivers `modbus_tcp`, `modbus_rtu` -- Modbus devices
+ *
+
+Modbus TCP devices (port 502) and Modbus RTU devices on a serial line.
+Commands are text messages, registers are addressed using Modicon
+notation: 00001-09999 -- coils, 10001-19999 -- discrete inputs,
+30001-39999 -- input registers, 40001-49999 -- holding registers
+(6-digit addresses 000001-465536 can be also used). Unit (slave) address
+can be added before the register address: `2:40001`.
+
+* `READ <addr> [<n>]` -- Read `n` registers or bits (default 1), return
+  space-separated decimal values.
+* `WRITE <addr> <v1> [<v2> ...]` -- Write coils or holding registers
+  (values are decimal or hex numbers with 0x prefix), return empty string.
+
+Drivers accept a few requests simultaneously (`-coalesce` parameter).
+While a Modbus transaction is running other requests are collected.
+Then reads of adjacent (or overlapping) ranges of the same unit and
+register type are done in a single transaction. If the combined read
+fails with a Modbus exception, requests are repeated one by one.
+Writes are done in the original order, reads are never moved across
+writes.
+
+Modbus exceptions are reported as errors of the device (they are not
+counted by the device circuit breaker).
+
+Common parameters:
+
+* `-unit <N>`      -- Default unit address. Default: 1.
+* `-coalesce <N>`  -- Max number of simultaneous requests. Use 1 to
+                      disable coalescing. Default: 8.
+* `-max_gap <N>`   -- Max gap between register ranges which are
+                      read together. Default: 0.
+* `-timeout <N>`   -- Read timeout, seconds. Default: 1.0.
+* `-errpref <str>` -- Prefix for error messages.
+                      Default: "modbus_tcp: ", "modbus_rtu: ".
+* `-idn <str>`     -- Override output of *idn? command.
+                      Default: empty string, do not override.
+
+Parameters of `modbus_tcp` driver:
+
+* `-addr`, `-port` -- Network address and port. Default port: 502.
+* `-connect_timeout`, `-addr_cache`, `-tcp_nodelay`, `-keepalive`,
+  `-keepalive_intvl`, `-keepalive_cnt`, `-reconnect`, `-reconnect_max`
+                   -- Connection settings, same as in `net` driver.
+
+Parameters of `modbus_rtu` driver:
+
+* `-dev <name>`    -- Serial device filename (e.g. /dev/ttyUSB0). Required.
+* `-speed <N>`     -- Baud rate. Default: 9600.
+* `-parity <V>`    -- Parity (8N1, 8E1, 8O1, 8N2). Default: 8E1.
+* `-char_timeout <N>` -- Max pause inside a frame, seconds. Longer
+                      than 1.5 character time of the standard because
+                      USB adapters deliver data in portions. Default: 0.05.
+
+RTU frames are separated by silent intervals of 3.5 characters
+(1.75 ms above 19200 baud), the driver waits only the remaining part of
+the interval before sending a request. Requests to unit 0 are broadcast,
+no answer is expected (writes only).
+*/
+
+/*************************************************/
+// Modbus protocol: text commands, PDUs, coalescing of reads.
+// Transport is implemented in derived classes.
+
+class Modbus {
+public:
+  // function codes
+  enum {
+    READ_COILS = 1, READ_DISCRETE = 2, READ_HOLDING = 3, READ_INPUT = 4,
+    WRITE_COIL = 5, WRITE_REGISTER = 6, WRITE_COILS = 15, WRITE_REGISTERS = 16
+  };
+
+  // Big-endian 16-bit numbers.
+  static std::string u16(const uint16_t v);
+  static uint16_t get_u16(const std::string & s, const size_t pos);
+
+  // CRC of RTU frames (sent low byte first).
+  static uint16_t crc16(const std::string & data);
+
+  // Expected size of a PDU by its beginning: 0 if more data is needed,
+  // -1 for unknown function codes.
+  static int pdu_size(const std::string & pdu, const bool request);
+
+  // Text of a Modbus exception code.
+  static std::string exc_msg(const int code);
+
+private:
+  // parsed request
+  struct Req {
+    uint8_t unit, fn;
+    uint16_t addr, num;
+    std::vector<uint16_t> vals;
+    std::vector<uint16_t> res;
+    std::string err;
+    int err_code;
+    bool done;
+    Req(): unit(0), fn(0), addr(0), num(0), err_code(-1), done(false) {}
+  };
+
+  uint8_t def_unit;
+  int max_gap;
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::vector<Req*> queue; // requests waiting for processing
+  bool busy;               // somebody is talking to the device
+  std::string last;        // answer for read()
+
+  // Parse a text command.
+  Req parse(const std::string & msg, const std::string & errpref);
+
+  // Do a transaction, check exceptions and answer function code.
+  std::string do_pdu(const uint8_t unit, const std::string & pdu,
+                     const std::string & errpref);
+
+  // Read a range, put values to members of the group.
+  void read_group(const std::vector<Req*> & grp, const std::string & errpref);
+
+  // Process requests in the order, merge reads.
+  void process(const std::vector<Req*> & batch, const std::string & errpref);
+
+protected:
+  int coalesce;
+
+  Modbus(const Opt & opts);
+  virtual ~Modbus() {}
+
+  // Send request PDU to a unit, return response PDU
+  // (empty for broadcast requests). Throw Err on errors.
+  virtual std::string transact(const uint8_t unit, const std::string & pdu) = 0;
+
+  // Process a text command.
+  std::string modbus_ask(const std::string & msg, const std::string & errpref);
+  void modbus_write(const std::string & msg, const std::string & errpref);
+  std::string modbus_read();
+};
+
+/*************************************************/
+
+class Driver_modbus_tcp: public Driver_net, public Modbus {
+  uint16_t tid; // transaction id
+
+  // set options for net driver
+  static Opt set_opt(const Opt & opts);
+
+  std::string transact(const uint8_t unit, const std::string & pdu) override;
+
+public:
+  Driver_modbus_tcp(const Opt & opts);
+
+  std::string read() override {return modbus_read();}
+  void write(const std::string & msg) override {modbus_write(msg, errpref);}
+  std::string ask(const std::string & msg) override;
+  bool read_compound() const override {return false;}
+  int parallel() const override {return coalesce;}
+};
+
+/*************************************************/
+
+class Driver_modbus_rtu: public Driver_serial, public Modbus {
+  double timeout, char_timeout;
+  double t35; // silent interval between frames, s
+  std::chrono::steady_clock::time_point t_last; // end of the last frame
+
+  // set options for serial driver
+  static Opt set_opt(const Opt & opts);
+
+  std::string transact(const uint8_t unit, const std::string & pdu) override;
+
+public:
+  Driver_modbus_rtu(const Opt & opts);
+
+  std::string read() override {return modbus_read();}
+  void write(const std::string & msg) override {modbus_write(msg, errpref);}
+  std::string ask(const std::string & msg) override;
+  bool read_compound() const override {return false;}
+  int parallel() const override {return coalesce;}
+};
+
+#endif
@@ -11,66 +11,311 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <poll.h>
 
-// based on the example in
-// https://beej.us/guide/bgnet/html//index.html#a-simple-stream-client
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <chrono>
 
-Driver_net::Driver_net(const Opt & opts) {
-  opts.check_unknown({"addr","port","timeout","bufsize","errpref","idn",
-    "read_cond", "add_str", "trim_str"});
-  int res;
+/*************************************************/
+// Cache of resolved addresses: "<addr>:<port>" -> (time, addresses).
+// It is shared between all driver objects, reopening the device
+// does not need a new DNS request.
 
-  //prefix for error messages
-  errpref = opts.get("errpref", "Driver_net: ");
+namespace {
 
-  // address and port (mandatory settings)
-  std::string addr = opts.get("addr", "");
-  if (addr == "") throw Err() << errpref
-    << "Parameter -addr is empty or missing";
+struct NetAddr {
+  struct sockaddr_storage sa;
+  socklen_t len;
+  int family, socktype, protocol;
 
-  std::string port = opts.get("port", "5025");
+  bool operator==(const NetAddr & a) const {
+    return len == a.len && family == a.family && socktype == a.socktype &&
+      protocol == a.protocol && memcmp(&sa, &a.sa, len) == 0; }
+};
 
-  errpref += addr + ":" + port + ": ";
+typedef std::chrono::steady_clock cache_clock_t;
+std::mutex addr_cache_mutex;
+std::map<std::string,
+  std::pair<cache_clock_t::time_point, std::vector<NetAddr> > > addr_cache;
+
+}
+
+// Resolve address (use cached value if it is not older than cache_time).
+// Set `cached` flag if the cached value is returned.
+static std::vector<NetAddr>
+resolve(const std::string & addr, const std::string & port,
+        const std::string & errpref, const double cache_time, bool & cached){
+  std::string key = addr + ":" + port;
+  auto now = cache_clock_t::now();
+  cached = false;
+  if (cache_time>0) {
+    std::lock_guard<std::mutex> lk(addr_cache_mutex);
+    auto i = addr_cache.find(key);
+    if (i!=addr_cache.end() && now - i->second.first <
+        std::chrono::duration<double>(cache_time)){
+      cached = true;
+      return i->second.second;
+    }
+  }
 
   // fill hints structure and do getaddrinfo
   struct addrinfo hints, *servinfo, *p;
   memset(&hints, 0, sizeof(hints));
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
-  res = getaddrinfo(addr.c_str(), port.c_str(), &hints, &servinfo);
+  int res = getaddrinfo(addr.c_str(), port.c_str(), &hints, &servinfo);
   if (res != 0) throw Err() << errpref
     << "getaddrinfo: " << gai_strerror(res);
 
-  // loop through all the results and connect to the first we can
-  int e;
+  std::vector<NetAddr> ret;
   for(p = servinfo; p != NULL; p = p->ai_next) {
-    sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-    if (sockfd == -1) {e = errno; continue; }
-    res = connect(sockfd, p->ai_addr, p->ai_addrlen);
-    if (res == -1) {e = errno; continue; }
-    break;
-  }
-  if (p == NULL) {
-    freeaddrinfo(servinfo);
-    throw Err() << errpref
-      << "can't connect: " << strerror(e);
+    NetAddr a;
+    memcpy(&a.sa, p->ai_addr, p->ai_addrlen);
+    a.len      = p->ai_addrlen;
+    a.family   = p->ai_family;
+    a.socktype = p->ai_socktype;
+    a.protocol = p->ai_protocol;
+    ret.push_back(a);
   }
   freeaddrinfo(servinfo);
 
+  if (cache_time>0) {
+    std::lock_guard<std::mutex> lk(addr_cache_mutex);
+    addr_cache[key] = std::make_pair(now, ret);
+  }
+  return ret;
+}
+
+// Connect to all addresses in parallel (non-blocking connect),
+// return socket of the first successful connection.
+static int
+connect_any(const std::vector<NetAddr> & addrs,
+            const std::string & errpref, const double timeout){
+  int e = EHOSTUNREACH;
+  std::vector<struct pollfd> pfds;
+  auto close_all = [&pfds](){ for (auto & p: pfds) ::close(p.fd); };
+
+  for (auto const & a: addrs) {
+    int fd = socket(a.family, a.socktype | SOCK_NONBLOCK, a.protocol);
+    if (fd == -1) {e = errno; continue; }
+    int res = connect(fd, (const struct sockaddr *)&a.sa, a.len);
+    if (res == 0) { close_all(); return fd; }
+    if (errno != EINPROGRESS) {e = errno; ::close(fd); continue; }
+    pfds.push_back({fd, POLLOUT, 0});
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
+  while (pfds.size()) {
+    int ms = -1;
+    if (timeout>0) {
+      double dt = timeout - std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t0).count();
+      ms = dt>0 ? int(dt*1000)+1 : 0;
+    }
+    int res = poll(pfds.data(), pfds.size(), ms);
+    if (res<0 && errno==EINTR) continue;
+    if (res<0) { e = errno; close_all(); break; }
+    if (res==0) { close_all(); throw Err() << errpref
+      << "can't connect: timeout"; }
+
+    for (size_t i=0; i<pfds.size(); i++) {
+      if (!pfds[i].revents) continue;
+      int fd = pfds[i].fd, err = 0;
+      socklen_t len = sizeof(err);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len)<0) err = errno;
+      if (err == 0) {
+        pfds.erase(pfds.begin()+i);
+        close_all();
+        return fd;
+      }
+      e = err;
+      ::close(fd);
+      pfds.erase(pfds.begin()+i);
+      i--;
+    }
+  }
+  throw Err() << errpref << "can't connect: " << strerror(e);
+}
+
+int
+tcp_connect(const std::string & addr, const std::string & port,
+            const std::string & errpref, const double timeout,
+            const double cache_time){
+  // Connect to cached addresses. If it fails, resolve the name
+  // again (address could be changed) and repeat if addresses are
+  // changed. Both attempts share one timeout.
+  int fd;
+  bool cached;
+  auto t0 = std::chrono::steady_clock::now();
+  auto addrs = resolve(addr, port, errpref, cache_time, cached);
+  try { fd = connect_any(addrs, errpref, timeout); }
+  catch (Err & e) {
+    if (!cached) throw;
+    auto addrs1 = resolve(addr, port, errpref, 0, cached);
+    {
+      std::lock_guard<std::mutex> lk(addr_cache_mutex);
+      addr_cache[addr + ":" + port] = std::make_pair(cache_clock_t::now(), addrs1);
+    }
+    if (addrs1 == addrs) throw;
+    double dt = timeout;
+    if (timeout>0) {
+      dt -= std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t0).count();
+      if (dt<=0) throw;
+    }
+    fd = connect_any(addrs1, errpref, dt);
+  }
+
+  // blocking mode for reading and writing
+  int fl = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, fl & ~O_NONBLOCK);
+  return fd;
+}
+
+bool
+read_n(const int fd, char * buf, const size_t n,
+       const std::chrono::steady_clock::time_point & t_end,
+       const bool first_ok){
+  size_t got = 0;
+  while (got < n){
+    int ms = -1;
+    if (t_end != std::chrono::steady_clock::time_point::max()){
+      double dt = std::chrono::duration<double>(
+        t_end - std::chrono::steady_clock::now()).count();
+      ms = dt>0 ? int(dt*1000)+1 : 0;
+    }
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int res = poll(&pfd, 1, ms);
+    if (res<0 && errno==EINTR) continue;
+    if (res<0) throw Err() << "poll error: " << strerror(errno);
+    if (res==0) {
+      if (got==0 && first_ok) return false;
+      throw Err() << "read timeout";
+    }
+    auto r = ::recv(fd, buf+got, n-got, 0);
+    if (r<0 && errno==EINTR) continue;
+    if (r<0) throw Err() << "read error: " << strerror(errno);
+    if (r==0) throw Err() << "connection closed by the device";
+    got += r;
+  }
+  return true;
+}
+
+/*************************************************/
+
+Driver_net::Driver_net(const Opt & opts): sockfd(-1) {
+  opts.check_unknown({"addr","port","timeout","bufsize","errpref","idn",
+    "read_cond", "add_str", "trim_str", "reconnect", "reconnect_max",
+    "connect_timeout", "addr_cache", "tcp_nodelay", "keepalive",
+    "keepalive_intvl", "keepalive_cnt", "rcvbuf"});
+
+  //prefix for error messages
+  errpref = opts.get("errpref", "Driver_net: ");
+
+  // address and port (mandatory settings)
+  addr = opts.get("addr", "");
+  if (addr == "") throw Err() << errpref
+    << "Parameter -addr is empty or missing";
+
+  port = opts.get("port", "5025");
+
+  errpref += addr + ":" + port + ": ";
+
   bufsize = opts.get("bufsize", 4096);
   timeout = opts.get("timeout", 5.0);
   add     = opts.get("add_str",  "\n");
   trim    = opts.get("trim_str", "\n");
   idn     = opts.get("idn", "");
   read_cond = str_to_read_cond(opts.get("read_cond", "qmark1w"));
+  reconnect = opts.get("reconnect", true);
+  backoff = Backoff(0.1, opts.get("reconnect_max", 10.0));
+
+  connect_timeout = opts.get("connect_timeout", 5.0);
+  cache_time      = opts.get("addr_cache", 60.0);
+  tcp_nodelay     = opts.get("tcp_nodelay", true);
+  keepalive       = opts.get("keepalive", 0);
+  keepalive_intvl = opts.get("keepalive_intvl", 0);
+  keepalive_cnt   = opts.get("keepalive_cnt", 0);
+  rcvbuf          = opts.get("rcvbuf", 0);
+  if (keepalive<0 || keepalive_intvl<0 || keepalive_cnt<0 || rcvbuf<0)
+    throw Err() << errpref << "keepalive and rcvbuf parameters "
+      "should be non-negative";
+
+  connect_socket();
 }
 
 Driver_net::~Driver_net() {
-  ::close(sockfd);
+  if (sockfd>=0) ::close(sockfd);
+}
+
+void
+Driver_net::connect_socket() {
+  sockfd = tcp_connect(addr, port, errpref, connect_timeout, cache_time);
+
+  // socket options
+  int on = 1;
+  if (tcp_nodelay &&
+      setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on))<0)
+    set_broken(std::string("can't set TCP_NODELAY: ") + strerror(errno));
+  if (keepalive>0 && sockfd>=0 && (
+      setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on))<0 ||
+      setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive, sizeof(keepalive))<0 ||
+      (keepalive_intvl>0 && setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL,
+        &keepalive_intvl, sizeof(keepalive_intvl))<0) ||
+      (keepalive_cnt>0 && setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT,
+        &keepalive_cnt, sizeof(keepalive_cnt))<0)))
+    set_broken(std::string("can't set keepalive: ") + strerror(errno));
+  if (rcvbuf>0 && sockfd>=0 &&
+      setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf))<0)
+    set_broken(std::string("can't set receive buffer size: ") + strerror(errno));
+  if (sockfd<0) throw Err() << errpref << conn_err;
+}
+
+void
+Driver_net::set_broken(const std::string & err) {
+  if (sockfd>=0) ::close(sockfd);
+  sockfd = -1;
+  conn_err = err;
+}
+
+void
+Driver_net::check_connection() {
+  if (!reconnect) {
+    if (sockfd<0) throw Err() << errpref << conn_err;
+    return;
+  }
+
+  // Was the connection closed by the device (e.g. idle timeout)?
+  // Check without waiting, ignore any pending data.
+  if (sockfd>=0) {
+    struct pollfd pfd = {sockfd, POLLIN | POLLRDHUP, 0};
+    if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP|POLLHUP|POLLERR))) {
+      char c;
+      if (::recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0)
+        set_broken("connection closed by the device");
+    }
+  }
+  if (sockfd>=0) return;
+
+  // reconnect
+  if (!backoff.ready()) throw Err() << errpref << conn_err
+    << " (reconnecting in " << backoff.wait() << " s)";
+  try { connect_socket(); }
+  catch (Err & e) {
+    backoff.fail();
+    conn_err = e.str().substr(errpref.size());
+    throw;
+  }
+  backoff.reset();
 }
 
 std::string
 Driver_net::read() {
+  if (sockfd<0) throw Err() << errpref << conn_err;
   char buf[bufsize];
 
   // Reading with timeout.
@@ -85,15 +330,19 @@ Driver_net::read() {
 
     // Wait for data.
     auto res = pselect(sockfd+1, &set, NULL, NULL, &timeout_s, NULL);
-    if (res == -1) throw Err() << errpref << "select error: " << strerror(errno);
+    if (res == -1) {
+      set_broken(std::string("select error: ") + strerror(errno));
+      throw Err() << errpref << conn_err;
+    }
     if (res == 0)  throw Err() << errpref << "read timeout";
   }
 
   // Read data
   int fl=0;
   auto res = ::recv(sockfd, buf, sizeof(buf), fl);
-  if (res<0) throw Err() << errpref
-    << "read error: " << strerror(errno);
+  if (res<0) set_broken(std::string("read error: ") + strerror(errno));
+  if (res==0) set_broken("connection closed by the device");
+  if (res<=0) throw Err() << errpref << conn_err;
 
   auto ret = std::string(buf, buf+res);
 
@@ -107,10 +356,21 @@ Driver_net::write(const std::string & msg) {
   std::string m = msg;
   if (add.size()>0) m+=add;
 
+  check_connection();
+
   int fl = MSG_NOSIGNAL;
   ssize_t ret = ::send(sockfd, m.data(), m.size(), fl);
-  if (ret<0) throw Err() << errpref
-    << "write error: " << strerror(errno);
+
+  // connection was reset: nothing was sent, reconnect and try again
+  if (ret<0 && reconnect && (errno==EPIPE || errno==ECONNRESET)) {
+    set_broken(std::string("write error: ") + strerror(errno));
+    check_connection();
+    ret = ::send(sockfd, m.data(), m.size(), fl);
+  }
+  if (ret<0) {
+    set_broken(std::string("write error: ") + strerror(errno));
+    throw Err() << errpref << conn_err;
+  }
 }
 
 std::string
@@ -37,17 +37,75 @@ Parameters:
                       Default: "\n"
 * `-trim_str <v>`  -- Remove string from the end of received messages.
                       Default: "\n"
+* `-connect_timeout <N>` -- Connection timeout, seconds. All addresses
+                      of the host (IPv4, IPv6) are tried in parallel. No
+                      timeout if <=0. Default: 5.0.
+* `-addr_cache <N>` -- Keep resolved addresses for this time, seconds.
+                      Reopening the device does not need a new DNS request.
+                      If connection to cached addresses fails, the name is
+                      resolved again, and new addresses (if they are changed)
+                      are tried within the same connect_timeout.
+                      Default: 60.0, 0 - no caching.
+* `-tcp_nodelay <v>` -- Disable Nagle algorithm (TCP_NODELAY). Default: 1.
+* `-keepalive <N>` -- Enable TCP keepalive, idle time before probes, seconds.
+                      Default: 0, keepalive is off.
+* `-keepalive_intvl <N>` -- Interval between keepalive probes, seconds.
+                      Default: 0, system setting.
+* `-keepalive_cnt <N>` -- Number of keepalive probes.
+                      Default: 0, system setting.
+* `-rcvbuf <N>`    -- Socket receive buffer size, bytes.
+                      Default: 0, system setting.
+* `-reconnect <v>` -- Reconnect if connection is broken (closed by the device,
+                      read/write errors). Reconnection is done before the next
+                      write, with exponential back-off delays between attempts.
+                      Default: 1.
+* `-reconnect_max <N>` -- Maximum delay between reconnection attempts, seconds.
+                      Default: 10.0.
 */
 
+// Connect to a TCP server. All addresses of the host are tried in
+// parallel, resolved addresses are cached for cache_time seconds.
+// Return socket in blocking mode, throw Err on errors.
+int tcp_connect(const std::string & addr, const std::string & port,
+                const std::string & errpref, const double timeout,
+                const double cache_time);
+
+// Read exactly n bytes from a socket before the deadline
+// (time_point::max() for no deadline). Throw Err on errors, timeout,
+// or if the connection is closed. If `first_ok` is set, timeout before
+// the first byte is not an error: return false.
+bool read_n(const int fd, char * buf, const size_t n,
+            const std::chrono::steady_clock::time_point & t_end,
+            const bool first_ok = false);
+
 class Driver_net: public Driver {
 protected:
-  int sockfd; // file descriptor for the network socket
+  int sockfd; // file descriptor for the network socket, -1 if broken
+  std::string addr, port;
   size_t bufsize;
   double timeout;
   std::string errpref,idn;
   std::string add,trim;
   read_cond_t read_cond;
 
+  double connect_timeout, cache_time;
+  bool tcp_nodelay;
+  int keepalive, keepalive_intvl, keepalive_cnt, rcvbuf;
+
+  bool reconnect;
+  Backoff backoff;
+  std::string conn_err; // error which broke the connection
+
+  // Connect to the device, throw Err on errors.
+  void connect_socket();
+
+  // Close broken connection, remember the error.
+  void set_broken(const std::string & err);
+
+  // Check that the connection was not closed by the device,
+  // reconnect if needed. Throw Err on errors.
+  void check_connection();
+
 public:
 
   Driver_net(const Opt & opts);
@@ -56,6 +114,7 @@ public:
   std::string read() override;
   void write(const std::string & msg) override;
   std::string ask(const std::string & msg) override;
+  bool read_compound() const override {return read_cond_any(read_cond);}
 };
 
 #endif
@@ -4,39 +4,50 @@
 #include <memory>
 #include "drv_net.h"
 #include "opt/opt.h"
+#include <cstring> // strcasecmp
 
 /*************************************************/
 /*
  * Access to device via Prologix gpib2eth converter.
  *
 
-Not tested!
+Tested only with a simulator.
 
 Parameters:
 
 * `-addr <v>`      -- Network address or IP.
                       Required.
 * `-port <v>`      -- Port number.
-                      Default: "5025" (lxi raw protocol).
+                      Default: "1234".
 * `-timeout <v>`   -- Read timeout, seconds. No timeout if <=0.
                       Default 5.0.
 * `-bufsize <v>`   -- Buffer size for reading. Maximum length of read data.
                       Default: 4096
 * `-errpref <v>`   -- Prefix for error messages.
-                      Default: "IOSerial: "
+                      Default: "Driver_net: "
 * `-idn <v>`       -- Override output of *idn? command.
                       Default: empty string, do not override.
-* `-addr <v>`      -- GPIB address
+* `-reconnect <v>`, `-reconnect_max <v>` -- Reconnection settings,
+                      same as in `net` driver.
+* `-connect_timeout`, `-addr_cache`, `-tcp_nodelay`, `-keepalive`,
+  `-keepalive_intvl`, `-keepalive_cnt`, `-rcvbuf` -- Connection
+                      settings, same as in `net` driver.
+* `-gpib_addr <v>` -- GPIB address.
+                      Required.
 
 */
 
 class Driver_net_gpib_prologix: public Driver_net {
-  std::string addr; // gpib address
+  std::string gpib_addr; // gpib address
 
 public:
 
   Driver_net_gpib_prologix(const Opt & opts):
-    Driver_net(set_opt(opts)) {}
+    Driver_net(set_opt(opts)) {
+    gpib_addr = opts.get("gpib_addr", "");
+    if (gpib_addr == "") throw Err() << errpref
+      << "Parameter -gpib_addr is empty or missing";
+  }
 
   std::string read() override {
     sel_device();
@@ -48,34 +59,45 @@ public:
     Driver_net::write(msg);
   }
 
+  // Select device once and do write+read without
+  // selecting it again (this would read the answer of
+  // ++addr command instead of the answer from the device).
+  std::string ask(const std::string & msg) override {
+    if (idn.size() && strcasecmp(msg.c_str(),"*idn?")==0) return idn;
+    sel_device();
+    Driver_net::write(msg);
+    if (!check_read_cond(msg, read_cond)) return std::string();
+    return Driver_net::read();
+  }
+
   // Select gpib device.
   // Get address, change it if needed.
   void sel_device() {
     std::string acmd("++addr");
     Driver_net::write(acmd);
     auto a = Driver_net::read();
-    if (a != addr)
-      Driver_net::write(acmd + " " + addr);
+    if (a != gpib_addr)
+      Driver_net::write(acmd + " " + gpib_addr);
   }
 
   // set options for net driver
-  Opt set_opt(const Opt & opts){
+  static Opt set_opt(const Opt & opts){
     // Options "add_str", "trim_str" are not needed, we want to use
     // default values, or set them here.
-    opts.check_unknown({"addr","port","timeout","bufsize","errpref","idn"});
+    opts.check_unknown({"addr","port","timeout","bufsize","errpref","idn",
+                        "reconnect","reconnect_max","connect_timeout",
+                        "addr_cache","tcp_nodelay","keepalive",
+                        "keepalive_intvl","keepalive_cnt","rcvbuf",
+                        "gpib_addr"});
 
     // Copy options to modify them for Driver_net.
     // Only override default port setting.
     Opt o(opts);
     o.put_missing("port", "1234");
 
-    // Process options specific for gpib_prologix driver.
+    // Option specific for gpib_prologix driver
     // (gpib address on the device we want to access)
-    addr = opts.get("addr", "");
-    o.erase("addr");
-    if ("addr" == "") throw Err() << errpref
-      << "Parameter -addr is empty or missing";
-
+    o.erase("gpib_addr");
     return o;
  }
 
@@ -313,13 +313,30 @@ Driver_serial::Driver_serial(const Opt & opts) {
       options.c_cflag &= ~CSIZE;
       options.c_cflag |= CS7;
     }
+    else if (par == "8E1" || par == "8O1"){
+      options.c_cflag |= PARENB;
+      if (par == "8O1") options.c_cflag |= PARODD;
+      else options.c_cflag &= ~PARODD;
+      options.c_cflag &= ~CSTOPB;
+      options.c_cflag &= ~CSIZE;
+      options.c_cflag |= CS8;
+    }
+    else if (par == "8N2"){
+      options.c_cflag &= ~PARENB;
+      options.c_cflag |= CSTOPB;
+      options.c_cflag &= ~CSIZE;
+      options.c_cflag |= CS8;
+    }
     else if (par != "") throw Err() << errpref
      << "unknown parity setting "
-     << "(expected 8N1, 7E1, 7O1, or 7S1): " << par;
+     << "(expected 8N1, 7E1, 7O1, 7S1, 8E1, 8O1, or 8N2): " << par;
   }
   // enable parity checking and stripping of the parity bit
-  if (options.c_cflag & PARENB)
-    options.c_iflag |= (INPCK | ISTRIP);
+  // (only for 7-bit characters)
+  if (options.c_cflag & PARENB){
+    options.c_iflag |= INPCK;
+    if ((options.c_cflag & CSIZE) == CS7) options.c_iflag |= ISTRIP;
+  }
 
   // canonical/raw input
   if (opts.exists("raw")){
@@ -409,7 +426,7 @@ Driver_serial::read() {
   }
 
   trim_str(ret,trim); // -trim option
-  if (fail) throw Err() << "nack from the device: " << ret;
+  if (fail) throw Err(ERR_ANSWER) << "nack from the device: " << ret;
   return ret;
 }
 
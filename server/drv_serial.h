@@ -115,7 +115,7 @@ Parameters:
 
   Combination settings. Different from stty(1) options!
 
-  -parity <V>  -- Parity (8N1, 7N1, 7O1, 7S1).
+  -parity <V>  -- Parity (8N1, 7E1, 7O1, 7S1, 8E1, 8O1, 8N2).
                   Default: do not change.
 
   -raw (1|0)   -- Raw/canonical input.
@@ -182,6 +182,7 @@ then the setting is left untouched.
 #include "opt/opt.h"
 
 class Driver_serial: public Driver {
+protected:
   int fd; // file descriptor
   std::string errpref, idn;
   std::string ack,nack,add,trim;
@@ -196,6 +197,7 @@ public:
   std::string read() override;
   void write(const std::string & msg) override;
   std::string ask(const std::string & msg) override;
+  bool read_compound() const override {return read_cond_any(read_cond);}
 };
 
 #endif
@@ -1,40 +1,211 @@
 #include "drv_spp.h"
 #include "err/err.h"
-#include <cstring> // strcasecmp
+#include <cstring> // strcasecmp, memchr
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sstream>
+#include <chrono>
+
+/*************************************************/
+SppPipe::SppPipe(const std::string & prog):
+    pid(0), ifd(-1), ofd(-1), buf(65536), beg(0), end(0) {
+
+  // close-on-exec: other programs should not keep our pipes open
+  int fd1[2], fd2[2];
+  if (pipe2(fd1, O_CLOEXEC)<0) throw Err() << "SPP: pipe error: " << strerror(errno);
+  if (pipe2(fd2, O_CLOEXEC)<0) {
+    ::close(fd1[0]); ::close(fd1[1]);
+    throw Err() << "SPP: pipe error: " << strerror(errno);
+  }
+
+  signal(SIGPIPE, SIG_IGN); // ignore sigpipe (to avoid program exit)
+
+  pid = fork();
+  if (pid<0) {
+    ::close(fd1[0]); ::close(fd1[1]);
+    ::close(fd2[0]); ::close(fd2[1]);
+    throw Err() << "SPP: fork error: " << strerror(errno);
+  }
+
+  // child: attach stdin/stdout to pipes and execute the program
+  if (pid==0) {
+    if (dup2(fd1[0], STDIN_FILENO)<0 || dup2(fd2[1], STDOUT_FILENO)<0) _exit(127);
+    execl("/bin/sh", "sh", "-c", prog.c_str(), (char *)0);
+    _exit(127);
+  }
+
+  ::close(fd1[0]);
+  ::close(fd2[1]);
+  ifd = fd1[1];
+  ofd = fd2[0];
+}
+
+SppPipe::~SppPipe(){
+  ::close(ifd);
+  ::kill(pid, SIGTERM);
+  int st;
+  waitpid(pid, &st, 0);
+  ::close(ofd);
+}
+
+bool
+SppPipe::getline(const char * & l, size_t & n, const double timeout){
+  size_t scan = beg; // data before this position has no newlines
+  while (1){
+    const char * p = (const char *)memchr(buf.data()+scan, '\n', end-scan);
+    if (p) {
+      l = buf.data()+beg;
+      n = p-l;
+      beg += n+1;
+      return true;
+    }
+
+    // move data to the beginning of the buffer, grow the buffer if needed
+    if (beg>0) {
+      memmove(buf.data(), buf.data()+beg, end-beg);
+      end -= beg;
+      beg = 0;
+    }
+    if (end == buf.size()) buf.resize(2*buf.size());
+    scan = end;
+
+    struct pollfd pfd = {ofd, POLLIN, 0};
+    int res = poll(&pfd, 1, timeout<0 ? -1 : int(timeout*1000));
+    if (res<0 && errno==EINTR) continue;
+    if (res<0) throw Err() << "SPP: poll error: " << strerror(errno);
+    if (res==0) throw Err() << "Read timeout";
+
+    auto r = ::read(ofd, buf.data()+end, buf.size()-end);
+    if (r<0 && errno==EINTR) continue;
+    if (r<0) throw Err() << "SPP: read error: " << strerror(errno);
+    if (r==0) return false;
+    end += r;
+  }
+}
+
+bool
+SppPipe::write(const std::string & data){
+  size_t n = 0;
+  while (n < data.size()){
+    auto r = ::write(ifd, data.data()+n, data.size()-n);
+    if (r<0 && errno==EINTR) continue;
+    if (r<0) return false;
+    n += r;
+  }
+  return true;
+}
+
+/*************************************************/
+
+void
+Driver_spp::parse_header(const std::string & l,
+    const std::string & errpref, char & ch, int & ver){
+  if (l.size()<5 || l[1]!='S' || l[2]!='P' || l[3]!='P')
+    throw Err() << errpref
+      << "not an SPP program, header expected";
+  ch  = l[0];
+  ver = str_to_type<int>(l.substr(4));
+  if (ver!=1 && ver!=2 && ver!=3) throw Err() << errpref
+    <<"unsupported SPP version";
+}
+
+int
+Driver_spp::parse_tagged(const char * l, const size_t n, const char ch,
+    std::string & tag, std::string & err){
+  if (n<5 || l[0]!=ch) return 0;
+  if (strncmp(l+1, "OK ", 3)==0){
+    tag.assign(l+4, n-4);
+    return 1;
+  }
+  if (n>=9 && strncmp(l+1, "Error ", 6)==0){
+    const char * c = (const char *)memchr(l+7, ':', n-7);
+    if (!c) return 0;
+    tag.assign(l+7, c-l-7);
+    size_t p = c-l+1;
+    if (p<n && l[p]==' ') p++;
+    err.assign(l+p, n-p);
+    return 2;
+  }
+  return 0;
+}
+
+bool
+Driver_spp::parse_line(const char * l, const size_t n, const char ch,
+    std::string & ret, const std::string & prog){
+  // line starts with the special character
+  if (n>0 && l[0] == ch){
+    if (n>=8 && strncmp(l+1, "Error: ", 7)==0)
+      throw Err(ERR_ANSWER) << std::string(l+8, n-8);
+    if (n>=8 && strncmp(l+1, "Fatal: ", 7)==0)
+      throw Err() << std::string(l+8, n-8);
+    if (n==3 && l[1]=='O' && l[2]=='K') return true;
+
+    if (ret.size()>0) ret += '\n';
+    if (n>1 && l[1] == ch) ret.append(l+1, n-1);
+    else throw Err() << "SPP: symbol " << ch <<
+      " in the beginning of a line is not protected: " << prog;
+  }
+  else {
+    if (ret.size()>0) ret += '\n';
+    ret.append(l, n);
+  }
+  return false;
+}
+
+bool
+Driver_spp::read_line(const char * & l, size_t & n,
+                      std::string & tmp, const double timeout){
+  if (pp) return pp->getline(l, n, timeout);
+
+  // Read from SPP program with timeout.
+  // Err is thrown if error happens.
+  // Return -1 on EOF.
+  if (flt->getline(tmp, timeout) < 0) return false;
+  l = tmp.data();
+  n = tmp.size();
+  return true;
+}
+
+bool
+Driver_spp::send(const std::string & msg){
+  if (pp) return pp->write(msg + "\n");
+  flt->ostream() << msg << "\n";
+  flt->ostream().flush();
+  return (bool)flt->ostream();
+}
 
 std::string
 Driver_spp::read_spp(double timeout){
-  if (!flt) throw Err() << "SPP: read from closed device";
-  std::string ret;
+  if (!running()) throw Err() << "SPP: read from closed device";
+  std::string ret, tmp;
+  ret.reserve(ans_size);
   while (1){
-    std::string l;
-
-    // Read from SPP program with timeout.
-    // Err is thrown if error happens.
-    // Return -1 on EOF.
-    int res = flt->getline(l, timeout);
-    if (res<0) throw Err() << "SPP: unexpected EOF: " << prog;
-    // line starts with the special character
-    if (l.size()>0 && l[0] == ch){
-      if (l.substr(1,7) == "Error: ") throw Err() << l.substr(8);
-      if (l.substr(1,7) == "Fatal: ") throw Err() << l.substr(8);
-      if (l.substr(1) == "OK") return ret;
-
-      if (ret.size()>0) ret += '\n';
-      if (l.size()>1 && l[1] == ch) ret += l.substr(1);
-      else throw Err() << "SPP: symbol " << ch <<
-        " in the beginning of a line is not protected: " << prog;
+    const char * l;
+    size_t n;
+    if (!read_line(l, n, tmp, timeout)) {
+      set_broken("SPP: unexpected EOF: " + prog);
+      throw Err() << conn_err;
     }
-    else {
-      if (ret.size()>0) ret += '\n';
-      ret += l;
+    try { if (parse_line(l, n, ch, ret, prog)) break; }
+    catch (Err & e) {
+      // program exits after #Fatal message
+      if (e.code() != ERR_ANSWER) set_broken(e.str());
+      throw;
     }
   }
+  if (ret.size() > ans_size) ans_size = ret.size();
+  return ret;
 }
 
 
-Driver_spp::Driver_spp(const Opt & opts) {
-  opts.check_unknown({"prog", "open_timeout", "read_timeout", "errpref", "idn"});
+Driver_spp::Driver_spp(const Opt & opts):
+    ans_size(0), ver(0), tag(0), reading(false), broken(false) {
+  opts.check_unknown({"prog", "open_timeout", "read_timeout", "errpref", "idn",
+                      "reconnect", "reconnect_max", "fast_pipe",
+                      "instances", "primary_cmds", "pipeline"});
 
   //prefix for error messages
   errpref = opts.get("errpref", "spp: ");
@@ -47,61 +218,348 @@ Driver_spp::Driver_spp(const Opt & opts) {
 
   open_timeout = opts.get<double>("open_timeout", 20.0);
   read_timeout = opts.get<double>("read_timeout", 10.0);
+  reconnect = opts.get("reconnect", true);
+  backoff = Backoff(0.1, opts.get("reconnect_max", 10.0));
+  fast = opts.get("fast_pipe", true);
+  pipeline = opts.get("pipeline", 8);
+  if (pipeline<1) throw Err() << errpref
+    << "-pipeline should be positive";
+
+  start();
+  idn = opts.get("idn", "");
+}
 
-  flt.reset(new IOFilter(prog));
+void
+Driver_spp::start() {
+  broken = false;
+  blk.clear();
+  if (fast) pp.reset(new SppPipe(prog));
+  else flt.reset(new IOFilter(prog));
   try {
 
     // first line: <symbol>SPP<version>
-    std::string l;
-    flt->getline(l, open_timeout);
-    if (l.size()<5 || l[1]!='S' || l[2]!='P' || l[3]!='P')
-      throw Err() << errpref
-        << "not an SPP program, header expected";
-    ch  = l[0];
-    int ver = str_to_type<int>(l.substr(4));
-    if (ver!=1 && ver!=2) throw Err() << errpref
-      <<"unsupported SPP version";
+    const char * l = NULL;
+    size_t n = 0;
+    std::string tmp;
+    read_line(l, n, tmp, open_timeout);
+    parse_header(std::string(l? l:"", n), errpref, ch, ver);
     read_spp(open_timeout); // ignore message, throw errors
   }
   catch (Err e) {
-    if (flt){
-      flt->close_input();
-      flt->kill();
-      flt.reset();
-    }
+    stop();
     throw;
   }
-  idn = opts.get("idn", "");
-
 }
 
-
-Driver_spp::~Driver_spp() {
+void
+Driver_spp::stop() {
+  pp.reset();
   if (!flt) return;
   flt->close_input();
   flt->kill();
   flt.reset();
 }
 
+void
+Driver_spp::set_broken(const std::string & err) {
+  conn_err = err;
+  for (auto & p: pending) {
+    p.second->err = err;
+    p.second->code = -1;
+    p.second->done = true;
+  }
+  pending.clear();
+  cv.notify_all();
+  // another thread reads the program output, it will stop the program
+  if (reading) broken = true;
+  else stop();
+}
+
+void
+Driver_spp::check_connection() {
+  if (running()) return;
+  if (reading) throw Err() << conn_err;
+  if (!reconnect) throw Err() << errpref
+    << "device is closed";
+  if (!backoff.ready()) throw Err() << conn_err
+    << " (restarting in " << backoff.wait() << " s)";
+  try { start(); }
+  catch (Err & e) {
+    backoff.fail();
+    conn_err = e.str();
+    throw;
+  }
+  backoff.reset();
+}
+
+Driver_spp::~Driver_spp() {
+  stop();
+}
+
+void
+Driver_spp::write_msg(const std::string & msg) {
+  check_connection();
+  bool ok = send(msg);
+
+  // program exited: nothing was sent, restart it and try again
+  if (!ok && reconnect) {
+    set_broken("SPP: write error: " + prog);
+    check_connection();
+    ok = send(msg);
+  }
+  if (!ok) {
+    set_broken("SPP: write error: " + prog);
+    throw Err() << conn_err;
+  }
+}
+
+std::string
+Driver_spp::send_tagged(const std::string & msg, Answer * a) {
+  auto t = type_to_str(tag++);
+  write_msg(t + " " + msg);
+  pending[t] = a;
+  return t;
+}
+
+void
+Driver_spp::dispatch(const char * l, const size_t n) {
+  std::string t, err;
+  int res = parse_tagged(l, n, ch, t, err);
+  if (res == 0) {
+    // data line, #Fatal message
+    try { parse_line(l, n, ch, blk, prog); }
+    catch (Err & e) { set_broken(e.str()); }
+    return;
+  }
+  auto i = pending.find(t);
+  if (i != pending.end()) { // else: answer to a timed out request
+    auto a = i->second;
+    if (res == 1) a->data.swap(blk);
+    else { a->err = err; a->code = ERR_ANSWER; }
+    a->done = true;
+    pending.erase(i);
+    cv.notify_all();
+  }
+  blk.clear();
+}
+
+std::string
+Driver_spp::wait_answer(std::unique_lock<std::mutex> & lk,
+                        const std::string & t, Answer & a) {
+  auto t_end = std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(read_timeout));
+
+  while (!a.done){
+    if (reading) {
+      // another thread reads the program output
+      if (cv.wait_until(lk, t_end) == std::cv_status::timeout && !a.done) {
+        pending.erase(t);
+        throw Err() << "Read timeout";
+      }
+      continue;
+    }
+
+    // read a line without locking the mutex
+    reading = true;
+    lk.unlock();
+    const char * l = NULL;
+    size_t n = 0;
+    std::string tmp, err;
+    bool eof = false;
+    try {
+      double dt = std::chrono::duration<double>(
+        t_end - std::chrono::steady_clock::now()).count();
+      eof = !read_line(l, n, tmp, std::max(dt, 0.001));
+    }
+    catch (Err & e) { err = e.str(); }
+    lk.lock();
+    reading = false;
+    cv.notify_all();
+
+    if (broken) { broken = false; stop(); continue; }
+    if (eof) { set_broken("SPP: unexpected EOF: " + prog); continue; }
+    if (err.size()) {
+      if (a.done) break;
+      pending.erase(t);
+      throw Err() << err;
+    }
+    dispatch(l, n);
+  }
+  if (a.code) throw Err(a.code) << a.err;
+  return a.data;
+}
+
 std::string
 Driver_spp::read() {
-  if (!flt) throw Err() << errpref
+  std::unique_lock<std::mutex> lk(m);
+  if (ver==3) {
+    if (unread.empty()) throw Err() << errpref
+      << "no messages to read answer for";
+    // take the oldest answer, list nodes keep their addresses
+    std::list<std::pair<std::string, Answer> > u;
+    u.splice(u.begin(), unread, unread.begin());
+    return wait_answer(lk, u.front().first, u.front().second);
+  }
+  if (!running()) throw Err() << errpref
     << "device is closed";
   return read_spp(read_timeout);
 }
 
 void
 Driver_spp::write(const std::string & msg) {
-  if (!flt) throw Err() << errpref
-    << "device is closed";
-  flt->ostream() << msg << "\n";
-  flt->ostream().flush();
+  std::unique_lock<std::mutex> lk(m);
+  check_connection();
+  if (ver!=3) { write_msg(msg); return; }
+  unread.emplace_back();
+  try { unread.back().first = send_tagged(msg, &unread.back().second); }
+  catch (Err & e) { unread.pop_back(); throw; }
 }
 
-
 std::string
 Driver_spp::ask(const std::string & msg) {
   if (idn.size() && strcasecmp(msg.c_str(),"*idn?")) return idn;
-  write(msg);
-  return read();
+  std::unique_lock<std::mutex> lk(m);
+  check_connection();
+  if (ver!=3) {
+    write_msg(msg);
+    return read_spp(read_timeout);
+  }
+
+  // Register the answer and send the message. Other threads
+  // can send their messages while we are waiting.
+  Answer a;
+  auto t = send_tagged(msg, &a);
+  return wait_answer(lk, t, a);
+}
+
+/*************************************************/
+Driver_spp_pool::Driver_spp_pool(const Opt & o): opts(o), stop(false) {
+  errpref = opts.get("errpref", "spp: ") + opts.get("prog") + ": ";
+  int n = opts.get("instances", 1);
+  if (n<1) throw Err() << errpref << "-instances should be positive";
+
+  std::istringstream ss(opts.get("primary_cmds", ""));
+  std::string c;
+  while (ss >> c) primary_cmds.push_back(c);
+
+  // instances are restarted by the pool
+  opts.erase("instances");
+  opts.erase("primary_cmds");
+  opts.put("reconnect", 0);
+
+  double dmax = o.get("reconnect_max", 10.0);
+  for (int i=0; i<n; i++){
+    inst.push_back(Inst(dmax));
+    inst.back().d.reset(new Driver_spp(opts));
+  }
+  if (o.get("reconnect", true))
+    thr = std::thread(&Driver_spp_pool::restart_loop, this);
+}
+
+Driver_spp_pool::~Driver_spp_pool(){
+  {
+    std::lock_guard<std::mutex> lk(m);
+    stop = true;
+  }
+  cv.notify_all();
+  if (thr.joinable()) thr.join();
+}
+
+bool
+Driver_spp_pool::is_primary(const std::string & msg) const {
+  for (auto const & c: primary_cmds)
+    if (strncasecmp(msg.c_str(), c.c_str(), c.size())==0) return true;
+  return false;
+}
+
+size_t
+Driver_spp_pool::take(const bool primary){
+  std::unique_lock<std::mutex> lk(m);
+  while (1){
+    // idle running instance, primary one is the last choice
+    bool wait = false;
+    for (size_t k=1; k<=inst.size(); k++){
+      size_t i = k % inst.size();
+      if (primary && i!=0) continue;
+      auto & in = inst[i];
+      if (in.restarting) continue;
+      if (in.busy) {wait = true; continue;}
+      if (!in.d || !in.d->running()) continue;
+      in.busy = true;
+      return i;
+    }
+    // all instances have crashed: do not wait for restart
+    if (!wait) throw Err() << errpref << (primary?
+      "primary instance is not running" : "no running instances")
+      << (err.size()? ": " + err : std::string());
+    cv.wait(lk);
+  }
+}
+
+void
+Driver_spp_pool::give(const size_t i){
+  {
+    std::lock_guard<std::mutex> lk(m);
+    inst[i].busy = false;
+  }
+  cv.notify_all();
+}
+
+void
+Driver_spp_pool::restart_loop(){
+  std::unique_lock<std::mutex> lk(m);
+  while (!stop){
+    for (size_t i=0; i<inst.size() && !stop; i++){
+      auto & in = inst[i];
+      if (in.busy || (in.d && in.d->running()) || !in.backoff.ready()) continue;
+      in.restarting = true;
+      lk.unlock();
+      std::unique_ptr<Driver_spp> d;
+      std::string e;
+      in.d.reset(); // stop the old program
+      try { d.reset(new Driver_spp(opts)); }
+      catch (Err & ex) { e = ex.str(); }
+      lk.lock();
+      in.d.swap(d);
+      if (e.size()) { in.backoff.fail(); err = e; }
+      else in.backoff.reset();
+      in.restarting = false;
+      cv.notify_all();
+    }
+    cv.wait_for(lk, std::chrono::milliseconds(100));
+  }
+}
+
+std::string
+Driver_spp_pool::read() {
+  size_t i = take(true);
+  try { auto ret = inst[i].d->read(); give(i); return ret; }
+  catch (Err & e) { give(i); throw; }
+}
+
+void
+Driver_spp_pool::write(const std::string & msg) {
+  size_t i = take(true);
+  try { inst[i].d->write(msg); give(i); }
+  catch (Err & e) { give(i); throw; }
+}
+
+std::string
+Driver_spp_pool::ask(const std::string & msg) {
+  bool primary = is_primary(msg);
+  for (int attempt=0; ; attempt++){
+    size_t i = take(primary);
+    try {
+      auto ret = inst[i].d->ask(msg);
+      give(i);
+      return ret;
+    }
+    catch (Err & e) {
+      bool crashed = !inst[i].d->running();
+      give(i);
+      // repeat the query on another instance
+      if (!crashed || primary || attempt>0) throw;
+    }
+  }
 }
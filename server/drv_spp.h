@@ -1,7 +1,14 @@
 #ifndef DRV_SPP_H
 #define DRV_SPP_H
 
+#include <vector>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "drv.h"
+#include "drv_utils.h"
 #include "iofilter/iofilter.h"
 
 /*************************************************/
@@ -24,28 +31,224 @@ Parameters:
 
 * `-idn`     -- Override output of *idn? command. Default: do not override.
 
+* `-reconnect` -- Restart the program if it exited (unexpected EOF, #Fatal
+  message, write error). Restart is done before the next write, with
+  exponential back-off delays between attempts. Default: 1.
+
+* `-reconnect_max` -- Maximum delay between restart attempts, seconds.
+  Default: 10.0.
+
+* `-fast_pipe` -- Communicate with the program using raw pipes and a
+  reusable read buffer instead of iostreams. Faster for programs with
+  long answers. Default: 1.
+
+* `-instances` -- Run a few copies of the program and send requests to
+  idle ones (up to N requests are processed in parallel). Crashed
+  instances are restarted in background (with -reconnect_max
+  back-off), requests go to running instances; a request which failed
+  because the instance crashed is repeated once on another instance.
+  Use only for programs which do not keep state between requests or
+  share it (e.g. a database). Default: 1.
+
+* `-primary_cmds` -- Space-separated list of command prefixes (case
+  insensitive), commands starting with them are always sent to the
+  first (primary) instance, they are not repeated after crashes.
+  Use it for commands which modify program state. Default: empty.
+
+* `-pipeline` -- Max number of requests sent to a program with SPP
+  version 3 without waiting for answers. Default: 8.
+
+SPP version 3 (header `#SPP003`) is an extension with tagged requests.
+The header and the greeting message are same as in version 1. Then
+every request line starts with a tag (a word without spaces and colons),
+answer is finished with `#OK <tag>` or `#Error <tag>: <message>` line.
+Answers can go in any order, but lines of different answers should not
+be mixed. `#Fatal: <message>` line stops all requests. Programs with
+SPP3 can process a few requests in parallel, answers are distributed
+by tags.
+
 */
 
+/*************************************************/
+// Pipes to a program (its stdin and stdout). Data is read
+// with poll/read into a reusable buffer, lines are found with memchr.
+class SppPipe {
+  int pid;
+  int ifd, ofd; // stdin and stdout of the program
+  std::vector<char> buf;
+  size_t beg, end; // unread data in the buffer
+
+public:
+  // Run the program, throw Err on errors.
+  SppPipe(const std::string & prog);
+
+  // Close pipes, kill the program.
+  ~SppPipe();
+
+  // Get a line without the newline character. The pointer is valid
+  // until the next call. Return false on EOF, throw Err on errors and
+  // if there is no data for `timeout` seconds (no timeout if <0).
+  bool getline(const char * & l, size_t & n, const double timeout);
+
+  // Write data, return false on errors.
+  bool write(const std::string & data);
+};
+
 class Driver_spp: public Driver {
-  std::shared_ptr<IOFilter> flt;
+  std::shared_ptr<IOFilter> flt;  // -fast_pipe 0
+  std::unique_ptr<SppPipe> pp;    // -fast_pipe 1
+  bool fast;
+  size_t ans_size; // max answer size, used to preallocate memory
   std::string prog;
   char ch; // protocol special character
   int ver; // protocol version
   double open_timeout, read_timeout;
   std::string errpref; // error prefix
   std::string idn;
+  int pipeline;
+
+  bool reconnect;
+  Backoff backoff;
+  std::string conn_err; // error which stopped the program
+
+  // All data below is protected by the mutex. For SPP3 programs only
+  // one thread reads the program output at a time and distributes
+  // answers, others wait on the condition variable.
+  std::mutex m;
+  std::condition_variable cv;
+  struct Answer {
+    std::string data, err;
+    int code; // error code, 0 if there is no error
+    bool done;
+    Answer(): code(0), done(false) {}
+  };
+  std::map<std::string, Answer*> pending; // tag -> answer
+  std::list<std::pair<std::string, Answer> > unread; // answers for read()
+  uint64_t tag;     // next tag
+  bool reading;     // somebody reads the program output
+  bool broken;      // program should be stopped when reading is finished
+  std::string blk;  // answer being read (SPP3)
+
+  // Read a line from the program, return false on EOF.
+  // `tmp` is used as a buffer for iostream reading.
+  bool read_line(const char * & l, size_t & n,
+                 std::string & tmp, const double timeout);
+
+  // Send a line to the program, return false on errors.
+  bool send(const std::string & msg);
 
   // read SPP message until #OK or #Error line
   std::string read_spp(double timeout = -1);
 
+  // Start the program, read the header and the greeting message.
+  void start();
+
+  // Stop the program.
+  void stop();
+
+  // Stop the program after an error which breaks the communication,
+  // remember the error.
+  void set_broken(const std::string & err);
+
+  // Restart the program if needed. Throw Err on errors.
+  void check_connection();
+
+  // Send a message, restart the program if needed
+  // (before sending, or if nothing was sent).
+  void write_msg(const std::string & msg);
+
+  // SPP3: send a tagged message, register the answer.
+  std::string send_tagged(const std::string & msg, Answer * a);
+
+  // SPP3: process a line of program output.
+  void dispatch(const char * l, const size_t n);
+
+  // SPP3: wait for the answer, read program output if nobody else does.
+  std::string wait_answer(std::unique_lock<std::mutex> & lk,
+                          const std::string & t, Answer & a);
+
 public:
 
+  // Is the program running?
+  bool running() const {return (pp || flt) && !broken;}
+
+  // Parse SPP header (<symbol>SPP<version>), get special
+  // symbol and protocol version. Throw error if header is bad.
+  static void parse_header(const std::string & l,
+    const std::string & errpref, char & ch, int & ver);
+
+  // Process a line of SPP message, add it to `ret`.
+  // Return true if message is finished (#OK line),
+  // throw error on #Error and #Fatal lines.
+  static bool parse_line(const char * l, const size_t n, const char ch,
+    std::string & ret, const std::string & prog);
+  static bool parse_line(const std::string & l, const char ch,
+    std::string & ret, const std::string & prog){
+    return parse_line(l.data(), l.size(), ch, ret, prog);}
+
+  // Parse a terminating line of SPP3 answer: `#OK <tag>` or
+  // `#Error <tag>: <message>`. Return 1 for #OK, 2 for #Error
+  // (message is put to `err`), 0 for other lines.
+  static int parse_tagged(const char * l, const size_t n, const char ch,
+    std::string & tag, std::string & err);
+
   Driver_spp(const Opt & opts);
   ~Driver_spp();
 
   std::string read() override;
   void write(const std::string & msg) override;
   std::string ask(const std::string & msg) override;
+  bool read_compound() const override {return true;}
+  int parallel() const override {return ver==3? pipeline : 1;}
+};
+
+/*************************************************/
+// Pool of SPP programs (spp driver with -instances > 1).
+
+class Driver_spp_pool: public Driver {
+  struct Inst {
+    std::unique_ptr<Driver_spp> d; // NULL if the program is not running
+    bool busy;       // used by a request
+    bool restarting; // being restarted (not running for requests)
+    Backoff backoff;
+    Inst(const double dmax): busy(false), restarting(false), backoff(0.1, dmax) {}
+  };
+
+  Opt opts; // options for instances
+  std::string errpref;
+  std::vector<std::string> primary_cmds;
+  std::vector<Inst> inst;
+  std::string err; // last restart error
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread thr; // restarts crashed instances
+  bool stop;
+
+  // Should the message go to the primary instance?
+  bool is_primary(const std::string & msg) const;
+
+  // Get an idle running instance (only the primary one if primary=true,
+  // others are preferred otherwise), wait if all are busy.
+  size_t take(const bool primary);
+
+  // Return an instance to the pool.
+  void give(const size_t i);
+
+  // Restart crashed instances, runs in a separate thread.
+  void restart_loop();
+
+public:
+
+  Driver_spp_pool(const Opt & opts);
+  ~Driver_spp_pool();
+
+  // read/write go to the primary instance
+  std::string read() override;
+  void write(const std::string & msg) override;
+  std::string ask(const std::string & msg) override;
+  bool read_compound() const override {return true;}
+  int parallel() const override {return inst.size();}
 };
 
 #endif
@@ -2,6 +2,9 @@
 
 #include "drv_spp.h"
 #include "err/assert_err.h"
+#include <unistd.h>
+#include <thread>
+#include <chrono>
 
 using namespace std;
 
@@ -42,6 +45,188 @@ main(){
       Driver_spp d(o);
     }
 
+    // restart of the program
+    {
+      // answer one message and exit
+      o.put("prog", "echo '#SPP1\n#OK'; read a; echo $a; echo '#OK'");
+      Driver_spp d(o);
+      assert_eq(d.ask("a"), "a");
+      usleep(100000);
+      assert_eq(d.ask("b"), "b");
+
+      // exit while processing a message: error, restart on the next one
+      o.put("prog", "echo '#SPP1\n#OK'; read a; echo $a");
+      Driver_spp d1(o);
+      assert_err(d1.ask("a"), "SPP: unexpected EOF: " + o.get("prog"));
+      assert_err(d1.ask("a"), "SPP: unexpected EOF: " + o.get("prog"));
+
+      // #Error does not restart the program, #Fatal does
+      o.put("prog", "echo '#SPP1\n#OK'; read a; echo '#Error: err';"
+                    "read a; echo '#Fatal: fatal'");
+      Driver_spp d2(o);
+      assert_err(d2.ask("a"), "err");
+      assert_err(d2.ask("a"), "fatal");
+      assert_err(d2.ask("a"), "err");
+
+      // no restart
+      o.put("prog", "echo '#SPP1\n#OK'; read a; echo $a; echo '#OK'");
+      o.put("reconnect", 0);
+      Driver_spp d3(o);
+      assert_eq(d3.ask("a"), "a");
+      usleep(100000);
+      assert_err(d3.ask("b"), "SPP: write error: " + o.get("prog"));
+      assert_err(d3.ask("b"), "spp: " + o.get("prog") + ": device is closed");
+    }
+
+    // raw pipes and iostreams: long answers, long lines
+    for (int fast=0; fast<2; fast++){
+      Opt o1;
+      o1.put("prog", "echo '#SPP1\n#OK'; while read a; do seq $a;"
+                     " head -c $a /dev/zero | tr '\\0' x; echo; echo '##'; echo '#OK'; done");
+      o1.put("fast_pipe", fast);
+      Driver_spp d(o1);
+      for (int n: {1, 10, 100000}){
+        std::string exp;
+        for (int i=1; i<=n; i++) exp += type_to_str(i) + "\n";
+        exp += std::string(n, 'x') + "\n#";
+        assert_eq(d.ask(type_to_str(n)), exp);
+      }
+      assert_eq(d.ask("2"), "1\n2\nxx\n#");
+    }
+
+    // SPP3: tagged requests, answers in any order
+    {
+      char ch;
+      int ver;
+      std::string t, e;
+      Driver_spp::parse_header("#SPP003", "", ch, ver);
+      assert_eq(ver, 3);
+      assert_eq(Driver_spp::parse_tagged("#OK 12", 6, '#', t, e), 1);
+      assert_eq(t, "12");
+      assert_eq(Driver_spp::parse_tagged("#Error 5: a: b", 14, '#', t, e), 2);
+      assert_eq(t, "5");
+      assert_eq(e, "a: b");
+      assert_eq(Driver_spp::parse_tagged("#OK", 3, '#', t, e), 0);
+      assert_eq(Driver_spp::parse_tagged("##OK 1", 6, '#', t, e), 0);
+
+      Opt o1;
+      o1.put("prog", "echo '#SPP003\n#OK'; while read t c a; do case $c in"
+        " sleep) (sleep $a; printf '%s\\n##\\n#OK %s\\n' $a $t) & ;;"
+        " err) echo \"#Error $t: $a\";;"
+        " fatal) echo \"#Fatal: $a\"; exit;;"
+        " *) printf '%s\\n#OK %s\\n' $c $t;; esac; done");
+      Driver_spp d(o1);
+      assert_eq(d.parallel(), 8);
+      assert_eq(d.ask("a"), "a");
+      assert_err(d.ask("err e1"), "e1");
+
+      // answers go to their requests
+      std::vector<std::thread> thr;
+      std::vector<std::string> res(3);
+      std::vector<std::string> msg = {"sleep 0.3", "sleep 0.1", "b"};
+      auto t0 = std::chrono::steady_clock::now();
+      for (int i=0; i<3; i++)
+        thr.push_back(std::thread([&d, &res, &msg, i](){ res[i] = d.ask(msg[i]); }));
+      for (auto & t: thr) t.join();
+      double dt = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t0).count();
+      assert_eq(dt < 0.35, true);
+      assert_eq(res[0], "0.3\n#");
+      assert_eq(res[1], "0.1\n#");
+      assert_eq(res[2], "b");
+
+      // write/read
+      d.write("sleep 0.1");
+      d.write("c");
+      assert_eq(d.read(), "0.1\n#");
+      assert_eq(d.read(), "c");
+      assert_err(d.read(), "spp: " + o1.get("prog") + ": no messages to read answer for");
+
+      // timeout, late answer is skipped
+      o1.put("read_timeout", 0.1);
+      Driver_spp d1(o1);
+      assert_err(d1.ask("sleep 0.2"), "Read timeout");
+      usleep(200000);
+      assert_eq(d1.ask("x"), "x");
+
+      // #Fatal message, restart
+      assert_err(d1.ask("fatal f1"), "f1");
+      assert_eq(d1.ask("y"), "y");
+
+      // SPP1 programs get one request at a time
+      o1.put("prog", "echo '#SPP1\n#OK'");
+      Driver_spp d2(o1);
+      assert_eq(d2.parallel(), 1);
+    }
+
+    // pool of programs
+    {
+      Opt o1;
+      o1.put("prog", "echo '#SPP1\n#OK'; while read a b; do"
+                     " if [ \"$b\" = exit ]; then exit; fi; sleep 0.1; echo $$; echo '#OK'; done");
+      o1.put("instances", 3);
+      o1.put("primary_cmds", "set");
+      auto d = Driver::create("spp", o1);
+      assert_eq(d->parallel(), 3);
+
+      // parallel requests go to different instances
+      std::vector<std::thread> thr;
+      std::vector<std::string> res(3);
+      auto t0 = std::chrono::steady_clock::now();
+      for (int i=0; i<3; i++)
+        thr.push_back(std::thread([&d, &res, i](){ res[i] = d->ask("get"); }));
+      for (auto & t: thr) t.join();
+      double dt = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t0).count();
+      assert_eq(dt < 0.25, true);
+      assert_eq(res[0]!=res[1] && res[1]!=res[2] && res[0]!=res[2], true);
+
+      // commands for the primary instance
+      auto p = d->ask("set");
+      assert_eq(d->ask("SET 1"), p);
+      thr.clear();
+      for (int i=0; i<3; i++)
+        thr.push_back(std::thread([&d, &res, i](){ res[i] = d->ask(i? "get":"set"); }));
+      for (auto & t: thr) t.join();
+      assert_eq(res[0], p);
+
+      // crashed instances are restarted
+      assert_err(d->ask("set exit"), "SPP: unexpected EOF: " + o1.get("prog"));
+      assert_eq(d->ask("get").size()>0, true);
+      usleep(200000);
+      assert_eq(d->ask("set")!=p, true);
+
+      // requests do not wait for a slow restart
+      {
+        const char *fn = "test_data/spp_pool.tmp";
+        unlink(fn);
+        Opt o2(o1);
+        o2.put("prog", std::string("[ -f ") + fn + " ] && sleep 0.5; touch " + fn + ";"
+          + o1.get("prog"));
+        d = Driver::create("spp", o2);
+        assert_err(d->ask("set exit"), "SPP: unexpected EOF: " + o2.get("prog"));
+        usleep(50000);
+        auto t0 = std::chrono::steady_clock::now();
+        assert_err(d->ask("set"), "spp: " + o2.get("prog") +
+          ": primary instance is not running");
+        assert_eq(d->ask("get").size()>0, true);
+        double dt = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - t0).count();
+        assert_eq(dt < 0.3, true);
+        usleep(600000);
+        assert_eq(d->ask("set").size()>0, true);
+        unlink(fn);
+      }
+
+      // no restart
+      o1.put("reconnect", 0);
+      d = Driver::create("spp", o1);
+      assert_err(d->ask("set exit"), "SPP: unexpected EOF: " + o1.get("prog"));
+      assert_err(d->ask("set"), "spp: " + o1.get("prog") +
+        ": primary instance is not running");
+      assert_eq(d->ask("get").size()>0, true);
+    }
+
   }
   catch (Err e) {
     std::cerr << "Error: " << e.str() << "\n";
@@ -0,0 +1,75 @@
+#include "drv_test.h"
+#include "drv_spp.h"
+#include <unistd.h> // usleep
+
+void
+Driver_test::sleep_s(const double t){
+  if (t>0) usleep(t*1e6);
+}
+
+Driver_test::Driver_test(const Opt & opts, const std::list<std::string> & known) {
+  std::list<std::string> k(known);
+  k.insert(k.end(), {"delay", "jitter", "fail_rate",
+    "open_delay", "answer_size", "seed", "errpref", "read_cond"});
+  opts.check_unknown(k);
+
+  errpref     = opts.get("errpref", "test: ");
+  delay       = opts.get("delay", 0.0);
+  jitter      = opts.get("jitter", 0.0);
+  fail_rate   = opts.get("fail_rate", 0.0);
+  answer_size = opts.get<size_t>("answer_size", 0);
+  read_cond   = str_to_read_cond(opts.get("read_cond", "always"));
+  rnd.seed(opts.get<unsigned int>("seed", 1));
+
+  if (delay<0) throw Err() << errpref
+    << "-delay should be non-negative";
+  if (jitter<0) throw Err() << errpref
+    << "-jitter should be non-negative";
+  if (fail_rate<0 || fail_rate>1) throw Err() << errpref
+    << "-fail_rate should be in [0..1] range";
+
+  sleep_s(opts.get("open_delay", 0.0));
+}
+
+Driver_test::Driver_test(const Opt & opts): Driver_test(opts, {}) {}
+
+std::string
+Driver_test::read() {
+  std::uniform_real_distribution<double> dist(0.0, 1.0);
+
+  // always use two random numbers to keep sequence
+  // reproducible for any set of parameters
+  double r1 = dist(rnd), r2 = dist(rnd);
+  sleep_s(delay + jitter*r1);
+  if (r2 < fail_rate) throw Err() << errpref << "simulated failure";
+
+  if (answer_size==0 || m.size()==0) return m;
+  std::string ret;
+  ret.reserve(answer_size);
+  while (ret.size() < answer_size)
+    ret.append(m, 0, std::min(m.size(), answer_size - ret.size()));
+  return ret;
+}
+
+void
+Driver_test::write(const std::string & msg) {m = msg;}
+
+/*************************************************/
+
+Driver_test_spp::Driver_test_spp(const Opt & opts):
+  Driver_test(opts, {"header", "greeting", "open_error"}) {
+
+  // same checks as in the spp driver
+  char ch; int ver;
+  Driver_spp::parse_header(opts.get("header", "#SPP002"), errpref, ch, ver);
+
+  std::string ret;
+  std::string err = opts.get("open_error", "");
+  std::string greeting = opts.get("greeting", "test_spp");
+  std::istringstream ss(greeting + "\n" + ch +
+    (err.size()? "Error: " + err : std::string("OK")));
+  std::string l;
+  while (std::getline(ss, l))
+    if (Driver_spp::parse_line(l, ch, ret, "test_spp")) return;
+  throw Err() << "SPP: unexpected EOF: test_spp";
+}
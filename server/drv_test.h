@@ -1,29 +1,100 @@
 #ifndef DRV_TEST_H
 #define DRV_TEST_H
 
+#include <random>
 #include "drv.h"
+#include "drv_utils.h"
 #include "err/err.h"
 
 /*************************************************/
 /* Driver `test` -- a dummy driver for tests
 
-Just repeats any message sent to it.
-Parameters: none
+Repeats any message sent to it. Delays, random errors and answer size
+can be configured to model slow devices without any hardware.
+
+Parameters:
+
+* `-delay <v>`       -- Delay before answering each message, seconds.
+                        Default: 0.
+
+* `-jitter <v>`      -- Additional random delay, uniformly distributed
+                        in [0..jitter] range, seconds. Default: 0.
+
+* `-fail_rate <v>`   -- Probability of an error for each message, [0..1].
+                        Default: 0.
+
+* `-open_delay <v>`  -- Delay on opening the device, seconds.
+                        Default: 0.
+
+* `-answer_size <N>` -- If N>0, answer is the message repeated (or
+                        truncated) to N bytes. Default: 0 (just repeat
+                        the message).
+
+* `-seed <N>`        -- Seed for the random number generator.
+                        Default: 1.
+
+* `-errpref <v>`     -- Prefix for error messages.
+                        Default: "test: ".
+
+* `-read_cond <v>`   -- When do we read answer from a message:
+                        always, never, qmark (if there is a question mark
+                        in the message), qmark1w (question mark in
+                        the first word). Default: always.
 
 */
 
 class Driver_test: public Driver {
   std::string m;
+  double delay, jitter, fail_rate;
+  size_t answer_size;
+  int read_cond;
+  std::mt19937 rnd;
+
+protected:
+  std::string errpref;
+
+  // sleep for a given time (seconds)
+  static void sleep_s(const double t);
+
+  // check parameters which are common for test drivers
+  Driver_test(const Opt & opts, const std::list<std::string> & known);
+
 public:
-  Driver_test(const Opt & opts) {}
+  Driver_test(const Opt & opts);
 
-  std::string read() override {return m;};
+  std::string read() override;
 
-  void write(const std::string & msg) override {m = msg;};
+  void write(const std::string & msg) override;
 
   std::string ask(const std::string & msg) override {
-    write(msg); return read(); }
+    write(msg); return check_read_cond(msg, read_cond)? read() : std::string(); }
+
+  bool read_compound() const override {return read_cond_any(read_cond);}
 };
 
+/*************************************************/
+/* Driver `test_spp` -- `test` driver with SPP opening procedure
+
+Same as `test` but opening emulates startup of an SPP program: after
+`-open_delay` the header and the greeting message are checked in the same
+way as in `spp` driver. This can be used to test handling of slow or
+failing device opening.
+
+Parameters: same as in `test` driver, and
+
+* `-header <v>`      -- SPP header. Default: "#SPP002".
+
+* `-greeting <v>`    -- Greeting message. Default: "test_spp".
+
+* `-open_error <v>`  -- If not empty, the greeting ends with an error
+                        message instead of #OK and opening fails.
+                        Default: empty.
+
+*/
+
+class Driver_test_spp: public Driver_test {
+public:
+  Driver_test_spp(const Opt & opts);
+};
 
 #endif
@@ -0,0 +1,112 @@
+///\cond HIDDEN (do not show this in Doxyden)
+
+#include "drv_test.h"
+#include "err/assert_err.h"
+#include <sys/time.h>
+
+using namespace std;
+
+// current time, seconds
+double
+now(){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+int
+main(){
+  try{
+
+    Opt o;
+    {
+      Driver_test d(o);
+      assert_eq(d.ask("abc"), "abc");
+      assert_eq(d.ask(""), "");
+    }
+
+    o.put("xxx", 1);
+    assert_err(Driver_test d(o), "unknown option: xxx");
+    o.erase("xxx");
+
+    o.put("fail_rate", 2);
+    assert_err(Driver_test d(o), "test: -fail_rate should be in [0..1] range");
+    o.put("fail_rate", 1);
+    {
+      Driver_test d(o);
+      assert_err(d.ask("abc"), "test: simulated failure");
+    }
+    o.erase("fail_rate");
+
+    // answer size
+    o.put("answer_size", 8);
+    {
+      Driver_test d(o);
+      assert_eq(d.ask("abc"), "abcabcab");
+      assert_eq(d.ask("0123456789"), "01234567");
+      assert_eq(d.ask(""), "");
+    }
+    o.erase("answer_size");
+
+    // same seed -- same sequence of errors
+    o.put("fail_rate", 0.5);
+    {
+      Driver_test d1(o), d2(o);
+      int n1=0, n2=0;
+      for (int i=0; i<100; i++){
+        bool e1=false, e2=false;
+        try { d1.ask("a"); } catch (Err & e) {e1=true; n1++;}
+        try { d2.ask("a"); } catch (Err & e) {e2=true; n2++;}
+        assert_eq(e1, e2);
+      }
+      assert_eq(n1>20 && n1<80, true);
+    }
+    o.erase("fail_rate");
+
+    // delays
+    o.put("open_delay", 0.05);
+    o.put("delay", 0.02);
+    o.put("jitter", 0.01);
+    {
+      double t0 = now();
+      Driver_test d(o);
+      double t1 = now();
+      d.ask("a");
+      double t2 = now();
+      assert_eq(t1-t0 >= 0.05, true);
+      assert_eq(t2-t1 >= 0.02, true);
+      assert_eq(t2-t1 <  0.03 + 0.01, true);
+    }
+
+    // test_spp driver
+    Opt o1;
+    {
+      Driver_test_spp d(o1);
+      assert_eq(d.ask("abc"), "abc");
+    }
+    o1.put("header", "#SPP1a");
+    assert_err(Driver_test_spp d(o1), "can't parse value: \"1a\"");
+    o1.put("header", "#SAA1");
+    assert_err(Driver_test_spp d(o1), "test: not an SPP program, header expected");
+    o1.put("header", "#SPP5");
+    assert_err(Driver_test_spp d(o1), "test: unsupported SPP version");
+    o1.put("header", "%SPP1");
+    o1.put("greeting", "a\n%b");
+    assert_err(Driver_test_spp d(o1),
+      "SPP: symbol % in the beginning of a line is not protected: test_spp");
+    o1.put("greeting", "a\n%%b");
+    {
+      Driver_test_spp d(o1);
+    }
+    o1.put("open_error", "can't open");
+    assert_err(Driver_test_spp d(o1), "can't open");
+
+  }
+  catch (Err e) {
+    std::cerr << "Error: " << e.str() << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+///\endcond
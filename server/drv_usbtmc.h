@@ -56,6 +56,7 @@ public:
   std::string read() override;
   void write(const std::string & msg) override;
   std::string ask(const std::string & msg) override;
+  bool read_compound() const override {return read_cond_any(read_cond);}
 };
 
 #endif
@@ -1,5 +1,6 @@
 #include "drv_utils.h"
 #include "err/err.h"
+#include <algorithm>
 
 bool
 trim_str(std::string & str, const std::string & trim){
@@ -33,3 +34,23 @@ check_read_cond(const std::string & msg, const int cond){
   }
   throw Err() << "bad read_cond: " << cond;
 }
+
+bool
+read_cond_any(const int cond){
+  return cond == READCOND_ALWAYS || cond == READCOND_QMARK;
+}
+
+double
+Backoff::wait() const {
+  if (ready()) return 0;
+  return std::chrono::duration<double>(
+    next - std::chrono::steady_clock::now()).count();
+}
+
+void
+Backoff::fail() {
+  delay = delay==0 ? dmin : std::min(2*delay, dmax);
+  next = std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(delay));
+}
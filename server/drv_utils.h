@@ -2,6 +2,7 @@
 #define DRV_UTILS_H
 
 #include <string>
+#include <chrono>
 
 // Trim substring `trim` from the end of `str` (if it is there).
 // Return true if the rimming is done.
@@ -22,6 +23,33 @@ read_cond_t str_to_read_cond(const std::string & str);
 // Check if the message contains no question marks
 bool check_read_cond(const std::string & msg, const int cond);
 
+// Is an answer read for any message with `?` (not only in the first word)?
+bool read_cond_any(const int cond);
+
+// Exponential back-off for reconnecting broken connections.
+// First attempt can be done immediately, after each failure
+// the delay is doubled, from `dmin` to `dmax`.
+class Backoff {
+  double dmin, dmax, delay;
+  std::chrono::steady_clock::time_point next;
+public:
+  Backoff(const double dmin = 0.1, const double dmax = 10.0):
+    dmin(dmin), dmax(dmax), delay(0) {}
+
+  // Can we make an attempt now?
+  bool ready() const { return delay==0 ||
+    std::chrono::steady_clock::now() >= next; }
+
+  // Time until the next attempt, s.
+  double wait() const;
+
+  // Attempt failed: increase the delay.
+  void fail();
+
+  // Attempt was successful: reset the delay.
+  void reset() { delay = 0; }
+};
+
 #endif
 
 
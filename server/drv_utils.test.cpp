@@ -2,6 +2,7 @@
 
 #include "drv_utils.h"
 #include "err/assert_err.h"
+#include <unistd.h>
 
 using namespace std;
 
@@ -29,6 +30,23 @@ main(){
     assert_eq(check_read_cond("DISP:TEXT WHAT?!", READCOND_QMARK1W),  false);
     assert_eq(check_read_cond("DISP:TEXT? (1)", READCOND_QMARK1W),  true);
 
+
+    // exponential back-off
+    {
+      Backoff b(0.1, 0.15);
+      assert_eq(b.ready(), true);
+      assert_eq(b.wait(), 0);
+      b.fail();
+      assert_eq(b.ready(), false);
+      assert_eq(b.wait()>0.05 && b.wait()<=0.1, true);
+      usleep(100000);
+      assert_eq(b.ready(), true);
+      b.fail();
+      assert_eq(b.wait()>0.1 && b.wait()<=0.15, true); // limited by dmax
+      b.reset();
+      assert_eq(b.ready(), true);
+    }
+
   }
   catch (Err e) {
     std::cerr << "Error: " << e.str() << "\n";
@@ -0,0 +1,307 @@
+#include "drv_vxi11.h"
+#include "drv_net.h"
+#include "err/err.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <chrono>
+#include <poll.h>
+#include <sys/socket.h>
+
+// portmapper
+#define PMAP_PROG    100000
+#define PMAP_VERS    2
+#define PMAP_GETPORT 3
+#define IPPROTO_TCP_ 6
+
+/*************************************************/
+XdrOut &
+XdrOut::u32(const uint32_t v){
+  for (int i=3; i>=0; i--) buf += (char)((v >> (8*i)) & 0xff);
+  return *this;
+}
+
+XdrOut &
+XdrOut::opaque(const std::string & s){
+  u32(s.size());
+  buf += s;
+  buf.append((4 - s.size()%4)%4, '\0');
+  return *this;
+}
+
+uint32_t
+XdrIn::u32(){
+  if (pos+4 > buf.size()) throw Err() << "XDR: data is too short";
+  uint32_t ret = 0;
+  for (int i=0; i<4; i++) ret = (ret<<8) | (uint8_t)buf[pos++];
+  return ret;
+}
+
+std::string
+XdrIn::opaque(){
+  size_t n = u32();
+  if (pos+n > buf.size()) throw Err() << "XDR: data is too short";
+  std::string ret = buf.substr(pos, n);
+  pos += n + (4 - n%4)%4;
+  return ret;
+}
+
+/*************************************************/
+bool
+RpcClient::read_record(const int fd, std::string & rec, const double timeout){
+  auto t_end = std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(timeout));
+  rec.clear();
+  while (1) {
+    char h[4];
+    read_n(fd, h, 4, t_end);
+    uint32_t v = 0;
+    for (int i=0; i<4; i++) v = (v<<8) | (uint8_t)h[i];
+    size_t n = v & 0x7fffffff;
+    size_t s = rec.size();
+    rec.resize(s+n);
+    if (n) read_n(fd, &rec[s], n, t_end);
+    if (v & 0x80000000) return true;
+  }
+}
+
+void
+RpcClient::write_record(const int fd, const std::string & rec){
+  std::string s = XdrOut().u32(0x80000000 | rec.size()).str() + rec;
+  size_t n = 0;
+  while (n < s.size()){
+    auto res = ::send(fd, s.data()+n, s.size()-n, MSG_NOSIGNAL);
+    if (res<0 && errno==EINTR) continue;
+    if (res<0) throw Err() << "write error: " << strerror(errno);
+    n += res;
+  }
+}
+
+void
+RpcClient::open(const std::string & addr, const std::string & port,
+                const std::string & errpref, const double timeout){
+  close();
+  fd = tcp_connect(addr, port, errpref, timeout, 60.0);
+}
+
+void
+RpcClient::close(){
+  if (fd>=0) ::close(fd);
+  fd = -1;
+}
+
+std::string
+RpcClient::call(const uint32_t prog, const uint32_t vers,
+    const uint32_t proc, const std::string & args, const double timeout){
+  if (fd<0) throw Err() << "RPC: not connected";
+  uint32_t x = xid++;
+  XdrOut c;
+  c.u32(x).u32(0).u32(2).u32(prog).u32(vers).u32(proc)
+   .u32(0).u32(0)  // credentials: AUTH_NONE
+   .u32(0).u32(0); // verifier: AUTH_NONE
+  write_record(fd, c.str() + args);
+
+  while (1){
+    std::string rec;
+    read_record(fd, rec, timeout);
+    XdrIn r(rec);
+    if (r.u32() != x) continue; // reply to an old call
+    if (r.u32() != 1) throw Err() << "RPC: reply expected";
+    if (r.u32() != 0) throw Err() << "RPC: call is rejected";
+    r.u32(); r.opaque(); // verifier
+    auto st = r.u32();
+    if (st != 0) throw Err() << "RPC: call is not accepted: " << st;
+    return r.rest();
+  }
+}
+
+/*************************************************/
+
+std::string
+Driver_vxi11::err_msg(const uint32_t code){
+  switch (code){
+    case 1:  return "syntax error";
+    case 3:  return "device not accessible";
+    case 4:  return "invalid link identifier";
+    case 5:  return "parameter error";
+    case 6:  return "channel not established";
+    case 8:  return "operation not supported";
+    case 9:  return "out of resources";
+    case 11: return "device locked by another link";
+    case 12: return "no lock held by this link";
+    case 15: return "I/O timeout";
+    case 17: return "I/O error";
+    case 21: return "invalid address";
+    case 23: return "abort";
+    case 29: return "channel already established";
+  }
+  return "error " + type_to_str(code);
+}
+
+Driver_vxi11::Driver_vxi11(const Opt & opts): lid(0), max_recv(0) {
+  opts.check_unknown({"addr","port","pmap_port","name","timeout",
+    "connect_timeout","read_size","errpref","idn","read_cond","add_str",
+    "trim_str","reconnect","reconnect_max"});
+
+  errpref = opts.get("errpref", "vxi11: ");
+
+  addr = opts.get("addr", "");
+  if (addr == "") throw Err() << errpref
+    << "Parameter -addr is empty or missing";
+  port      = opts.get("port", "0");
+  pmap_port = opts.get("pmap_port", "111");
+  name      = opts.get("name", "inst0");
+
+  errpref += addr + ": ";
+
+  timeout   = opts.get("timeout", 5.0);
+  connect_timeout = opts.get("connect_timeout", 5.0);
+  read_size = opts.get<uint32_t>("read_size", 65536);
+  add       = opts.get("add_str",  "\n");
+  trim      = opts.get("trim_str", "\n");
+  idn       = opts.get("idn", "");
+  read_cond = str_to_read_cond(opts.get("read_cond", "qmark1w"));
+  reconnect = opts.get("reconnect", true);
+  backoff = Backoff(0.1, opts.get("reconnect_max", 10.0));
+  if (read_size==0) throw Err() << errpref
+    << "-read_size should be positive";
+
+  open_link();
+}
+
+Driver_vxi11::~Driver_vxi11() {
+  close_link();
+}
+
+void
+Driver_vxi11::open_link() {
+  try {
+    // ask portmapper for the port
+    std::string p = port;
+    if (p == "0") {
+      rpc.open(addr, pmap_port, "", connect_timeout);
+      XdrOut a;
+      a.u32(PROG).u32(VERS).u32(IPPROTO_TCP_).u32(0);
+      XdrIn r(rpc.call(PMAP_PROG, PMAP_VERS, PMAP_GETPORT, a.str(), timeout));
+      p = type_to_str(r.u32());
+      rpc.close();
+      if (p == "0") throw Err() << "VXI-11 service is not registered";
+    }
+
+    // create link
+    rpc.open(addr, p, "", connect_timeout);
+    XdrOut a;
+    a.u32(getpid()).u32(0).u32(0).opaque(name);
+    XdrIn r(rpc.call(PROG, VERS, CREATE_LINK, a.str(), timeout));
+    auto e = r.u32();
+    if (e) throw Err() << "can't create link: " << err_msg(e);
+    lid = r.u32();
+    r.u32(); // abort port
+    max_recv = r.u32();
+    if (max_recv==0) max_recv = 1024;
+  }
+  catch (Err & e) {
+    rpc.close();
+    throw Err() << errpref << e.str();
+  }
+}
+
+void
+Driver_vxi11::close_link() {
+  if (!rpc.is_open()) return;
+  try { rpc.call(PROG, VERS, DESTROY_LINK, XdrOut().u32(lid).str(), 1.0); }
+  catch (Err & e) {}
+  rpc.close();
+}
+
+void
+Driver_vxi11::check_connection() {
+  if (rpc.is_open()) return;
+  if (!reconnect) throw Err() << errpref << conn_err;
+  if (!backoff.ready()) throw Err() << errpref << conn_err
+    << " (reconnecting in " << backoff.wait() << " s)";
+  try { open_link(); }
+  catch (Err & e) {
+    backoff.fail();
+    conn_err = e.str().substr(errpref.size());
+    throw;
+  }
+  backoff.reset();
+}
+
+XdrIn
+Driver_vxi11::call(const uint32_t proc, const std::string & args) {
+  check_connection();
+  std::string res;
+  // RPC timeout is longer than the device I/O timeout
+  try { res = rpc.call(PROG, VERS, proc, args, timeout + 1.0); }
+  catch (Err & e) {
+    rpc.close();
+    conn_err = e.str();
+    throw Err() << errpref << e.str();
+  }
+  XdrIn r(res);
+  auto e = r.u32();
+  if (e) throw Err() << errpref << err_msg(e);
+  return r;
+}
+
+void
+Driver_vxi11::write(const std::string & msg) {
+  std::string s = msg + add;
+  uint32_t tmo = timeout*1000;
+  // split long messages, END flag is set in the last part
+  size_t n = 0;
+  do {
+    size_t len = std::min<size_t>(s.size()-n, max_recv);
+    bool last = n + len >= s.size();
+    XdrOut a;
+    a.u32(lid).u32(tmo).u32(tmo).u32(last? FLAG_END:0).opaque(s.substr(n, len));
+    auto r = call(DEVICE_WRITE, a.str());
+    auto sent = r.u32();
+    if (sent==0 && len>0) throw Err() << errpref << "device_write: no data accepted";
+    n += std::min<size_t>(sent, len);
+  } while (n < s.size());
+}
+
+std::string
+Driver_vxi11::read() {
+  std::string ret;
+  uint32_t tmo = timeout*1000;
+  // read in chunks until END or termination character
+  while (1){
+    XdrOut a;
+    a.u32(lid).u32(read_size).u32(tmo).u32(tmo).u32(0).u32(0);
+    auto r = call(DEVICE_READ, a.str());
+    auto reason = r.u32();
+    ret += r.opaque();
+    if (reason & (REASON_END | REASON_CHR)) break;
+  }
+  trim_str(ret, trim);
+  return ret;
+}
+
+std::string
+Driver_vxi11::ask(const std::string & msg) {
+  if (idn.size() && strcasecmp(msg.c_str(),"*idn?")==0) return idn;
+
+  uint32_t tmo = timeout*1000;
+  if (msg == "#stb"){
+    XdrOut a;
+    a.u32(lid).u32(0).u32(tmo).u32(tmo);
+    auto r = call(DEVICE_READSTB, a.str());
+    return type_to_str(r.u32() & 0xff);
+  }
+  if (msg == "#clear"){
+    XdrOut a;
+    a.u32(lid).u32(0).u32(tmo).u32(tmo);
+    call(DEVICE_CLEAR, a.str());
+    return std::string();
+  }
+
+  write(msg);
+  if (!check_read_cond(msg, read_cond)) return std::string();
+  return read();
+}
@@ -0,0 +1,164 @@
+#ifndef DRV_VXI11_H
+#define DRV_VXI11_H
+
+#include <cstdint>
+#include "drv.h"
+#include "drv_utils.h"
+#include "opt/opt.h"
+
+/*************************************************/
+/*
+ * Driver `vxi11` -- LXI devices, VXI-11 protocol (ONC RPC)
+ *
+
+Driver opens a link to the device (create_link) and keeps it open until
+the device is closed. Messages are sent with device_write, answers are
+read with device_read in chunks of `-read_size` bytes until the END
+indicator. Long messages are split according to maxRecvSize reported by
+the device.
+
+If `-port` parameter is not set, port of the VXI-11 core channel is
+requested from the portmapper on the device (port 111).
+
+Driver reads answer from the device only if there is a question mark '?'
+in the first word of the message.
+
+Special messages (not sent to the device):
+
+* `#stb`   -- Read status byte (device_readstb), return decimal number.
+* `#clear` -- Device clear (device_clear).
+
+Parameters:
+
+* `-addr`          -- Network address or IP.
+                      Required.
+* `-port <N>`      -- Port of the VXI-11 core channel.
+                      Default: 0, ask the portmapper.
+* `-pmap_port <N>` -- Portmapper port. Default: 111.
+* `-name <v>`      -- Device name.
+                      Default: "inst0".
+* `-timeout <N>`   -- I/O timeout, seconds.
+                      Default 5.0.
+* `-connect_timeout <N>` -- Connection timeout, seconds.
+                      Default: 5.0.
+* `-read_size <N>` -- Max number of bytes in one device_read call.
+                      Default: 65536.
+* `-errpref <str>` -- Prefix for error messages.
+                      Default: "vxi11: "
+* `-idn <str>`     -- Override output of *idn? command.
+                      Default: empty string, do not override.
+* `-read_cond <v>` -- When do we need to read answer from a command:
+                      always, never, qmark (if there is a question mark in the message),
+                      qmark1w (question mark in the first word). Default: qmark1w.
+* `-add_str <v>`   -- Add string to each message sent to the device.
+                      Default: "\n"
+* `-trim_str <v>`  -- Remove string from the end of received messages.
+                      Default: "\n"
+* `-reconnect <v>`, `-reconnect_max <v>` -- Reconnection settings,
+                      same as in `net` driver.
+*/
+
+/*************************************************/
+// XDR encoding (RFC 4506), only types used in VXI-11.
+
+class XdrOut {
+  std::string buf;
+public:
+  XdrOut & u32(const uint32_t v);
+  XdrOut & opaque(const std::string & s); // variable-length opaque, string
+  const std::string & str() const {return buf;}
+};
+
+class XdrIn {
+  std::string buf;
+  size_t pos;
+public:
+  XdrIn(const std::string & s): buf(s), pos(0) {}
+  uint32_t u32();       // throw Err if data is too short
+  std::string opaque();
+  std::string rest() const {return buf.substr(pos);} // data after the current position
+};
+
+/*************************************************/
+// ONC RPC over TCP (RFC 5531), calls with AUTH_NONE.
+
+class RpcClient {
+  int fd;
+  uint32_t xid;
+public:
+  RpcClient(): fd(-1), xid(1) {}
+  ~RpcClient() {close();}
+
+  // Connect to a server, throw Err on errors.
+  void open(const std::string & addr, const std::string & port,
+            const std::string & errpref, const double timeout);
+  void close();
+  bool is_open() const {return fd>=0;}
+
+  // Do a call, return result data. Throw Err on errors.
+  std::string call(const uint32_t prog, const uint32_t vers,
+    const uint32_t proc, const std::string & args, const double timeout);
+
+  // Read/write RPC record (record marking).
+  static bool read_record(const int fd, std::string & rec, const double timeout);
+  static void write_record(const int fd, const std::string & rec);
+};
+
+/*************************************************/
+
+class Driver_vxi11: public Driver {
+public:
+  // VXI-11 core channel program and procedures
+  enum {
+    PROG = 0x0607AF, VERS = 1,
+    CREATE_LINK = 10, DEVICE_WRITE = 11, DEVICE_READ = 12,
+    DEVICE_READSTB = 13, DEVICE_CLEAR = 15, DESTROY_LINK = 23
+  };
+  // flags and read reasons
+  enum {
+    FLAG_END = 8, REASON_REQCNT = 1, REASON_CHR = 2, REASON_END = 4
+  };
+
+  // Error message for a VXI-11 error code.
+  static std::string err_msg(const uint32_t code);
+
+private:
+  std::string addr, port, pmap_port, name;
+  std::string errpref, idn, add, trim;
+  double timeout, connect_timeout;
+  uint32_t read_size;
+  read_cond_t read_cond;
+
+  RpcClient rpc;
+  uint32_t lid;      // link id
+  uint32_t max_recv; // max size of device_write data
+
+  bool reconnect;
+  Backoff backoff;
+  std::string conn_err; // error which broke the connection
+
+  // Find port of the core channel, connect, create link.
+  void open_link();
+
+  // Destroy link, close the connection.
+  void close_link();
+
+  // Reconnect if needed.
+  void check_connection();
+
+  // Do a VXI-11 call, mark connection as broken on RPC errors.
+  // Check VXI-11 error code (first field of the result).
+  XdrIn call(const uint32_t proc, const std::string & args);
+
+public:
+
+  Driver_vxi11(const Opt & opts);
+  ~Driver_vxi11();
+
+  std::string read() override;
+  void write(const std::string & msg) override;
+  std::string ask(const std::string & msg) override;
+  bool read_compound() const override {return read_cond_any(read_cond);}
+};
+
+#endif
@@ -1,10 +1,15 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <atomic>
+#include <unistd.h>
+#include <poll.h>
+#include <cmath>
 #include <arpa/inet.h>
 
 #include "err/err.h"
 #include "http_server.h"
+#include "unix_sock.h"
 
 #if MHD_VERSION < 0x00097002
 #define MHD_Result int
@@ -21,6 +26,15 @@ AppendToOpt (void *cls,
 }
 
 
+// Check if the client is still connected (requests of disconnected
+// clients are removed from device queues).
+bool
+conn_alive(const int fd){
+  struct pollfd p = {fd, POLLRDHUP, 0};
+  if (poll(&p, 1, 0) <= 0) return true;
+  return (p.revents & (POLLRDHUP | POLLHUP | POLLERR)) == 0;
+}
+
 // callback (MHD_AccessHandlerCallback) for processing requests
 MHD_Result
 ProcessRequest(void * cls,
@@ -59,27 +73,44 @@ ProcessRequest(void * cls,
     Opt opts;
     MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, AppendToOpt, &opts);
     Log(3) << "conn:" << cnum << " process request: " << url;
-    std::string msg = dm->run(url, opts, cnum);
+    int fd = MHD_get_connection_info(
+      connection, MHD_CONNECTION_INFO_CONNECTION_FD)->connect_fd;
+    std::string msg = dm->run(url, opts, cnum,
+      [fd](){ return conn_alive(fd); });
     Log(3) << "conn:" << cnum << " answer: " << msg;
     response = MHD_create_response_from_buffer(
         msg.length(), (void*)msg.data(), MHD_RESPMEM_MUST_COPY);
     ret = MHD_queue_response(connection, 200, response);
     MHD_destroy_response(response);
   }
+  catch (ErrBusy & e) {
+    // device is busy: 503 response with Retry-After header (integer seconds)
+    Log(3) << "conn:" << cnum << " busy: " << e.str();
+    response = MHD_create_response_from_buffer(
+        e.str().length(), (void*)e.str().data(), MHD_RESPMEM_MUST_COPY);
+    MHD_add_response_header(response, "Error", e.str().c_str());
+    int t = (int)ceil(e.retry_after);
+    MHD_add_response_header(response, "Retry-After",
+      type_to_str(t>0? t:1).c_str());
+    ret = MHD_queue_response(connection, 503, response);
+    MHD_destroy_response(response);
+  }
   catch (Err e) {
     Log(3) << "conn:" << cnum << " error: " << e.str();
     response = MHD_create_response_from_buffer(
         e.str().length(), (void*)e.str().data(), MHD_RESPMEM_MUST_COPY);
     MHD_add_response_header(response, "Error", e.str().c_str());
-    ret = MHD_queue_response(connection, 400, response);
+    // request replaced by a newer one (coalescing): 409 response
+    ret = MHD_queue_response(connection,
+      e.code()==ERR_SUPERSEDED? 409:400, response);
     MHD_destroy_response(response);
   }
 
   return ret;
 }
 
-// global connection counter
-uint64_t cmax = 0;
+// global connection counter (shared between TCP and unix socket servers)
+std::atomic<uint64_t> cmax(0);
 
 // Callback for opening/closing a connection
 void ConnFunc (void *cls,
@@ -101,12 +132,17 @@ void ConnFunc (void *cls,
     if (Log::get_log_level() >= 2){
       auto info = MHD_get_connection_info(
         connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
-      struct sockaddr_in *sa = (sockaddr_in*)info->client_addr;
-      uint32_t a = ntohl(sa->sin_addr.s_addr);
-      //uint16_t p = ntohs(sa->sin_port);
-      Log(2) << "conn:" << cnum << " open connection from "
-             << ((a>>24)&0xff) << "." << ((a>>16)&0xff) << "."
-             << ((a>>8)&0xff) << "." << (a&0xff);
+      if (info->client_addr->sa_family == AF_INET){
+        struct sockaddr_in *sa = (sockaddr_in*)info->client_addr;
+        uint32_t a = ntohl(sa->sin_addr.s_addr);
+        //uint16_t p = ntohs(sa->sin_port);
+        Log(2) << "conn:" << cnum << " open connection from "
+               << ((a>>24)&0xff) << "." << ((a>>16)&0xff) << "."
+               << ((a>>8)&0xff) << "." << (a&0xff);
+      }
+      else {
+        Log(2) << "conn:" << cnum << " open connection from unix socket";
+      }
     }
 
     dm->conn_open(cnum);
@@ -120,11 +156,9 @@ void ConnFunc (void *cls,
   }
 }
 
-HTTP_Server::HTTP_Server(
-      const std::string & addr,
-      const int port,
-      const bool test,
-      DevManager * dm) {
+void
+HTTP_Server::start(const int port, const int fd, const bool test,
+                   DevManager * dm, void * sock){
 
   // create option structure
   std::vector<struct MHD_OptionItem> ops;
@@ -137,16 +171,12 @@ HTTP_Server::HTTP_Server(
     {MHD_OPTION_NOTIFY_CONNECTION, (intptr_t)&ConnFunc, dm});
 
   // listen only one address
-  struct sockaddr_in sock;
-  if (addr!="*"){
-    // fill sockaddr_in structure
-    memset (&sock, 0, sizeof (struct sockaddr_in));
-    sock.sin_family = AF_INET;
-    sock.sin_port = htons(port);
-    sock.sin_addr.s_addr = htonl(str_to_type_ip4(addr));
-    ops.push_back((MHD_OptionItem)
-      { MHD_OPTION_SOCK_ADDR, 0, &sock });
-  }
+  if (sock) ops.push_back((MHD_OptionItem)
+      { MHD_OPTION_SOCK_ADDR, 0, sock });
+
+  // pre-bound listening socket
+  if (fd>=0) ops.push_back((MHD_OptionItem)
+      { MHD_OPTION_LISTEN_SOCKET, fd, NULL });
 
   // test mode - only one connection at a time, to
   // have reproducible logs
@@ -164,13 +194,45 @@ HTTP_Server::HTTP_Server(
       flags, port, NULL, NULL, &ProcessRequest, dm,
       MHD_OPTION_ARRAY, ops.data(),
       MHD_OPTION_END);
+}
 
+HTTP_Server::HTTP_Server(
+      const std::string & addr,
+      const int port,
+      const bool test,
+      DevManager * dm) {
+
+  // listen only one address
+  struct sockaddr_in sock;
+  if (addr!="*"){
+    // fill sockaddr_in structure
+    memset (&sock, 0, sizeof (struct sockaddr_in));
+    sock.sin_family = AF_INET;
+    sock.sin_port = htons(port);
+    sock.sin_addr.s_addr = htonl(str_to_type_ip4(addr));
+  }
+
+  start(port, -1, test, dm, addr!="*"? &sock : NULL);
   if (d == NULL)
     throw Err() << "Can't start http server at " << addr << ":" << port;
 }
 
+HTTP_Server::HTTP_Server(
+      const std::string & path,
+      const int mode,
+      DevManager * dm) {
+
+  int fd = unix_sock_listen(path, mode);
+  start(0, fd, false, dm, NULL);
+  if (d == NULL){
+    ::close(fd);
+    unlink(path.c_str());
+    throw Err() << "Can't start http server at " << path;
+  }
+  sock_path = path;
+}
+
 HTTP_Server::~HTTP_Server(){
   MHD_stop_daemon((MHD_Daemon*)d);
+  if (sock_path!="") unlink(sock_path.c_str());
 }
-
-
@@ -11,14 +11,26 @@
 
 class HTTP_Server{
   void *d;
+  std::string sock_path; // unix socket (to be removed in destructor)
+
+  // start MHD daemon
+  void start(const int port, const int fd, const bool test,
+             DevManager * dm, void * sock);
 
 public:
+  // Listen TCP port.
   HTTP_Server(
       const std::string & addr,
       const int port,
       bool test, // test mode with single connection
       DevManager * dm);
 
+  // Listen unix domain socket with a given access mode.
+  HTTP_Server(
+      const std::string & path,
+      const int mode,
+      DevManager * dm);
+
   ~HTTP_Server();
 };
 
@@ -0,0 +1,248 @@
+#include "sequence.h"
+#include "err/err.h"
+#include "opt/opt.h"
+#include "read_words/read_words.h"
+
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <cstring>
+
+// max number of points in a sequence
+#define SEQ_MAX_POINTS 1000000
+
+/*************************************************/
+
+Sequence::Sequence(const std::string & descr, const ask_t & ask):
+     period(0), total(1), ask(ask), state(RUNNING), done(0), stop_(false){
+
+  std::istringstream ss(descr);
+  int line_num[2] = {0,0};
+  try {
+    while (1){
+      auto vs = read_words(ss, line_num, false);
+      if (vs.empty()) break;
+      auto const & c = vs[0];
+
+      if (c == "loop" || c == "list"){
+        if (c == "loop" && vs.size()!=5) throw Err()
+          << "expected: loop <var> <from> <to> <step>";
+        if (c == "list" && vs.size()<3) throw Err()
+          << "expected: list <var> <v1> <v2> ...";
+        Loop l;
+        l.var = vs[1];
+        if (l.var=="" || strspn(l.var.c_str(),
+            "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_")
+            != l.var.size()) throw Err() << "bad variable name: " << l.var;
+        for (auto const & l0: loops)
+          if (l0.var == l.var) throw Err() << "duplicated variable: " << l.var;
+        if (c == "loop"){
+          double from = str_to_type<double>(vs[2]);
+          double to   = str_to_type<double>(vs[3]);
+          double step = str_to_type<double>(vs[4]);
+          if (step==0 || (to-from)/step < 0) throw Err()
+            << "bad loop range: " << vs[2] << " " << vs[3] << " " << vs[4];
+          double n = floor((to-from)/step + 1e-9) + 1;
+          if (n > SEQ_MAX_POINTS) throw Err() << "too many points";
+          for (size_t i=0; i<n; i++){
+            std::ostringstream s;
+            s << std::setprecision(10) << from + i*step;
+            l.vals.push_back(s.str());
+          }
+        }
+        else {
+          l.vals.assign(vs.begin()+2, vs.end());
+        }
+        total *= l.vals.size();
+        if (total > SEQ_MAX_POINTS) throw Err() << "too many points";
+        loops.push_back(l);
+        continue;
+      }
+
+      if (c == "period"){
+        if (vs.size()!=2) throw Err() << "expected: period <time>";
+        period = str_to_type<double>(vs[1]);
+        if (period<0) throw Err() << "negative period";
+        continue;
+      }
+
+      Step s;
+      s.t = 0;
+      if (c == "set" || c == "read"){
+        if (vs.size()!=3) throw Err()
+          << "expected: " << c << " <device> <command>";
+        s.type = (c == "set")? Step::SET : Step::READ;
+        s.dev = vs[1];
+        s.cmd = vs[2];
+        if (s.dev=="" || s.dev.find('/')!=std::string::npos)
+          throw Err() << "bad device name: " << s.dev;
+      }
+      else if (c == "wait"){
+        if (vs.size()!=2) throw Err() << "expected: wait <time>";
+        s.type = Step::WAIT;
+        s.t = str_to_type<double>(vs[1]);
+        if (s.t<0) throw Err() << "negative wait time";
+      }
+      else throw Err() << "unknown command: " << c;
+      steps.push_back(s);
+    }
+  }
+  catch (Err & e){
+    throw Err() << "sequence line " << line_num[0] << ": " << e.str();
+  }
+  if (steps.empty()) throw Err() << "empty sequence";
+
+  // table header
+  out = "# time";
+  for (auto const & l: loops) out += "\t" + l.var;
+  for (auto const & s: steps)
+    if (s.type == Step::READ) out += "\t" + s.dev + ":" + s.cmd;
+  out += "\n";
+
+  t0 = std::chrono::steady_clock::now();
+  thr = std::thread(&Sequence::run, this);
+}
+
+Sequence::~Sequence(){
+  stop();
+  if (thr.joinable()) thr.join();
+}
+
+void
+Sequence::stop(){
+  {
+    std::lock_guard<std::mutex> lk(m);
+    stop_ = true;
+  }
+  cv.notify_all();
+}
+
+bool
+Sequence::running(){
+  std::lock_guard<std::mutex> lk(m);
+  return state == RUNNING;
+}
+
+std::string
+Sequence::get(){
+  std::lock_guard<std::mutex> lk(m);
+  std::string ret;
+  ret.swap(out);
+  return ret;
+}
+
+std::string
+Sequence::status(){
+  std::lock_guard<std::mutex> lk(m);
+  std::ostringstream s;
+  switch (state){
+    case RUNNING:   s << "running";   break;
+    case FINISHED:  s << "finished";  break;
+    case CANCELLED: s << "cancelled"; break;
+    case FAILED:    s << "failed";    break;
+  }
+  auto t = (state==RUNNING? std::chrono::steady_clock::now() : t1) - t0;
+  s << " " << done << "/" << total << " " << std::fixed << std::setprecision(3)
+    << std::chrono::duration<double>(t).count();
+  if (state == FAILED) s << ": " << err;
+  s << "\n";
+  return s.str();
+}
+
+/*************************************************/
+std::string
+Sequence::subst(const std::string & cmd, const std::vector<size_t> & idx) const {
+  std::string ret;
+  for (size_t i=0; i<cmd.size(); i++){
+    if (cmd[i]!='$' || i+1==cmd.size()) { ret += cmd[i]; continue; }
+    size_t p1 = i+1, p2;
+    bool br = cmd[p1]=='{';
+    if (br){
+      p1++;
+      p2 = cmd.find('}', p1);
+      if (p2 == std::string::npos) { ret += cmd[i]; continue; }
+    }
+    else {
+      p2 = p1;
+      while (p2<cmd.size() && (isalnum(cmd[p2]) || cmd[p2]=='_')) p2++;
+    }
+    auto var = cmd.substr(p1, p2-p1);
+    size_t j;
+    for (j=0; j<loops.size(); j++) if (loops[j].var == var) break;
+    if (j==loops.size()) { ret += cmd[i]; continue; }
+    ret += loops[j].vals[idx[j]];
+    i = br? p2 : p2-1;
+  }
+  return ret;
+}
+
+bool
+Sequence::wait_until(const std::chrono::steady_clock::time_point & t){
+  std::unique_lock<std::mutex> lk(m);
+  return !cv.wait_until(lk, t, [this](){ return stop_; });
+}
+
+void
+Sequence::run(){
+  auto alive = [this](){
+    std::lock_guard<std::mutex> lk(m);
+    return !stop_;
+  };
+  std::vector<size_t> idx(loops.size(), 0);
+  auto st = FINISHED;
+  std::string e1;
+  for (size_t p=0; p<total; p++){
+    auto tp = t0 + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(p*period));
+    if (!wait_until(period>0 ? tp : std::chrono::steady_clock::now())) {
+      st = CANCELLED;
+      break;
+    }
+
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(6) << std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - t0).count();
+    for (size_t i=0; i<loops.size(); i++)
+      line << "\t" << loops[i].vals[idx[i]];
+
+    try {
+      for (auto const & s: steps){
+        if (!alive()) break;
+        if (s.type == Step::WAIT){
+          wait_until(std::chrono::steady_clock::now() +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::duration<double>(s.t)));
+          continue;
+        }
+        auto ans = ask(s.dev, subst(s.cmd, idx), alive);
+        if (s.type != Step::READ) continue;
+        for (auto & c: ans) if (c=='\n' || c=='\t' || c=='\r') c = ' ';
+        line << "\t" << ans;
+      }
+    }
+    catch (Err & e){
+      if (!alive()) { st = CANCELLED; break; }
+      st = FAILED;
+      e1 = e.str();
+      break;
+    }
+    if (!alive()) { st = CANCELLED; break; }
+
+    {
+      std::lock_guard<std::mutex> lk(m);
+      out += line.str() + "\n";
+      done++;
+    }
+
+    // next point
+    for (size_t i=loops.size(); i>0; i--){
+      if (++idx[i-1] < loops[i-1].vals.size()) break;
+      idx[i-1] = 0;
+    }
+  }
+
+  std::lock_guard<std::mutex> lk(m);
+  state = st;
+  err = e1;
+  t1 = std::chrono::steady_clock::now();
+}
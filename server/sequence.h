@@ -0,0 +1,104 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+
+/*************************************************/
+/*
+Sequence of device commands (e.g. a sweep) running in the server.
+
+Description contains one command per line. Words can be quoted as in
+the device list file, `$<var>` or `${<var>}` in device commands is
+replaced by the current value of a loop variable.
+
+* `loop <var> <from> <to> <step>` -- Loop over values from..to (inclusive).
+* `list <var> <v1> <v2> ...`     -- Loop over a list of values.
+* `period <t>`   -- Time between starts of points, seconds (default: 0,
+                    start next point after the previous one).
+* `set <device> <command>`  -- Send command to the device, ignore the answer.
+* `read <device> <command>` -- Send command to the device, write the answer
+                    in the table.
+* `wait <t>`     -- Wait t seconds.
+
+Loops are nested in the order of appearance (the first one is the outer
+loop), other commands are done for every point. The result is a table
+with one line per point: time from the start of the sequence (seconds),
+values of loop variables, answers of `read` commands (new lines and
+tabs replaced by spaces). Columns are separated by tabs, the first line
+is a header, starting with `#`.
+*/
+
+class Sequence {
+public:
+  // Function for sending a command to a device. The request
+  // should be cancelled if the `alive` function returns false.
+  typedef std::function<std::string(const std::string & dev,
+    const std::string & cmd, const std::function<bool()> & alive)> ask_t;
+
+private:
+  struct Loop {
+    std::string var;
+    std::vector<std::string> vals;
+  };
+  struct Step {
+    enum {SET, READ, WAIT} type;
+    std::string dev, cmd;
+    double t;
+  };
+  std::vector<Loop> loops;
+  std::vector<Step> steps;
+  double period;
+  size_t total; // number of points
+
+  ask_t ask;
+
+  enum {RUNNING, FINISHED, CANCELLED, FAILED} state;
+  size_t done;     // number of finished points
+  std::string out; // table lines, not read yet
+  std::string err; // error message
+  std::chrono::steady_clock::time_point t0, t1; // start and end time
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread thr;
+  bool stop_;
+
+  // Replace $<var> and ${<var>} by values.
+  std::string subst(const std::string & cmd,
+                    const std::vector<size_t> & idx) const;
+
+  // Wait until time t, return false if the sequence is stopped.
+  bool wait_until(const std::chrono::steady_clock::time_point & t);
+
+  void run();
+
+public:
+
+  // Parse description, start the sequence.
+  // Throw Err if the description is wrong.
+  Sequence(const std::string & descr, const ask_t & ask);
+
+  // Stop the sequence, wait until the current command is finished.
+  ~Sequence();
+
+  // Stop the sequence (does not wait).
+  void stop();
+
+  // Is the sequence still running?
+  bool running();
+
+  // Get table lines added after the previous call.
+  std::string get();
+
+  // Status: running (with number of done points), finished,
+  // cancelled, or failed (with error message); time from the start.
+  std::string status();
+};
+
+#endif
@@ -0,0 +1,85 @@
+///\cond HIDDEN (do not show this in Doxyden)
+
+#include "sequence.h"
+#include "err/assert_err.h"
+#include <unistd.h>
+#include <vector>
+#include <string>
+
+using namespace std;
+
+int
+main(){
+  try{
+
+    std::mutex m;
+    std::vector<std::string> log;
+    auto ask = [&m, &log](const std::string & dev, const std::string & cmd,
+                          const std::function<bool()> &){
+      std::lock_guard<std::mutex> lk(m);
+      log.push_back(dev + ":" + cmd);
+      if (cmd == "err") throw Err() << "device error";
+      return cmd + "\nx";
+    };
+
+    // wrong descriptions
+    assert_err(Sequence("", ask), "empty sequence");
+    assert_err(Sequence("loop f 1 2", ask),
+      "sequence line 1: expected: loop <var> <from> <to> <step>");
+    assert_err(Sequence("loop f 1 2 -1", ask),
+      "sequence line 1: bad loop range: 1 2 -1");
+    assert_err(Sequence("list a 1\nlist a 2", ask),
+      "sequence line 2: duplicated variable: a");
+    assert_err(Sequence("set a/b c", ask),
+      "sequence line 1: bad device name: a/b");
+    assert_err(Sequence("xxx", ask),
+      "sequence line 1: unknown command: xxx");
+    assert_err(Sequence("loop a 1 1000 1\nloop b 1 1001 1\nset d c", ask),
+      "sequence line 2: too many points");
+
+    // nested loops, substitution, table
+    {
+      Sequence s("loop f 1 1.2 0.1 # frequency\n"
+                 "list g a b\n"
+                 "set gen \"FREQ $f ${g}x $h\"\n"
+                 "wait 0.01\n"
+                 "read lockin X?\n", ask);
+      while (s.running()) usleep(10000);
+      assert_eq(s.status().substr(0,13), "finished 6/6 ");
+      auto t = s.get();
+      assert_eq(s.get(), "");
+      assert_eq(t.substr(0, t.find('\n')), "# time\tf\tg\tlockin:X?");
+      assert_eq(t.find("\t1.1\tb\tX? x\n") != std::string::npos, true);
+      assert_eq(log.size(), 12);
+      assert_eq(log[0], "gen:FREQ 1 ax $h");
+      assert_eq(log[2], "gen:FREQ 1 bx $h");
+      assert_eq(log[10], "gen:FREQ 1.2 bx $h");
+    }
+
+    // errors
+    {
+      Sequence s("list a 1 2 3\nread d $a\nread d err", ask);
+      while (s.running()) usleep(10000);
+      assert_eq(s.status().substr(0,10), "failed 0/3");
+      assert_eq(s.status().find(": device error\n") != std::string::npos, true);
+    }
+
+    // period, stop
+    {
+      Sequence s("loop i 1 100 1\nperiod 0.05\nread d $i", ask);
+      usleep(120000);
+      assert_eq(s.running(), true);
+      s.stop();
+      usleep(10000);
+      assert_eq(s.status().substr(0,13), "cancelled 3/1");
+    }
+
+  }
+  catch (Err e) {
+    std::cerr << "Error: " << e.str() << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+///\endcond
@@ -0,0 +1,863 @@
+#include "sim.h"
+#include "err/err.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cmath>
+#include <sstream>
+
+// poll period, ms (also a pause which ends messages if -eol is empty)
+#define SIM_POLL_MS 20
+
+// write all data to fd
+static bool
+write_all(int fd, const std::string & s){
+  size_t n = 0;
+  while (n < s.size()){
+    auto res = ::write(fd, s.data()+n, s.size()-n);
+    if (res<0 && errno==EINTR) continue;
+    if (res<0) return false;
+    n += res;
+  }
+  return true;
+}
+
+/*************************************************/
+SimInstr::SimInstr(const Opt & opts): stop(false) {
+  opts.check_unknown({"eol", "delay", "answer_size", "answer_cond",
+    "add_str", "nack_pref", "nack_str", "prologix", "overlap"});
+  eol         = opts.get("eol", "\n");
+  delay       = opts.get("delay", 0.0);
+  answer_size = opts.get<size_t>("answer_size", 0);
+  answer_cond = str_to_read_cond(opts.get("answer_cond", "always"));
+  add         = opts.get("add_str", "\n");
+  nack_pref   = opts.get("nack_pref", "ERR");
+  nack        = opts.get("nack_str", "");
+  prologix    = opts.get("prologix", false);
+  overlap     = opts.get("overlap", true);
+}
+
+void
+SimInstr::finish(){
+  stop = true;
+  if (thr.joinable()) thr.join();
+}
+
+bool
+SimInstr::answer(const std::string & msg, std::string & ans){
+
+  // Prologix commands
+  if (prologix && msg.substr(0,6) == "++addr"){
+    if (msg.size()>7) {gpib_addr = msg.substr(7); return false;}
+    ans = gpib_addr + add;
+    return true;
+  }
+
+  if (!check_read_cond(msg, answer_cond)) return false;
+
+  if (answer_size>0){
+    ans.resize(answer_size);
+    for (size_t i=0; i<answer_size; i++) ans[i] = '0' + i%10;
+  }
+  else {
+    ans = msg;
+  }
+
+  if (nack_pref.size() && msg.compare(0, nack_pref.size(), nack_pref)==0)
+    ans += nack;
+  else
+    ans += add;
+  return true;
+}
+
+bool
+SimInstr::process(int fd, const std::string & data){
+  auto & buf = bufs[fd];
+  std::vector<std::string> msgs;
+
+  // no message terminator: data is flushed by timeout (empty data)
+  if (eol.size()==0){
+    if (data.size()) { buf += data; return true; }
+    if (buf.size()) msgs.push_back(buf);
+    buf.clear();
+  }
+  else {
+    buf += data;
+    size_t p;
+    while ((p = buf.find(eol)) != std::string::npos){
+      msgs.push_back(buf.substr(0,p));
+      buf.erase(0, p+eol.size());
+    }
+  }
+
+  for (auto const & m: msgs){
+    std::string ans;
+    if (!answer(m, ans)) continue;
+    if (delay>0) usleep(delay*1e6);
+    if (!write_all(fd, ans)) return false;
+  }
+  return true;
+}
+
+/*************************************************/
+// open pseudo-terminal: master and slave file descriptors, slave name
+static void
+open_pty(int & mfd, int & sfd, std::string & sname, const std::string & errpref){
+  mfd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (mfd<0) throw Err() << errpref << "can't open pty: " << strerror(errno);
+  if (grantpt(mfd)<0 || unlockpt(mfd)<0 || ptsname(mfd)==NULL){
+    ::close(mfd);
+    throw Err() << errpref << "can't set up pty: " << strerror(errno);
+  }
+  sname = ptsname(mfd);
+
+  // Keep slave side open: otherwise master gets EIO
+  // when driver closes the device.
+  sfd = ::open(sname.c_str(), O_RDWR | O_NOCTTY);
+  if (sfd<0){
+    ::close(mfd);
+    throw Err() << errpref << "can't open " << sname << ": " << strerror(errno);
+  }
+
+  // start in raw mode, drivers can modify settings
+  struct termios t;
+  tcgetattr(sfd, &t);
+  cfmakeraw(&t);
+  tcsetattr(sfd, TCSANOW, &t);
+}
+
+// listen on a free port on localhost, return socket and port
+static int
+listen_local(int & port, const std::string & errpref){
+  int lfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (lfd<0) throw Err() << errpref << "can't create socket: " << strerror(errno);
+
+  int one = 1;
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0; // any free port
+  socklen_t n = sizeof(addr);
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr))<0 ||
+      listen(lfd, 16)<0 ||
+      getsockname(lfd, (struct sockaddr *)&addr, &n)<0){
+    ::close(lfd);
+    throw Err() << errpref << "can't listen: " << strerror(errno);
+  }
+  port = ntohs(addr.sin_port);
+  return lfd;
+}
+
+/*************************************************/
+SimSerial::SimSerial(const Opt & opts): SimInstr(opts) {
+  open_pty(mfd, sfd, sname, "SimSerial: ");
+  thr = std::thread(&SimSerial::run, this);
+}
+
+SimSerial::~SimSerial(){
+  finish();
+  ::close(sfd);
+  ::close(mfd);
+}
+
+void
+SimSerial::run(){
+  char buf[4096];
+  while (!stop){
+    struct pollfd pfd = {mfd, POLLIN, 0};
+    int res = poll(&pfd, 1, SIM_POLL_MS);
+    if (res<0 && errno!=EINTR) break;
+    if (res<=0) { process(mfd, ""); continue; }
+    auto n = ::read(mfd, buf, sizeof(buf));
+    if (n<=0) { usleep(SIM_POLL_MS*1000); continue; }
+    if (!process(mfd, std::string(buf, buf+n))) break;
+  }
+}
+
+/*************************************************/
+SimNet::SimNet(const Opt & opts): SimInstr(opts), drop(false) {
+
+  lfd = listen_local(port_, "SimNet: ");
+  thr = std::thread(&SimNet::run, this);
+}
+
+SimNet::~SimNet(){
+  finish();
+  for (auto const & b: bufs) ::close(b.first);
+  ::close(lfd);
+}
+
+void
+SimNet::run(){
+  char buf[65536];
+  while (!stop){
+    if (drop){
+      for (auto const & b: bufs) ::close(b.first);
+      bufs.clear();
+      drop = false;
+    }
+    std::vector<struct pollfd> pfds;
+    pfds.push_back({lfd, POLLIN, 0});
+    for (auto const & b: bufs) pfds.push_back({b.first, POLLIN, 0});
+
+    int res = poll(pfds.data(), pfds.size(), SIM_POLL_MS);
+    if (res<0 && errno!=EINTR) break;
+    if (res<=0){
+      for (auto & p: pfds)
+        if (p.fd!=lfd) process(p.fd, "");
+      continue;
+    }
+
+    // new connection
+    if (pfds[0].revents & POLLIN){
+      int fd = accept(lfd, NULL, NULL);
+      if (fd>=0) bufs[fd] = std::string();
+    }
+
+    // data from clients
+    for (size_t i=1; i<pfds.size(); i++){
+      if (!pfds[i].revents) continue;
+      int fd = pfds[i].fd;
+      auto n = ::read(fd, buf, sizeof(buf));
+      if (n<=0 || !process(fd, std::string(buf, buf+n))){
+        ::close(fd);
+        bufs.erase(fd);
+      }
+    }
+  }
+}
+
+/*************************************************/
+typedef Driver_hislip H;
+
+// current time, s
+static double
+sim_time(){
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+SimHiSLIP::SimHiSLIP(const Opt & opts): SimInstr(opts),
+    next_session(1), stb(0) {
+
+  lfd = listen_local(port_, "SimHiSLIP: ");
+  thr = std::thread(&SimHiSLIP::run, this);
+}
+
+SimHiSLIP::~SimHiSLIP(){
+  finish();
+  for (auto const & b: bufs) ::close(b.first);
+  ::close(lfd);
+}
+
+void
+SimHiSLIP::close_fd(int fd){
+  ::close(fd);
+  bufs.erase(fd);
+  msgs.erase(fd);
+  fd_sessions.erase(fd);
+  for (auto i = out.begin(); i!=out.end();)
+    if (i->second.first == fd) i = out.erase(i); else ++i;
+}
+
+bool
+SimHiSLIP::process_msg(int fd, const H::Msg & m){
+  switch (m.type){
+
+    case H::Initialize: {
+      int s = next_session++;
+      sessions[s] = std::make_pair(fd, -1);
+      fd_sessions[fd] = s;
+      return write_all(fd, H::encode(H::Msg(H::InitializeResponse,
+        overlap? 1:0, (0x0100<<16) | s)));
+    }
+
+    case H::AsyncInitialize: {
+      int s = m.par & 0xffff;
+      if (sessions.count(s)==0) return false;
+      sessions[s].second = fd;
+      fd_sessions[fd] = s;
+      return write_all(fd, H::encode(H::Msg(H::AsyncInitializeResponse,
+        0, 0x4453)));
+    }
+
+    case H::AsyncMaximumMessageSize:
+      return write_all(fd, H::encode(H::Msg(H::AsyncMaximumMessageSizeResponse,
+        0, 0, H::encode_u64(1<<20))));
+
+    case H::AsyncStatusQuery: {
+      uint8_t s = stb;
+      stb = 0;
+      return write_all(fd, H::encode(H::Msg(H::AsyncStatusResponse, s)));
+    }
+
+    case H::AsyncDeviceClear:
+      // drop scheduled answers of the session
+      if (fd_sessions.count(fd)){
+        int sfd = sessions[fd_sessions[fd]].first;
+        for (auto i = out.begin(); i!=out.end();)
+          if (i->second.first == sfd) i = out.erase(i); else ++i;
+        msgs.erase(sfd);
+      }
+      return write_all(fd, H::encode(H::Msg(H::AsyncDeviceClearAcknowledge,
+        overlap? 1:0)));
+
+    // mode requested by the client, if it is supported
+    case H::DeviceClearComplete:
+      return write_all(fd, H::encode(H::Msg(H::DeviceClearAcknowledge,
+        m.ctl & (overlap? 1:0))));
+
+    case H::Data:
+      msgs[fd] += m.data;
+      return true;
+
+    case H::DataEnd: {
+      std::string msg = msgs[fd] + m.data;
+      msgs.erase(fd);
+      if (eol.size() && msg.size()>=eol.size() &&
+          msg.compare(msg.size()-eol.size(), eol.size(), eol)==0)
+        msg.resize(msg.size()-eol.size());
+
+      // service request
+      if (msg == "SRQ"){
+        stb = 0x40;
+        int s = fd_sessions.count(fd)? fd_sessions[fd] : -1;
+        if (s>0 && sessions[s].second>=0)
+          return write_all(sessions[s].second,
+            H::encode(H::Msg(H::AsyncServiceRequest, stb)));
+        return true;
+      }
+
+      std::string ans;
+      if (!answer(msg, ans)) return true;
+      out.insert(std::make_pair(sim_time() + delay,
+        std::make_pair(fd, H::encode(H::Msg(H::DataEnd, 0, m.par, ans)))));
+      return true;
+    }
+  }
+  // unknown message
+  write_all(fd, H::encode(H::Msg(H::Error, 0, 0, "unknown message type")));
+  return true;
+}
+
+void
+SimHiSLIP::run(){
+  char buf[65536];
+  while (!stop){
+
+    // send scheduled answers
+    double now = sim_time();
+    while (out.size() && out.begin()->first <= now){
+      write_all(out.begin()->second.first, out.begin()->second.second);
+      out.erase(out.begin());
+    }
+    int ms = SIM_POLL_MS;
+    if (out.size())
+      ms = std::min(ms, int((out.begin()->first - now)*1000)+1);
+
+    std::vector<struct pollfd> pfds;
+    pfds.push_back({lfd, POLLIN, 0});
+    for (auto const & b: bufs) pfds.push_back({b.first, POLLIN, 0});
+
+    int res = poll(pfds.data(), pfds.size(), ms);
+    if (res<0 && errno!=EINTR) break;
+    if (res<=0) continue;
+
+    // new connection
+    if (pfds[0].revents & POLLIN){
+      int fd = accept(lfd, NULL, NULL);
+      if (fd>=0) bufs[fd] = std::string();
+    }
+
+    // data from clients
+    for (size_t i=1; i<pfds.size(); i++){
+      if (!pfds[i].revents) continue;
+      int fd = pfds[i].fd;
+      auto n = ::read(fd, buf, sizeof(buf));
+      bool ok = n>0;
+      if (ok) {
+        bufs[fd].append(buf, n);
+        H::Msg m;
+        try {
+          while (ok && H::decode(bufs[fd], m)) ok = process_msg(fd, m);
+        }
+        catch (Err & e) { ok = false; }
+      }
+      if (!ok) close_fd(fd);
+    }
+  }
+}
+
+/*************************************************/
+/*************************************************/
+typedef Driver_vxi11 V;
+
+#define VXI11_MAX_RECV 1024
+
+SimVXI11::SimVXI11(const Opt & opts): SimInstr(opts), next_link(1) {
+
+  lfd = listen_local(port_, "SimVXI11: ");
+  thr = std::thread(&SimVXI11::run, this);
+}
+
+SimVXI11::~SimVXI11(){
+  finish();
+  for (auto const & b: bufs) ::close(b.first);
+  ::close(lfd);
+}
+
+std::string
+SimVXI11::process_call(const std::string & call){
+  XdrIn c(call);
+  uint32_t xid = c.u32();
+  if (c.u32() != 0) throw Err() << "call expected";
+  c.u32(); // rpc version
+  uint32_t prog = c.u32(), vers = c.u32(), proc = c.u32();
+  c.u32(); c.opaque(); // credentials
+  c.u32(); c.opaque(); // verifier
+
+  XdrOut r;
+  r.u32(xid).u32(1).u32(0).u32(0).u32(0); // accepted reply, AUTH_NONE
+
+  // portmapper: GETPORT, return our port
+  if (prog == 100000 && proc == 3){
+    r.u32(0).u32(c.u32() == V::PROG? port_ : 0);
+    return r.str();
+  }
+  if (prog != V::PROG || vers != V::VERS) return r.u32(1).str(); // PROG_UNAVAIL
+  r.u32(0);
+
+  switch (proc){
+
+    case V::CREATE_LINK: {
+      uint32_t lid = next_link++;
+      links[lid];
+      return r.u32(0).u32(lid).u32(0).u32(VXI11_MAX_RECV).str();
+    }
+
+    case V::DESTROY_LINK:
+      links.erase(c.u32());
+      return r.u32(0).str();
+
+    case V::DEVICE_WRITE: {
+      uint32_t lid = c.u32();
+      c.u32(); c.u32(); // timeouts
+      uint32_t flags = c.u32();
+      std::string data = c.opaque();
+      if (!links.count(lid)) return r.u32(4).u32(0).str();
+      if (data.size() > VXI11_MAX_RECV) return r.u32(5).u32(0).str();
+      auto & l = links[lid];
+      // new message discards unread answer (as in IEEE-488.2 devices)
+      if (l.first.empty()) l.second.clear();
+      l.first += data;
+      if (flags & V::FLAG_END){
+        std::string msg = l.first;
+        l.first.clear();
+        if (eol.size() && msg.size()>=eol.size() &&
+            msg.compare(msg.size()-eol.size(), eol.size(), eol)==0)
+          msg.resize(msg.size()-eol.size());
+        std::string ans;
+        if (answer(msg, ans)){
+          if (delay>0) usleep(delay*1e6);
+          l.second += ans;
+        }
+      }
+      return r.u32(0).u32(data.size()).str();
+    }
+
+    case V::DEVICE_READ: {
+      uint32_t lid = c.u32();
+      uint32_t size = c.u32();
+      if (!links.count(lid)) return r.u32(4).u32(0).opaque("").str();
+      auto & out = links[lid].second;
+      if (out.empty()) return r.u32(15).u32(0).opaque("").str();
+      std::string data = out.substr(0, size);
+      out.erase(0, size);
+      return r.u32(0).u32(out.empty()? V::REASON_END : V::REASON_REQCNT)
+              .opaque(data).str();
+    }
+
+    case V::DEVICE_READSTB: {
+      uint32_t lid = c.u32();
+      if (!links.count(lid)) return r.u32(4).u32(0).str();
+      return r.u32(0).u32(links[lid].second.size()? 0x10 : 0).str();
+    }
+
+    case V::DEVICE_CLEAR: {
+      uint32_t lid = c.u32();
+      if (!links.count(lid)) return r.u32(4).str();
+      links[lid].first.clear();
+      links[lid].second.clear();
+      return r.u32(0).str();
+    }
+  }
+  return r.u32(8).str(); // operation not supported
+}
+
+void
+SimVXI11::run(){
+  char buf[65536];
+  while (!stop){
+    std::vector<struct pollfd> pfds;
+    pfds.push_back({lfd, POLLIN, 0});
+    for (auto const & b: bufs) pfds.push_back({b.first, POLLIN, 0});
+
+    int res = poll(pfds.data(), pfds.size(), SIM_POLL_MS);
+    if (res<0 && errno!=EINTR) break;
+    if (res<=0) continue;
+
+    // new connection
+    if (pfds[0].revents & POLLIN){
+      int fd = accept(lfd, NULL, NULL);
+      if (fd>=0) bufs[fd] = std::string();
+    }
+
+    // data from clients: RPC records (record marking)
+    for (size_t i=1; i<pfds.size(); i++){
+      if (!pfds[i].revents) continue;
+      int fd = pfds[i].fd;
+      auto n = ::read(fd, buf, sizeof(buf));
+      bool ok = n>0;
+      if (ok) {
+        auto & b = bufs[fd];
+        b.append(buf, n);
+        try {
+          while (ok) {
+            // find the last fragment of a record
+            size_t p = 0;
+            std::string rec;
+            bool last = false;
+            while (!last && p+4 <= b.size()){
+              uint32_t h = XdrIn(b.substr(p,4)).u32();
+              size_t len = h & 0x7fffffff;
+              if (p+4+len > b.size()) break;
+              rec += b.substr(p+4, len);
+              p += 4+len;
+              last = h & 0x80000000;
+            }
+            if (!last) break;
+            b.erase(0, p);
+            std::string rep = process_call(rec);
+            ok = write_all(fd, XdrOut().u32(0x80000000 | rep.size()).str() + rep);
+          }
+        }
+        catch (Err & e) { ok = false; }
+      }
+      if (!ok) {
+        ::close(fd);
+        bufs.erase(fd);
+      }
+    }
+  }
+}
+
+/*************************************************/
+/*************************************************/
+typedef Modbus M;
+
+std::string
+SimModbus::process_pdu(const std::string & pdu){
+  ntrans++;
+  if (delay>0) usleep(delay*1e6);
+
+  uint8_t fn = pdu[0];
+  std::string exc{(char)(fn|0x80), 0};
+  size_t size = regs.size();
+  if (M::pdu_size(pdu, true)<0) { exc[1] = 1; return exc; }
+  uint16_t addr = M::get_u16(pdu, 1);
+  uint16_t num  = M::get_u16(pdu, 3);
+
+  switch (fn){
+    case M::READ_COILS: case M::READ_DISCRETE: {
+      if (num<1 || num>2000) { exc[1] = 3; return exc; }
+      if (addr+num > size)   { exc[1] = 2; return exc; }
+      std::string b((num+7)/8, '\0');
+      for (int i=0; i<num; i++)
+        if (fn==M::READ_COILS ? coils[addr+i] : (addr+i)%2) b[i/8] |= 1<<(i%8);
+      return std::string{(char)fn, (char)b.size()} + b;
+    }
+    case M::READ_HOLDING: case M::READ_INPUT: {
+      if (num<1 || num>125) { exc[1] = 3; return exc; }
+      if (addr+num > size)  { exc[1] = 2; return exc; }
+      std::string ret{(char)fn, (char)(2*num)};
+      for (int i=0; i<num; i++)
+        ret += M::u16(fn==M::READ_HOLDING ? regs[addr+i] : addr+i);
+      return ret;
+    }
+    case M::WRITE_COIL:
+      if (addr >= size) { exc[1] = 2; return exc; }
+      if (num!=0 && num!=0xFF00) { exc[1] = 3; return exc; }
+      coils[addr] = num!=0;
+      return pdu;
+    case M::WRITE_REGISTER:
+      if (addr >= size) { exc[1] = 2; return exc; }
+      regs[addr] = num;
+      return pdu;
+    case M::WRITE_COILS:
+      if (addr+num > size) { exc[1] = 2; return exc; }
+      for (int i=0; i<num; i++) coils[addr+i] = (pdu[6+i/8]>>(i%8)) & 1;
+      return pdu.substr(0,5);
+    case M::WRITE_REGISTERS:
+      if (addr+num > size) { exc[1] = 2; return exc; }
+      for (int i=0; i<num; i++) regs[addr+i] = M::get_u16(pdu, 6+2*i);
+      return pdu.substr(0,5);
+  }
+  exc[1] = 1;
+  return exc;
+}
+
+/*************************************************/
+SimModbusTCP::SimModbusTCP(const Opt & opts): SimModbus(opts) {
+  lfd = listen_local(port_, "SimModbusTCP: ");
+  thr = std::thread(&SimModbusTCP::run, this);
+}
+
+SimModbusTCP::~SimModbusTCP(){
+  finish();
+  for (auto const & b: bufs) ::close(b.first);
+  ::close(lfd);
+}
+
+void
+SimModbusTCP::run(){
+  char buf[4096];
+  while (!stop){
+    std::vector<struct pollfd> pfds;
+    pfds.push_back({lfd, POLLIN, 0});
+    for (auto const & b: bufs) pfds.push_back({b.first, POLLIN, 0});
+
+    int res = poll(pfds.data(), pfds.size(), SIM_POLL_MS);
+    if (res<0 && errno!=EINTR) break;
+    if (res<=0) continue;
+
+    // new connection
+    if (pfds[0].revents & POLLIN){
+      int fd = accept(lfd, NULL, NULL);
+      if (fd>=0) bufs[fd] = std::string();
+    }
+
+    // data from clients: MBAP header + PDU
+    for (size_t i=1; i<pfds.size(); i++){
+      if (!pfds[i].revents) continue;
+      int fd = pfds[i].fd;
+      auto n = ::read(fd, buf, sizeof(buf));
+      bool ok = n>0;
+      if (ok) {
+        auto & b = bufs[fd];
+        b.append(buf, n);
+        try {
+          while (ok && b.size()>=7){
+            size_t len = M::get_u16(b, 4);
+            if (len<2) {ok = false; break;}
+            if (b.size() < 6+len) break;
+            std::string pdu = b.substr(7, len-1);
+            std::string ans = process_pdu(pdu);
+            ok = write_all(fd, b.substr(0,4) + M::u16(ans.size()+1) + b[6] + ans);
+            b.erase(0, 6+len);
+          }
+        }
+        catch (Err & e) { ok = false; }
+      }
+      if (!ok) {
+        ::close(fd);
+        bufs.erase(fd);
+      }
+    }
+  }
+}
+
+/*************************************************/
+SimModbusRTU::SimModbusRTU(const Opt & opts): SimModbus(opts) {
+  open_pty(mfd, sfd, sname, "SimModbusRTU: ");
+  thr = std::thread(&SimModbusRTU::run, this);
+}
+
+SimModbusRTU::~SimModbusRTU(){
+  finish();
+  ::close(sfd);
+  ::close(mfd);
+}
+
+void
+SimModbusRTU::run(){
+  char buf[4096];
+  std::string b;
+  while (!stop){
+    struct pollfd pfd = {mfd, POLLIN, 0};
+    int res = poll(&pfd, 1, SIM_POLL_MS);
+    if (res<0 && errno!=EINTR) break;
+    // pause: drop incomplete frame
+    if (res<=0) { b.clear(); continue; }
+    auto n = ::read(mfd, buf, sizeof(buf));
+    if (n<=0) { usleep(SIM_POLL_MS*1000); continue; }
+    b.append(buf, n);
+
+    while (b.size()>1){
+      int size = M::pdu_size(b.substr(1), true);
+      if (size<0) { b.clear(); break; }
+      if (size==0 || (int)b.size() < size+3) break;
+      std::string frame = b.substr(0, size+1);
+      uint16_t crc = M::crc16(frame);
+      bool crc_ok = (uint8_t)b[size+1] == (crc & 0xff) &&
+                    (uint8_t)b[size+2] == (crc >> 8);
+      b.erase(0, size+3);
+      if (!crc_ok) continue;
+      uint8_t unit = frame[0];
+      if (unit!=0 && unit!=1) continue;
+      std::string ans = process_pdu(frame.substr(1));
+      if (unit==0) continue; // broadcast
+      ans = frame.substr(0,1) + ans;
+      crc = M::crc16(ans);
+      ans += (char)(crc & 0xff);
+      ans += (char)(crc >> 8);
+      write_all(mfd, ans);
+    }
+  }
+}
+
+/*************************************************/
+SimServer::SimServer(const std::string & devfile):
+    dm(devfile), stop(false), conn(0) {
+  lfd = listen_local(port_, "SimServer: ");
+  thr = std::thread(&SimServer::run, this);
+}
+
+SimServer::~SimServer(){
+  stop = true;
+  if (thr.joinable()) thr.join();
+  disconnect();
+  std::map<int, std::thread> cl;
+  {
+    std::lock_guard<std::mutex> lk(m);
+    cl.swap(clients);
+  }
+  for (auto & c: cl) c.second.join();
+  for (auto fd: closed) ::close(fd);
+  ::close(lfd);
+}
+
+void
+SimServer::disconnect(){
+  std::lock_guard<std::mutex> lk(m);
+  for (auto const & c: clients) shutdown(c.first, SHUT_RDWR);
+}
+
+void
+SimServer::run(){
+  while (!stop){
+    struct pollfd pfd = {lfd, POLLIN, 0};
+    if (poll(&pfd, 1, SIM_POLL_MS) <= 0) continue;
+    int fd = accept(lfd, NULL, NULL);
+    if (fd<0) continue;
+    std::lock_guard<std::mutex> lk(m);
+    // join finished threads
+    for (auto c: closed){
+      clients[c].join();
+      clients.erase(c);
+      ::close(c);
+    }
+    closed.clear();
+    clients[fd] = std::thread(&SimServer::serve, this, fd, conn++);
+  }
+}
+
+// decode %XX sequences
+static std::string
+url_unescape(const std::string & s){
+  std::string ret;
+  for (size_t i=0; i<s.size(); i++){
+    if (s[i]=='%' && i+2<s.size()){
+      ret += (char)strtol(s.substr(i+1,2).c_str(), NULL, 16);
+      i+=2;
+    }
+    else ret += s[i];
+  }
+  return ret;
+}
+
+void
+SimServer::serve(const int fd, const uint64_t c){
+  dm.conn_open(c);
+  std::string buf;
+  char tmp[4096];
+  auto t_idle = std::chrono::steady_clock::now();
+  while (!stop){
+    // read request headers
+    auto he = buf.find("\r\n\r\n");
+    if (he == std::string::npos){
+      // idle connections are closed in 10s
+      if (std::chrono::steady_clock::now() - t_idle > std::chrono::seconds(10)) break;
+      struct pollfd pfd = {fd, POLLIN, 0};
+      if (poll(&pfd, 1, SIM_POLL_MS) <= 0) continue;
+      auto n = ::recv(fd, tmp, sizeof(tmp), 0);
+      if (n<=0) break;
+      buf.append(tmp, n);
+      continue;
+    }
+    auto req = buf.substr(0, buf.find("\r\n"));
+    buf.erase(0, he+4);
+
+    // GET <url> HTTP/1.1
+    auto p1 = req.find(' ');
+    auto p2 = req.rfind(' ');
+    std::string url = p1<p2 ? req.substr(p1+1, p2-p1-1) : "";
+    Opt opts;
+    auto q = url.find('?');
+    if (q != std::string::npos){
+      std::istringstream ss(url.substr(q+1));
+      std::string a;
+      while (std::getline(ss, a, '&')){
+        auto e = a.find('=');
+        if (e != std::string::npos)
+          opts.put(url_unescape(a.substr(0,e)), url_unescape(a.substr(e+1)));
+      }
+      url = url.substr(0, q);
+    }
+
+    // is the client still connected (same check as in device_d)
+    auto alive = [fd](){
+      struct pollfd p = {fd, POLLRDHUP, 0};
+      if (poll(&p, 1, 0) <= 0) return true;
+      return (p.revents & (POLLRDHUP | POLLHUP | POLLERR)) == 0;
+    };
+
+    std::string code = "200 OK", hdr, body;
+    try { body = dm.run(url_unescape(url), opts, c, alive); }
+    catch (ErrBusy & e){
+      code = "503 Service Unavailable";
+      hdr = "Retry-After: " + type_to_str((int)ceil(e.retry_after)) + "\r\n";
+      body = e.str();
+    }
+    catch (Err & e){
+      code = e.code()==ERR_SUPERSEDED? "409 Conflict" : "400 Bad Request";
+      body = e.str();
+    }
+    std::string out = "HTTP/1.1 " + code + "\r\n" + hdr +
+      "Content-Length: " + type_to_str(body.size()) + "\r\n\r\n" + body;
+    size_t n = 0;
+    while (n < out.size()){
+      auto r = ::send(fd, out.data()+n, out.size()-n, MSG_NOSIGNAL);
+      if (r<0 && errno==EINTR) continue;
+      if (r<0) break;
+      n += r;
+    }
+    t_idle = std::chrono::steady_clock::now();
+  }
+  dm.conn_close(c);
+  shutdown(fd, SHUT_RDWR);
+  std::lock_guard<std::mutex> lk(m);
+  closed.push_back(fd);
+}
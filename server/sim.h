@@ -0,0 +1,263 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <string>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include "opt/opt.h"
+#include "drv_utils.h"
+#include "drv_hislip.h"
+#include "drv_vxi11.h"
+#include "drv_modbus.h"
+#include "dev_manager.h"
+
+/*************************************************/
+/* Instrument simulators for testing drivers without hardware.
+
+A simulator runs a background thread which reads messages from a
+pseudo-terminal (SimSerial), from local TCP connections (SimNet),
+from HiSLIP sessions (SimHiSLIP), or from VXI-11 links (SimVXI11), and
+answers them like a simple SCPI instrument. Modbus simulators
+(SimModbusTCP, SimModbusRTU) work as a simple register device.
+SimServer is a device server (for the device2 driver).
+
+Parameters:
+
+* `-eol <v>`         -- End of incoming messages. If empty, message
+                        ends after a short pause in data (as for devices
+                        without message terminators). Default: "\n".
+
+* `-delay <v>`       -- Response latency, seconds. Default: 0.
+
+* `-answer_size <N>` -- If N>0, answer is a string of N bytes, otherwise
+                        the message is repeated. Default: 0.
+
+* `-answer_cond <v>` -- When should the simulator answer: always, never,
+                        qmark, qmark1w (same as -read_cond parameter in drivers).
+                        Default: always.
+
+* `-add_str <v>`     -- String added to each answer. Default: "\n".
+
+* `-nack_pref <v>`   -- Messages starting with this prefix are answered
+                        with `-nack_str` instead of `-add_str`. Default: "ERR".
+
+* `-nack_str <v>`    -- Default: empty string.
+
+* `-prologix (0|1)`  -- Understand `++addr` command of Prologix
+                        gpib2eth converter. Default: 0.
+
+* `-overlap (0|1)`   -- HiSLIP simulator: overlapped or synchronized mode.
+                        Default: 1.
+
+*/
+
+class SimInstr {
+protected:
+  std::string eol, add, nack_pref, nack, gpib_addr;
+  double delay;
+  size_t answer_size;
+  read_cond_t answer_cond;
+  bool prologix, overlap;
+
+  std::thread thr;
+  std::atomic<bool> stop;
+
+  // Input buffers for each file descriptor
+  std::map<int, std::string> bufs;
+
+  // Process data read from a file descriptor,
+  // write answers, return false on errors.
+  bool process(int fd, const std::string & data);
+
+  // Process message, return true if answer is needed.
+  bool answer(const std::string & msg, std::string & ans);
+
+  // Main loop, runs in a separate thread
+  virtual void run() = 0;
+
+public:
+  SimInstr(const Opt & opts);
+  virtual ~SimInstr() {}
+
+  // stop the thread
+  void finish();
+};
+
+/*************************************************/
+// Pseudo-terminal instrument (for serial drivers)
+class SimSerial: public SimInstr {
+  int mfd, sfd; // master and slave file descriptors
+  std::string sname; // slave device name
+  void run() override;
+public:
+  SimSerial(const Opt & opts = Opt());
+  ~SimSerial();
+
+  // device name to be used in -dev parameter of serial drivers
+  std::string dev() const {return sname;}
+};
+
+/*************************************************/
+// TCP instrument on localhost (for network drivers)
+class SimNet: public SimInstr {
+  int lfd;  // listening socket
+  int port_;
+  std::atomic<bool> drop;
+  void run() override;
+public:
+  SimNet(const Opt & opts = Opt());
+  ~SimNet();
+
+  // port number to be used in -port parameter of network drivers
+  int port() const {return port_;}
+
+  // close all client connections (as an instrument reboot
+  // or idle timeout would do)
+  void disconnect() {drop = true;}
+};
+
+/*************************************************/
+// HiSLIP instrument on localhost (for hislip driver).
+// Answers are sent after -delay time without blocking other requests
+// (as with a long network link), so pipelined requests are answered
+// in parallel. Message "SRQ" produces a service request with status
+// byte 0x40.
+class SimHiSLIP: public SimInstr {
+  int lfd;  // listening socket
+  int port_;
+
+  // sessions: session id -> (sync fd, async fd)
+  std::map<int, std::pair<int,int> > sessions;
+  std::map<int, int> fd_sessions; // fd -> session id
+  std::map<int, std::string> msgs; // incomplete messages (sync fd)
+  int next_session;
+  uint8_t stb;
+
+  // answers scheduled for sending: (time, sync fd, data)
+  std::multimap<double, std::pair<int, std::string> > out;
+
+  // process a HiSLIP message from fd, return false on errors
+  bool process_msg(int fd, const Driver_hislip::Msg & m);
+
+  // close a connection
+  void close_fd(int fd);
+
+  void run() override;
+public:
+  SimHiSLIP(const Opt & opts = Opt());
+  ~SimHiSLIP();
+
+  // port number to be used in -port parameter of hislip driver
+  int port() const {return port_;}
+};
+
+/*************************************************/
+// VXI-11 instrument on localhost (for vxi11 driver).
+// The same port is used for the portmapper and the core channel.
+// Max size of device_write data is 1024 bytes. A new message discards
+// unread answer of the previous one.
+class SimVXI11: public SimInstr {
+  int lfd;  // listening socket
+  int port_;
+  uint32_t next_link;
+
+  // links: link id -> (incomplete message, answer data)
+  std::map<uint32_t, std::pair<std::string, std::string> > links;
+
+  // process an RPC call, return the reply
+  std::string process_call(const std::string & call);
+
+  void run() override;
+public:
+  SimVXI11(const Opt & opts = Opt());
+  ~SimVXI11();
+
+  // port number to be used in -port and -pmap_port parameters
+  // of vxi11 driver
+  int port() const {return port_;}
+};
+
+/*************************************************/
+// Modbus device: 1000 holding registers and coils (initially 0),
+// input registers (value = address) and discrete inputs (value =
+// address%2). Access to other addresses gives exception 2. Number of
+// transactions is counted.
+class SimModbus: public SimInstr {
+protected:
+  std::vector<uint16_t> regs;
+  std::vector<bool> coils;
+  std::atomic<int> ntrans;
+
+  // process request PDU, return response PDU
+  std::string process_pdu(const std::string & pdu);
+
+public:
+  SimModbus(const Opt & opts): SimInstr(opts),
+    regs(1000,0), coils(1000,false), ntrans(0) {}
+
+  // number of processed transactions
+  int transactions() const {return ntrans;}
+};
+
+// Modbus TCP device on localhost (for modbus_tcp driver), any unit address.
+class SimModbusTCP: public SimModbus {
+  int lfd;  // listening socket
+  int port_;
+  void run() override;
+public:
+  SimModbusTCP(const Opt & opts = Opt());
+  ~SimModbusTCP();
+
+  // port number to be used in -port parameter of modbus_tcp driver
+  int port() const {return port_;}
+};
+
+// Modbus RTU device on a pseudo-terminal (for modbus_rtu driver),
+// unit address 1.
+class SimModbusRTU: public SimModbus {
+  int mfd, sfd; // master and slave file descriptors
+  std::string sname; // slave device name
+  void run() override;
+public:
+  SimModbusRTU(const Opt & opts = Opt());
+  ~SimModbusRTU();
+
+  // device name to be used in -dev parameter of modbus_rtu driver
+  std::string dev() const {return sname;}
+};
+
+/*************************************************/
+// Device server on localhost (for device2 driver): DevManager with
+// devices from a configuration file and a minimal HTTP/1.1 front end
+// (GET requests, keep-alive connections, a thread per connection).
+// As in device_d, devices are released when a connection is closed,
+// and waiting requests of closed connections are cancelled.
+class SimServer {
+  DevManager dm;
+  int lfd;  // listening socket
+  int port_;
+  std::atomic<bool> stop;
+  std::thread thr;
+
+  std::mutex m;            // protects data below
+  std::map<int, std::thread> clients; // fd -> thread
+  std::vector<int> closed; // finished clients
+  uint64_t conn;           // connection counter
+
+  // serve a single client
+  void serve(const int fd, const uint64_t conn);
+  void run();
+public:
+  SimServer(const std::string & devfile);
+  ~SimServer();
+
+  // port number to be used in -port parameter of device2 driver
+  int port() const {return port_;}
+
+  // close all client connections (as idle timeout would do)
+  void disconnect();
+};
+
+#endif
@@ -0,0 +1,606 @@
+///\cond HIDDEN (do not show this in Doxyden)
+
+#include "sim.h"
+#include "drv.h"
+#include "drv_device2.h"
+#include "err/assert_err.h"
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <fstream>
+
+using namespace std;
+
+int
+main(){
+  try{
+
+    // serial driver with explicit settings
+    {
+      SimSerial sim;
+      Opt o;
+      o.put("dev", sim.dev());
+      o.put("ndelay", 0);
+      o.put("raw", 1);
+      o.put("vmin", 0);
+      o.put("timeout", 1.0);
+      o.put("delay", 0);
+      o.put("add_str", "\n");
+      o.put("trim_str", "\n");
+      auto d = Driver::create("serial", o);
+      assert_eq(d->ask("abc"), "abc");
+      assert_eq(d->ask("*IDN?"), "*IDN?");
+    }
+
+    // serial driver, read timeout
+    {
+      Opt so;
+      so.put("answer_cond", "never");
+      SimSerial sim(so);
+      Opt o;
+      o.put("dev", sim.dev());
+      o.put("ndelay", 0);
+      o.put("raw", 1);
+      o.put("vmin", 0);
+      o.put("timeout", 0.1);
+      o.put("errpref", "");
+      auto d = Driver::create("serial", o);
+      assert_err(d->ask("abc"), sim.dev() + ": read timeout");
+    }
+
+    // asm340: ack/nack characters, CR at the end
+    {
+      Opt so;
+      so.put("eol", "\r");
+      so.put("add_str",  "\r\x06");
+      so.put("nack_str", "\r\x15");
+      SimSerial sim(so);
+      Opt o;
+      o.put("dev", sim.dev());
+      auto d = Driver::create("serial_asm340", o);
+      assert_eq(d->ask("*IDN?"), "Adixen ASM340 leak detector");
+      assert_eq(d->ask("?le2"), "?LE2"); // upper case on output
+      assert_err(d->ask("ERR"), "nack from the device: ERR");
+    }
+
+    // vs_ld: "ok" and "#?" as ack/nack sequences
+    {
+      Opt so;
+      so.put("add_str",  "\nok");
+      so.put("nack_str", "\n#?");
+      SimSerial sim(so);
+      Opt o;
+      o.put("dev", sim.dev());
+      auto d = Driver::create("serial_vs_ld", o);
+      assert_eq(d->ask("abc"), "abc");
+      assert_err(d->ask("ERR"), "nack from the device: ERR");
+    }
+
+    // tenma: no message terminators, answer only queries
+    {
+      Opt so;
+      so.put("eol", "");
+      so.put("add_str", "");
+      so.put("answer_cond", "qmark");
+      SimSerial sim(so);
+      Opt o;
+      o.put("dev", sim.dev());
+      auto d = Driver::create("serial_tenma_ps", o);
+      assert_eq(d->ask("vset1:1.00"), "");
+      assert_eq(d->ask("vset1?"), "VSET1?"); // upper case on output
+    }
+
+    // et: non-blocking mode
+    {
+      Opt so;
+      so.put("add_str", "\n\n");
+      SimSerial sim(so);
+      Opt o;
+      o.put("dev", sim.dev());
+      auto d = Driver::create("serial_et", o);
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+    }
+
+    // simple: read answer only for queries
+    {
+      Opt so;
+      so.put("answer_cond", "qmark1w");
+      SimSerial sim(so);
+      Opt o;
+      o.put("dev", sim.dev());
+      auto d = Driver::create("serial_simple", o);
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+      assert_eq(d->ask("FREQ 1"), "");
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+    }
+
+    // net
+    {
+      Opt so;
+      so.put("answer_cond", "qmark1w");
+      SimNet sim(so);
+      Opt o;
+      o.put("addr", "127.0.0.1");
+      o.put("port", sim.port());
+      auto d = Driver::create("net", o);
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+      assert_eq(d->ask("FREQ 1"), "");
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+    }
+
+    // net, answer size
+    {
+      Opt so;
+      so.put("answer_size", 100);
+      SimNet sim(so);
+      Opt o;
+      o.put("addr", "localhost");
+      o.put("port", sim.port());
+      auto d = Driver::create("net", o);
+      assert_eq(d->ask("DATA?").size(), 100);
+    }
+
+    // net, reconnect after the connection is closed by the device
+    {
+      SimNet sim;
+      Opt o;
+      o.put("addr", "127.0.0.1");
+      o.put("port", sim.port());
+      o.put("errpref", "");
+      auto d = Driver::create("net", o);
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+      sim.disconnect();
+      usleep(200000);
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+
+      // no reconnection
+      o.put("reconnect", 0);
+      d = Driver::create("net", o);
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+      sim.disconnect();
+      usleep(200000);
+      std::string pref = "127.0.0.1:" + type_to_str(sim.port()) + ": ";
+      assert_err(d->ask("FREQ?"), pref + "connection closed by the device");
+      assert_err(d->ask("FREQ?"), pref + "connection closed by the device");
+    }
+
+    // net, socket options
+    {
+      SimNet sim;
+      Opt o;
+      o.put("addr", "localhost");
+      o.put("port", sim.port());
+      o.put("tcp_nodelay", 0);
+      o.put("keepalive", 10);
+      o.put("keepalive_intvl", 2);
+      o.put("keepalive_cnt", 3);
+      o.put("rcvbuf", 65536);
+      o.put("connect_timeout", 0.5);
+      auto d = Driver::create("net", o);
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+      d = Driver::create("net", o); // cached address
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+      o.put("errpref", "");
+      o.put("rcvbuf", -1);
+      assert_err(Driver::create("net", o), "localhost:" + type_to_str(sim.port()) +
+        ": keepalive and rcvbuf parameters should be non-negative");
+    }
+
+    // net, connection refused
+    {
+      int port;
+      { SimNet sim; port = sim.port(); }
+      Opt o;
+      o.put("addr", "127.0.0.1");
+      o.put("port", port);
+      o.put("errpref", "");
+      assert_err(Driver::create("net", o),
+        "127.0.0.1:" + type_to_str(port) + ": can't connect: Connection refused");
+    }
+
+    // prologix
+    {
+      Opt so;
+      so.put("answer_cond", "qmark1w");
+      so.put("prologix", 1);
+      SimNet sim(so);
+      Opt o;
+      o.put("addr", "127.0.0.1");
+      o.put("port", sim.port());
+      assert_err(Driver::create("net_gpib_prologix", o),
+        "Driver_net: 127.0.0.1:" + type_to_str(sim.port()) +
+        ": Parameter -gpib_addr is empty or missing");
+      o.put("gpib_addr", 5);
+      auto d = Driver::create("net_gpib_prologix", o);
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+      assert_eq(d->ask("FREQ 1"), "");
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+    }
+
+    // hislip
+    {
+      SimHiSLIP sim;
+      Opt o;
+      o.put("addr", "127.0.0.1");
+      o.put("port", sim.port());
+      auto d = Driver::create("hislip", o);
+      assert_eq(d->parallel(), 8);
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+      assert_eq(d->ask("FREQ 1"), "");
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+
+      // binary data, long messages
+      std::string b("X?\0\n\r\xff", 6);
+      assert_eq(d->ask(b), b);
+      std::string l(2000000, 'a');
+      l[0] = '?';
+      assert_eq(d->ask(l), l);
+
+      // status byte, service requests, device clear
+      assert_eq(d->ask("#srq"), "");
+      assert_eq(d->ask("SRQ"), "");
+      usleep(100000);
+      assert_eq(d->ask("#srq"), "64");
+      assert_eq(d->ask("#srq"), "");
+      assert_eq(d->ask("#stb"), "64");
+      assert_eq(d->ask("#stb"), "0");
+      assert_eq(d->ask("#clear"), "");
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+    }
+
+    // hislip, overlapped mode: parallel requests
+    {
+      Opt so;
+      so.put("delay", 0.1);
+      SimHiSLIP sim(so);
+      Opt o;
+      o.put("addr", "127.0.0.1");
+      o.put("port", sim.port());
+      o.put("timeout", 1);
+      auto d = Driver::create("hislip", o);
+      std::vector<std::thread> thr;
+      std::atomic<int> nerr(0);
+      auto t0 = std::chrono::steady_clock::now();
+      for (int i=0; i<5; i++)
+        thr.push_back(std::thread([&d, &nerr, i](){
+          auto m = "MEAS? " + type_to_str(i);
+          if (d->ask(m) != m) nerr++;
+        }));
+      for (auto & t: thr) t.join();
+      double dt = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t0).count();
+      assert_eq(nerr, 0);
+      assert_eq(dt < 0.3, true);
+
+      // answers are matched to messages using message id
+      d->write("A?");
+      d->write("B?");
+      assert_eq(d->read(), "B?");
+      assert_eq(d->ask("C?"), "C?");
+
+      // device clear while another thread reads the channel
+      {
+        std::string err;
+        std::thread t([&d, &err](){
+          try { d->ask("D?"); } catch (Err & e) { err = e.str(); }
+        });
+        usleep(20000);
+        assert_eq(d->ask("#clear"), "");
+        t.join();
+        assert_eq(err, "hislip: 127.0.0.1:" +
+          type_to_str(sim.port()) + ": device clear");
+        assert_eq(d->ask("E?"), "E?");
+        assert_eq(d->parallel() > 1, true); // mode is kept
+      }
+
+      // read timeout, late answer is ignored
+      o.put("timeout", 0.05);
+      d = Driver::create("hislip", o);
+      assert_err(d->ask("A?"), "hislip: 127.0.0.1:" +
+        type_to_str(sim.port()) + ": read timeout");
+      usleep(100000);
+      assert_err(d->ask("B?"), "hislip: 127.0.0.1:" +
+        type_to_str(sim.port()) + ": read timeout");
+    }
+
+    // hislip, synchronized mode
+    {
+      Opt so;
+      so.put("overlap", 0);
+      SimHiSLIP sim(so);
+      Opt o;
+      o.put("addr", "127.0.0.1");
+      o.put("port", sim.port());
+      auto d = Driver::create("hislip", o);
+      assert_eq(d->parallel(), 1);
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+      assert_eq(d->ask("#clear"), "");
+      assert_eq(d->parallel(), 1);
+    }
+
+    // vxi11, port from the portmapper
+    {
+      SimVXI11 sim;
+      Opt o;
+      o.put("addr", "127.0.0.1");
+      o.put("pmap_port", sim.port());
+      auto d = Driver::create("vxi11", o);
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+      assert_eq(d->ask("FREQ 1"), "");
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+
+      // long messages are split, answers are read in chunks
+      std::string l(5000, 'a');
+      l[0] = '?';
+      assert_eq(d->ask(l), l);
+
+      // status byte, device clear
+      d->write("A?");
+      assert_eq(d->ask("#stb"), "16");
+      assert_eq(d->ask("#clear"), "");
+      assert_eq(d->ask("#stb"), "0");
+      assert_err(d->read(), "vxi11: 127.0.0.1: I/O timeout");
+      assert_eq(d->ask("FREQ?"), "FREQ?");
+    }
+
+    // vxi11, fixed port, small reads
+    {
+      Opt so;
+      so.put("answer_size", 1000);
+      SimVXI11 sim(so);
+      Opt o;
+      o.put("addr", "127.0.0.1");
+      o.put("port", sim.port());
+      o.put("read_size", 64);
+      auto d = Driver::create("vxi11", o);
+      assert_eq(d->ask("MEAS?").size(), 1000);
+
+      // connection error
+      o.put("port", 1);
+      o.put("reconnect", 0);
+      assert_err(Driver::create("vxi11", o),
+        "vxi11: 127.0.0.1: can't connect: Connection refused");
+    }
+
+    // modbus_tcp
+    {
+      Opt so;
+      so.put("delay", 0.05);
+      SimModbusTCP sim(so);
+      Opt o;
+      o.put("addr", "127.0.0.1");
+      o.put("port", sim.port());
+      auto d = Driver::create("modbus_tcp", o);
+      assert_eq(d->parallel(), 8);
+      std::string pref = "modbus_tcp: 127.0.0.1:" + type_to_str(sim.port()) + ": ";
+
+      assert_eq(d->ask("WRITE 40001 1 2 3 4 5 6 7 8 9 10"), "");
+      assert_eq(d->ask("READ 40001 10"), "1 2 3 4 5 6 7 8 9 10");
+      assert_eq(d->ask("WRITE 40003 0x100"), "");
+      assert_eq(d->ask("read 2:40002 3"), "2 256 4");
+      assert_eq(d->ask("READ 30011 2"), "10 11");
+      assert_eq(d->ask("WRITE 00002 1 0 1"), "");
+      assert_eq(d->ask("WRITE 00001 1"), "");
+      assert_eq(d->ask("READ 00001 5"), "1 1 0 1 0");
+      assert_eq(d->ask("READ 100001 3"), "0 1 0");
+      d->write("READ 400001");
+      assert_eq(d->read(), "1");
+
+      assert_err(d->ask("READ 41001"), pref + "exception 2: illegal data address");
+      assert_err(d->ask("READ 40001 200"), pref + "bad number of registers: 200");
+      assert_err(d->ask("READ 20001"), pref + "bad register address: 20001");
+      assert_err(d->ask("WRITE 30001 1"), pref + "register is not writable: 30001");
+      assert_err(d->ask("GET 40001"), pref + "unknown command, READ or WRITE expected: GET 40001");
+
+      // simultaneous reads of adjacent ranges are coalesced
+      int n0 = sim.transactions();
+      std::vector<std::thread> thr;
+      std::atomic<int> nerr(0);
+      for (int i=0; i<5; i++)
+        thr.push_back(std::thread([&d, &nerr, i](){
+          auto a = d->ask("READ 4000" + type_to_str(1+2*i) + " 2");
+          if (a != type_to_str(1+2*i) + " " + type_to_str(2+2*i) &&
+              a != "1 2" && a != "256 4") nerr++;
+        }));
+      for (auto & t: thr) t.join();
+      assert_eq(nerr, 0);
+      assert_eq(sim.transactions() - n0 <= 2, true);
+
+      // combined read fails: requests are repeated one by one
+      o.put("max_gap", 10);
+      d = Driver::create("modbus_tcp", o);
+      thr.clear();
+      for (int i=0; i<3; i++)
+        thr.push_back(std::thread([&d, &nerr, i](){
+          try { d->ask(i<2? "READ 40990 2" : "READ 41000 2"); }
+          catch (Err & e) { if (i<2) nerr++; }
+        }));
+      for (auto & t: thr) t.join();
+      assert_eq(nerr, 0);
+    }
+
+    // modbus_rtu
+    {
+      SimModbusRTU sim;
+      Opt o;
+      o.put("dev", sim.dev());
+      o.put("speed", 19200);
+      o.put("timeout", 0.2);
+      auto d = Driver::create("modbus_rtu", o);
+      assert_eq(d->ask("WRITE 40010 5 6"), "");
+      assert_eq(d->ask("READ 40010 2"), "5 6");
+      assert_eq(d->ask("READ 30100 2"), "99 100");
+      assert_eq(d->ask("WRITE 0:40010 7"), ""); // broadcast
+      assert_eq(d->ask("READ 40010 2"), "7 6");
+      assert_err(d->ask("READ 2:40010 2"), "modbus_rtu: " + sim.dev() + ": read timeout");
+      assert_err(d->ask("READ 41000 2"), "modbus_rtu: " + sim.dev() +
+        ": exception 2: illegal data address");
+      assert_eq(d->ask("READ 40010"), "7");
+    }
+
+    // device2
+    {
+      assert_eq(HttpConn::escape("a b/c?d%e-f_g.h~"), "a%20b%2Fc%3Fd%25e-f_g.h~");
+      assert_eq(HttpConn::make_url("ask", "a", "x/y"), "/ask/a/x%2Fy");
+      assert_eq(HttpConn::make_url("ping"), "/ping");
+
+      SimServer sim("test_data/dev2.txt");
+      Opt o;
+      o.put("port", sim.port());
+      o.put("dev", "a");
+      auto pref = "device2: localhost:" + type_to_str(sim.port());
+      auto d = Driver::create("device2", o);
+      assert_eq(d->parallel(), 4);
+      assert_eq(d->ask("a b/c?#%"), "a b/c?#%");
+      d->write("msg");
+      assert_eq(d->read(), "msg");
+
+      o.put("dev", "x");
+      assert_err(Driver::create("device2", o), pref + "/x: unknown device: x");
+
+      // requests to different devices go in parallel
+      o.put("dev", "b");
+      auto db = Driver::create("device2", o);
+      o.put("dev", "c");
+      auto dc = Driver::create("device2", o);
+      auto t0 = std::chrono::steady_clock::now();
+      std::thread t1([&db](){ assert_eq(db->ask("1"), "1"); });
+      std::thread t2([&dc](){ assert_eq(dc->ask("2"), "2"); });
+      t1.join(); t2.join();
+      double dt = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t0).count();
+      assert_eq(dt < 0.35, true);
+
+      // keep-alive connections closed by the server
+      sim.disconnect();
+      usleep(100000);
+      assert_eq(d->ask("b"), "b");
+
+      // lock: other connections can not use the device
+      o.put("dev", "a");
+      d->lock(true);
+      assert_err(Driver::create("device2", o), pref + "/a: device is locked");
+      assert_eq(d->ask("c"), "c");
+      d->lock(false);
+      auto d1 = Driver::create("device2", o);
+      assert_err(d->lock(true), "Can't lock the device: it is in use");
+      d1.reset();
+      usleep(100000);
+      d->lock(true);
+      d->lock(false);
+    }
+
+    // request replaced by a newer one (coalescing): 409 code
+    {
+      SimServer sim("test_data/dev3.txt");
+      auto port = type_to_str(sim.port());
+      auto req = [&port](const std::string & msg, std::string & body){
+        HttpConn h;
+        h.open("localhost", port, "", 1);
+        double ra;
+        return h.get(HttpConn::make_url("ask", "a", msg), body, ra, 5);
+      };
+      std::string b1, b2, b3;
+      int c1 = 0, c2 = 0;
+      std::thread t1([&](){ c1 = req("X", b1); });
+      usleep(50000);
+      std::thread t2([&](){ c2 = req("F 1", b2); });
+      usleep(50000);
+      assert_eq(req("F 2", b3), 200);
+      t1.join(); t2.join();
+      assert_eq(c1, 200);
+      assert_eq(c2, 409);
+      assert_eq(b2, "superseded by a newer request");
+      assert_eq(b3, "F 2");
+    }
+
+    // federated routing: devices on an upstream server
+    {
+      std::unique_ptr<SimServer> sim(new SimServer("test_data/dev2.txt"));
+      const char *fn = "test_data/route.tmp";
+      std::ofstream ff(fn);
+      ff << "local test\n"
+         << "upstream u1 -port " << sim->port() << " -check_period 0.5\n"
+         << "route u1 b c*\n";
+      ff.close();
+      DevManager dm(fn);
+      unlink(fn);
+      Opt o;
+      assert_eq(dm.run("list", o, 1), "b\nc\nlocal\n");
+      assert_eq(dm.run("ask/b/x", o, 1), "x");
+      assert_eq(dm.run("ask/local/y", o, 1), "y");
+      assert_err(dm.run("ask/a/x", o, 1), "unknown device: a");
+      assert_err(dm.run("ask/cx/x", o, 1), "unknown device: cx");
+
+      // requests of a client go through its own connection: lock, logs
+      dm.run("lock/b", o, 1);
+      assert_err(dm.run("ask/b/x", o, 2), "device is locked");
+      assert_eq(dm.run("info/b", o, 1).find("Device is locked\n"
+        "Upstream server: u1\n") != std::string::npos, true);
+      dm.run("log_start/c", o, 2);
+      dm.run("ask/c/z", o, 2);
+      assert_eq(dm.run("log_get/c", o, 2).find("z") != std::string::npos, true);
+
+      // disconnected client releases devices
+      dm.conn_close(1);
+      assert_eq(dm.run("ask/b/y", o, 2), "y");
+
+      // connection name is used on the upstream server
+      auto up_get = [&sim](const std::string & url){
+        HttpConn h;
+        h.open("localhost", type_to_str(sim->port()), "", 1);
+        std::string body;
+        double ra;
+        h.get(url, body, ra, 5);
+        return body;
+      };
+      dm.run("set_conn_name/cl5", o, 5);
+      dm.run("ask/b/x", o, 5);
+      assert_eq(up_get("/list_conn_names").find("cl5\n") != std::string::npos, true);
+      dm.conn_close(5);
+      assert_eq(up_get("/list_conn_names").find("cl5\n") == std::string::npos, true);
+
+      // request of a disconnected client is cancelled on the upstream server
+      {
+        std::atomic<bool> al(true);
+        std::thread t1([&dm, &o](){ dm.run("ask/b/1", o, 6); });
+        std::thread t2([&dm, &o](){ dm.run("ask/b/2", o, 7); });
+        usleep(50000);
+        std::thread t3([&dm, &o, &al](){
+          assert_err(dm.run("ask/b/3", o, 8, [&al](){ return (bool)al; }),
+            "upstream u1: request cancelled: client disconnected"); });
+        usleep(50000);
+        al = false;
+        t1.join(); t2.join(); t3.join();
+        assert_eq(up_get("/metrics").find("cancelled 1\n") != std::string::npos, true);
+      }
+
+      // requests to different devices go in parallel
+      auto t0 = std::chrono::steady_clock::now();
+      std::thread t1([&dm, &o](){ assert_eq(dm.run("ask/b/1", o, 3), "1"); });
+      std::thread t2([&dm, &o](){ assert_eq(dm.run("ask/c/2", o, 4), "2"); });
+      t1.join(); t2.join();
+      double dt = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t0).count();
+      assert_eq(dt < 0.35, true);
+
+      // server is down
+      sim.reset();
+      usleep(1000000);
+      assert_err(dm.run("ask/b/x", o, 2), "upstream u1: server is down: "
+        "can't connect: Connection refused");
+      assert_eq(dm.run("list", o, 1), "local\n");
+      assert_eq(dm.run("upstreams", o, 1).find("down") != std::string::npos, true);
+    }
+
+  }
+  catch (Err e) {
+    std::cerr << "Error: " << e.str() << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+///\endcond
@@ -0,0 +1,12 @@
+#!/bin/sh -efu
+
+# SPP interface returning long answers (for benchmarks):
+# answer to a number N is N lines of data
+
+echo "#SPP1"
+stdbuf -o L echo "#OK"
+
+while read x; do
+  seq -f "%g 1.234567 2.345678 3.456789" "$x"
+  stdbuf -o L echo "#OK"
+done
@@ -0,0 +1,103 @@
+#include "unix_sock.h"
+#include "err/err.h"
+
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// fill sockaddr_un structure
+static void
+fill_addr(struct sockaddr_un & addr, const std::string & path){
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    throw Err() << "unix socket path is too long: " << path;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+}
+
+int
+unix_sock_listen(const std::string & path, const int mode){
+  struct sockaddr_un addr;
+  fill_addr(addr, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd<0) throw Err() << "can't create unix socket: " << strerror(errno);
+
+  // remove stale socket file (only if it is a socket and
+  // nobody listens on it)
+  struct stat st;
+  if (lstat(path.c_str(), &st)==0 && S_ISSOCK(st.st_mode)){
+    int fd1 = socket(AF_UNIX, SOCK_STREAM, 0);
+    int res = fd1<0 ? -1 : connect(fd1, (struct sockaddr*)&addr, sizeof(addr));
+    auto en = errno;
+    if (fd1>=0) ::close(fd1);
+    if (res==0){
+      ::close(fd);
+      throw Err() << "unix socket is in use: " << path;
+    }
+    if (en == ECONNREFUSED) unlink(path.c_str());
+  }
+
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))<0){
+    auto en = errno;
+    ::close(fd);
+    throw Err() << "can't bind unix socket: " << path << ": " << strerror(en);
+  }
+
+  if (chmod(path.c_str(), mode)<0 || listen(fd, 64)<0){
+    auto en = errno;
+    ::close(fd);
+    unlink(path.c_str());
+    throw Err() << "can't listen unix socket: " << path << ": " << strerror(en);
+  }
+  return fd;
+}
+
+int
+unix_sock_connect(const std::string & path){
+  struct sockaddr_un addr;
+  fill_addr(addr, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd<0) throw Err() << "can't create unix socket: " << strerror(errno);
+
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))<0){
+    auto en = errno;
+    ::close(fd);
+    throw Err() << "can't connect to unix socket: " << path << ": " << strerror(en);
+  }
+  return fd;
+}
+
+bool
+FdLineReader::getline(std::string & l){
+  while (1){
+    auto p = buf.find('\n');
+    if (p != std::string::npos){
+      l = buf.substr(0,p);
+      buf.erase(0,p+1);
+      return true;
+    }
+    char b[4096];
+    auto res = ::read(fd, b, sizeof(b));
+    if (res<0 && errno==EINTR) continue;
+    if (res<0) throw Err() << "read error: " << strerror(errno);
+    if (res==0) return false;
+    buf.append(b, res);
+  }
+}
+
+void
+write_all(const int fd, const std::string & s){
+  size_t n = 0;
+  while (n < s.size()){
+    auto res = ::send(fd, s.data()+n, s.size()-n, MSG_NOSIGNAL);
+    if (res<0 && errno==EINTR) continue;
+    if (res<0) throw Err() << "write error: " << strerror(errno);
+    n += res;
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef UNIX_SOCK_H
+#define UNIX_SOCK_H
+
+#include <string>
+
+// Utilities for unix domain sockets.
+
+// Create a listening unix socket. Stale socket file is removed,
+// throw Err if another program listens on the socket.
+// Return file descriptor, throw Err on errors.
+int unix_sock_listen(const std::string & path, const int mode = 0600);
+
+// Connect to a unix socket.
+// Return file descriptor, throw Err on errors.
+int unix_sock_connect(const std::string & path);
+
+// Buffered reading of lines from a file descriptor.
+class FdLineReader {
+  int fd;
+  std::string buf;
+public:
+  FdLineReader(const int fd): fd(fd) {}
+
+  // Read a line (without trailing \n).
+  // Return false on EOF, throw Err on errors.
+  bool getline(std::string & l);
+};
+
+// Write all data to a socket, throw Err on errors.
+void write_all(const int fd, const std::string & s);
+
+#endif
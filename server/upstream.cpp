@@ -0,0 +1,295 @@
+#include "upstream.h"
+#include <algorithm>
+#include "log/log.h"
+#include "err/err.h"
+#include "cmd_queue.h"
+#include "drv.h"
+
+/*************************************************/
+
+Upstream::Upstream(const std::string & name, const Opt & opts):
+    name(name), opts(opts), checked(false), up(false), stop(false) {
+  opts.check_unknown({"addr","port","socket","timeout","connect_timeout",
+    "check_period","max_idle"});
+
+  errpref = "upstream " + name + ": ";
+  addr = opts.get("addr", "localhost");
+  port = opts.get("port", "8082");
+  sock = opts.get("socket", "");
+  timeout = opts.get("timeout", 20.0);
+  connect_timeout = opts.get("connect_timeout", 5.0);
+  check_period = opts.get("check_period", 5.0);
+  if (check_period<=0) throw Err() << errpref << "-check_period should be positive";
+  int n = opts.get("max_idle", 4);
+  if (n<0) throw Err() << errpref << "-max_idle should be non-negative";
+  max_idle = n;
+
+  thr = std::thread(&Upstream::check_loop, this);
+}
+
+Upstream::~Upstream(){
+  {
+    std::lock_guard<std::mutex> lk(m);
+    stop = true;
+  }
+  cv.notify_all();
+  if (thr.joinable()) thr.join();
+  // the server releases devices when connections are closed
+}
+
+/*************************************************/
+std::string
+Upstream::call(Conn & c, const std::string & url,
+               const std::function<bool()> & alive){
+  for (int attempt=0; ; attempt++){
+    bool reused = c.h.is_open();
+    if (!reused){
+      try { c.h.open(addr, port, sock, connect_timeout); }
+      catch (Err & e) {
+        // server is down until the next successful check
+        std::lock_guard<std::mutex> lk(m);
+        checked = true;
+        up = false;
+        err = e.str();
+        throw;
+      }
+      // new connection: set the client connection name
+      // (errors, such as a name used by another connection, are ignored)
+      if (c.cname.size()){
+        std::string body;
+        double ra;
+        try { c.h.get(HttpConn::make_url("set_conn_name", c.cname), body, ra, timeout); }
+        catch (Err & e) {
+          c.h.close();
+          throw;
+        }
+      }
+    }
+    std::string body;
+    double ra = 0;
+    int code;
+    try { code = c.h.get(url, body, ra, timeout, alive); }
+    catch (Err & e) {
+      c.h.close();
+      throw;
+    }
+    c.last = clock_t::now();
+    if (code == 0){
+      c.h.close();
+      // keep-alive connection was closed by the server: repeat once
+      if (reused && attempt==0) continue;
+      throw Err() << "connection closed by the server";
+    }
+    if (code == 200) return body;
+    if (code == 503){
+      ErrBusy e(ra);
+      e << body;
+      throw e;
+    }
+    if (code == 409) throw Err(ERR_SUPERSEDED) << body;
+    throw Err(ERR_ANSWER) << body;
+  }
+}
+
+std::unique_ptr<Upstream::Conn>
+Upstream::take_idle(){
+  if (idle.empty()) return std::unique_ptr<Conn>(new Conn);
+  auto c = std::move(idle.back());
+  idle.pop_back();
+  return c;
+}
+
+void
+Upstream::give_idle(std::unique_ptr<Conn> c){
+  if (c->h.is_open() && idle.size() < max_idle)
+    idle.push_back(std::move(c));
+}
+
+/*************************************************/
+std::string
+Upstream::request(const uint64_t conn, const std::string & cname,
+    const std::string & act, const std::string & arg,
+    const std::string & msg, const Opt & args,
+    const std::function<bool()> & alive){
+
+  auto url = HttpConn::make_url(act, arg, msg);
+  char sep = '?';
+  for (auto const & a: args){
+    url += sep + HttpConn::escape(a.first) + "=" + HttpConn::escape(a.second);
+    sep = '&';
+  }
+
+  std::unique_lock<std::mutex> lk(m);
+  if (checked && !up) throw Err() << errpref << "server is down: " << err;
+  auto & p = active[conn];
+  if (!p) p = take_idle();
+  Conn & c = *p;
+  cv.wait(lk, [&c](){ return !c.busy; });
+  c.busy = true;
+  bool rename = (c.cname != cname);
+  c.cname = cname;
+  lk.unlock();
+
+  try {
+    // name was changed: set it on the server
+    // (a new connection gets it when it is opened)
+    if (rename && c.h.is_open()){
+      try { call(c, HttpConn::make_url("set_conn_name", cname)); }
+      catch (Err & e) { if (e.code() != ERR_ANSWER) throw; }
+    }
+    auto ret = call(c, url, alive);
+    lk.lock();
+    c.busy = false;
+    cv.notify_all();
+    return ret;
+  }
+  catch (ErrBusy & e) {
+    lk.lock();
+    c.busy = false;
+    cv.notify_all();
+    throw;
+  }
+  catch (Err & e) {
+    lk.lock();
+    c.busy = false;
+    cv.notify_all();
+    if (e.code() == ERR_ANSWER) throw Err() << e.str();
+    if (e.code() == ERR_SUPERSEDED) throw;
+    throw Err(e.code()) << errpref << e.str();
+  }
+}
+
+void
+Upstream::release_all(const uint64_t conn){
+  {
+    std::lock_guard<std::mutex> lk(m);
+    if (active.count(conn) == 0) return;
+  }
+  // release_all resets the connection name on the server
+  try { request(conn, "", "release_all", "", "", Opt()); }
+  catch (Err & e) {}
+}
+
+void
+Upstream::conn_close(const uint64_t conn){
+  std::unique_lock<std::mutex> lk(m);
+  if (active.count(conn) == 0) return;
+  cv.wait(lk, [this, conn](){ return !active[conn]->busy; });
+  auto c = std::move(active[conn]);
+  active.erase(conn);
+  lk.unlock();
+
+  // release devices before giving the connection to another client
+  // (release_all also resets the connection name)
+  c->cname.clear();
+  if (c->h.is_open()){
+    try { call(*c, "/release_all"); }
+    catch (Err & e) { c->h.close(); }
+  }
+  lk.lock();
+  give_idle(std::move(c));
+}
+
+/*************************************************/
+std::vector<std::string>
+Upstream::devices(){
+  bool need;
+  {
+    std::lock_guard<std::mutex> lk(m);
+    need = !checked;
+  }
+  if (need) check();
+  std::lock_guard<std::mutex> lk(m);
+  return devs;
+}
+
+std::vector<std::string>
+Upstream::status(){
+  std::lock_guard<std::mutex> lk(m);
+  return {name, sock.size()? sock : addr + ":" + port,
+          checked? (up? "up":"down") : "unknown",
+          type_to_str(devs.size()), err};
+}
+
+void
+Upstream::check(){
+  std::unique_ptr<Conn> c;
+  {
+    std::lock_guard<std::mutex> lk(m);
+    c = take_idle();
+  }
+  std::vector<std::string> ds;
+  std::string e1;
+  try {
+    auto l = call(*c, "/list");
+    size_t p1 = 0, p2;
+    while ((p2 = l.find('\n', p1)) != std::string::npos){
+      if (p2>p1) ds.push_back(l.substr(p1, p2-p1));
+      p1 = p2+1;
+    }
+  }
+  catch (Err & e) { e1 = e.str(); }
+
+  bool changed;
+  {
+    std::lock_guard<std::mutex> lk(m);
+    changed = !checked || up != e1.empty();
+    checked = true;
+    up = e1.empty();
+    err = e1;
+    devs = ds;
+    last_check = clock_t::now();
+    give_idle(std::move(c));
+  }
+  if (changed && e1.empty())
+    Log(1) << errpref << "server is up, " << ds.size() << " devices";
+  if (changed && !e1.empty())
+    Log(1) << errpref << "server is down: " << e1;
+}
+
+void
+Upstream::check_loop(){
+  std::unique_lock<std::mutex> lk(m);
+  while (!stop){
+    auto now = clock_t::now();
+    // a server which is down is checked at least every second
+    double per = (checked && !up) ? std::min(check_period, 1.0) : check_period;
+    if (now - last_check >= std::chrono::duration<double>(per)){
+      lk.unlock();
+      check();
+      lk.lock();
+      continue;
+    }
+
+    // ping idle connections, otherwise the server closes them
+    auto t_ping = now - std::chrono::duration_cast<clock_t::duration>(
+      std::chrono::duration<double>(check_period));
+    for (auto & a: active){
+      auto & c = *a.second;
+      if (c.busy || !c.h.is_open() || c.last > t_ping) continue;
+      c.busy = true; // the entry is not erased while it is busy
+      lk.unlock();
+      try { call(c, "/ping"); }
+      catch (Err & e) { c.h.close(); }
+      lk.lock();
+      c.busy = false;
+      cv.notify_all();
+    }
+    std::vector<std::unique_ptr<Conn> > ping;
+    for (auto i = idle.begin(); i != idle.end();){
+      if ((*i)->last > t_ping) {++i; continue;}
+      ping.push_back(std::move(*i));
+      i = idle.erase(i);
+    }
+    if (ping.size()){
+      lk.unlock();
+      for (auto & c: ping){
+        try { call(*c, "/ping"); }
+        catch (Err & e) { c->h.close(); }
+      }
+      lk.lock();
+      for (auto & c: ping) give_idle(std::move(c));
+    }
+    cv.wait_for(lk, std::chrono::milliseconds(100));
+  }
+}
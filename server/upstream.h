@@ -0,0 +1,130 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include "opt/opt.h"
+#include "drv_device2.h"
+
+/*************************************************/
+/*
+Upstream device server for federated routing (`upstream` and `route`
+lines in the device list file).
+
+Requests of each client go through its own keep-alive connection to the
+upstream server, so the client keeps its state there (devices in use,
+locks, logs, connection name). When the client disconnects its devices
+are released on the upstream server and the connection goes to a pool
+of idle connections, to be reused by other clients without a new TCP
+handshake. If the client disconnects while its request is running, the
+upstream connection is closed, and the upstream server cancels the
+request.
+
+A background thread checks the server every `-check_period` seconds:
+it reads the device list (cached for list/devices actions) and pings
+idle connections (otherwise the server would close them). While the
+server is down requests fail immediately.
+
+Parameters:
+
+* `-addr <v>`      -- Server address. Default: localhost.
+* `-port <N>`      -- Server port. Default: 8082.
+* `-socket <v>`    -- Connect to the server through a unix domain socket
+                      instead of TCP. Default: empty.
+* `-timeout <N>`   -- Request timeout, seconds. Default: 20.0.
+* `-connect_timeout <N>` -- Connection timeout, seconds. Default: 5.0.
+* `-check_period <N>` -- Period of health checks, seconds. Default: 5.0.
+* `-max_idle <N>`  -- Max number of idle connections in the pool. Default: 4.
+*/
+
+class Upstream {
+  std::string name, addr, port, sock, errpref;
+  double timeout, connect_timeout, check_period;
+  size_t max_idle;
+  Opt opts;
+
+  typedef std::chrono::steady_clock clock_t;
+
+  struct Conn {
+    HttpConn h;
+    bool busy;
+    clock_t::time_point last; // time of the last request
+    std::string cname; // client connection name, set when the connection opens
+    Conn(): busy(false) {}
+  };
+  std::map<uint64_t, std::unique_ptr<Conn> > active; // connections of clients
+  std::vector<std::unique_ptr<Conn> > idle; // pool of idle connections
+
+  // health check results
+  bool checked, up;
+  std::string err;
+  std::vector<std::string> devs;
+  clock_t::time_point last_check;
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread thr;
+  bool stop;
+
+  // Do a request through a connection (open it if needed, repeat
+  // the request if a keep-alive connection was closed by the server).
+  // Return 200 answer, throw Err with the upstream message for 400,
+  // Err(ERR_SUPERSEDED) for 409, ErrBusy for 503 answers, Err with the
+  // error prefix for other errors. The connection is closed if `alive`
+  // function is set and returns false while waiting for the answer.
+  std::string call(Conn & c, const std::string & url,
+    const std::function<bool()> & alive = std::function<bool()>());
+
+  // Connection for a server request: idle one from the pool or a new one.
+  // Should be called with locked mutex.
+  std::unique_ptr<Conn> take_idle();
+
+  // Return a connection to the pool (or close it).
+  // Should be called with locked mutex.
+  void give_idle(std::unique_ptr<Conn> c);
+
+  // Read the device list, update server status.
+  void check();
+
+  // Check the server, ping idle connections.
+  void check_loop();
+
+public:
+  Upstream(const std::string & name, const Opt & opts);
+  ~Upstream();
+
+  const Opt & options() const {return opts;}
+
+  // Forward a request of client connection `conn` to the server.
+  // GET arguments `args` (priority, deadline) are forwarded too.
+  // Connection name `cname` (empty for the default name) is set on
+  // the server if it is changed or a new connection is opened.
+  // The request is cancelled if `alive` function returns false.
+  std::string request(const uint64_t conn, const std::string & cname,
+    const std::string & act, const std::string & arg,
+    const std::string & msg, const Opt & args,
+    const std::function<bool()> & alive = std::function<bool()>());
+
+  // Release all devices used by the client, reset connection name.
+  void release_all(const uint64_t conn);
+
+  // Client disconnected: release its devices,
+  // return its connection to the pool.
+  void conn_close(const uint64_t conn);
+
+  // Cached device list (empty if the server is down).
+  std::vector<std::string> devices();
+
+  // Server status for the `upstreams` action:
+  // name, address, up/down, number of devices, error.
+  std::vector<std::string> status();
+};
+
+#endif
@@ -6,30 +6,132 @@ package require http
 ##
 ## Usage:
 ##  set Device2::addr http://localhost:8082
+##  or
+##  set Device2::addr unix:/run/device2/device_d.sock
 ##  Device2::get list {} {}
 ##  Device2::get ask graphene get_time
 ##  ...
 ##  or
 ##  Device2::list
 ##  Device2::ask graphene get_time
+##  Device2::multi_ask dev1 *IDN? dev2 *IDN?
+##  Device2::get_async {my_callback} ask graphene get_time
 
 namespace eval Device2 {
-  # Server address. Updated from /etc/device_c.cfg
+  # Server address: http://<host>:<port> or unix:<socket path>.
+  # Updated from /etc/device_c.cfg
   set addr [exec device_c get_srv]
 
-  # nutmeat
-  proc get {act dev args} {
+  # Unix domain sockets (requires unix_sockets package)
+  proc unix_connect {args} {
+    return [unix_sockets::connect [string range $Device2::addr 5 end]]
+  }
+  if {![catch {package require unix_sockets}]} {
+    http::register unix 80 Device2::unix_connect
+  }
+
+  # base url
+  proc base {} {
+    if {[string match unix:* $Device2::addr]} {return unix://localhost}
+    return $Device2::addr
+  }
+
+  # build url for a request
+  proc url {act dev args} {
     set act [http::quoteString $act]
     set dev [http::quoteString $dev]
     set msg [http::quoteString [join $args { }]]
-    set url "$Device2::addr/$act/$dev/$msg"
-    set token [::http::geturl $url -keepalive true]
-    set code [::http::ncode $token]
-    set err  [::http::error $token]
-    set data [::http::data $token]
+    return "[Device2::base]/$act/$dev/$msg"
+  }
+
+  # Number of retries if the device is busy (server returns 503 code).
+  # Delay is taken from Retry-After header (1..10 s).
+  set retries 3
+
+  # nutmeat
+  proc get {act dev args} {
+    set url [Device2::url $act $dev {*}$args]
+    for {set i 0} {1} {incr i} {
+      set token [::http::geturl $url -keepalive true]
+      set code [::http::ncode $token]
+      set err  [::http::error $token]
+      set data [::http::data $token]
+      array set meta [::http::meta $token]
+      http::cleanup $token
+      if {$code == 503 && $i < $Device2::retries} {
+        set t 1
+        if {[::info exists meta(Retry-After)] && [string is integer -strict $meta(Retry-After)]} {
+          set t [expr {min(max($meta(Retry-After),1),10)}]
+        }
+        after [expr {$t*1000}]
+        continue
+      }
+      if {$code != 200} {error $data}
+      return $data
+    }
+  }
+
+  # Asynchronous request. Returns immediately, when the answer is
+  # received (in the event loop) <command> is called with two extra
+  # arguments: 0 and the answer on success, 1 and error message on error.
+  # Each request uses its own connection, thus requests to different
+  # devices are processed by the server in parallel.
+  proc get_async {command act dev args} {
+    set url [Device2::url $act $dev {*}$args]
+    ::http::geturl $url -keepalive false\
+      -command [::list Device2::async_done $command]
+  }
+
+  proc async_done {command token} {
+    if {[::http::status $token] != "ok"} {
+      set ret 1
+      set data [::http::error $token]
+      if {$data == {}} {set data [::http::status $token]}
+    } else {
+      set ret [expr {[::http::ncode $token] != 200}]
+      set data [::http::data $token]
+    }
     http::cleanup $token
-    if {$code != 200} {error $data}
-    return $data
+    uplevel #0 [::list {*}$command $ret $data]
+  }
+
+  # Send messages to a few devices in parallel, wait for all answers.
+  # Usage: multi_ask <dev1> <msg1> <dev2> <msg2> ...
+  # Returns list of answers in the same order. If some requests fail,
+  # error with the first error message is raised.
+  variable multi
+  set multi(id) 0
+  proc multi_ask {args} {
+    variable multi
+    if {[llength $args] % 2} {error "multi_ask: pairs of device and message expected"}
+    set id [incr multi(id)]
+    set multi($id,left) [expr {[llength $args]/2}]
+    set n 0
+    foreach {dev msg} $args {
+      if {[catch {get_async [::list Device2::multi_done $id $n] ask $dev $msg} err]} {
+        multi_done $id $n 1 $err
+      }
+      incr n
+    }
+    while {$multi($id,left) > 0} {vwait Device2::multi($id,left)}
+
+    set ret {}
+    set err {}
+    for {set i 0} {$i < $n} {incr i} {
+      lassign $multi($id,$i) e data
+      if {$e && $err == {}} {set err $data}
+      lappend ret $data
+      unset multi($id,$i)
+    }
+    unset multi($id,left)
+    if {$err != {}} {error $err}
+    return $ret
+  }
+
+  proc multi_done {id n ret data} {
+    variable multi
+    set multi($id,$n) [::list $ret $data]
+    incr multi($id,left) -1
   }
 
   # syntactic sugar